@@ -1,21 +1,354 @@
 #include "GritVM.hpp"
+#include "GritVMProfiler.hpp"
+#include "GritVMHeatmap.hpp"
+#include "GritVMTrace.hpp"
+#include "GritVMMetrics.hpp"
+#include "GritVMReplay.hpp"
+#include "GritVMAnalysis.hpp"
+#include "GritVMOptimize.hpp"
+#include "GritVMInput.hpp"
+#include <algorithm>
+#include <chrono>
+#include <exception>
+#include <filesystem>
 #include <iostream>
+#include <limits>
 #include <sstream>
 
+namespace {
+    // Hooks for the interpreter specializations, called before each instruction
+    // and around data memory accesses
+    // unchecked: cell accesses skip validateMemoryAccess() and go through
+    // cell(), because guard pages catch a bad one (GuardedHooks) or none of
+    // them can be bad (ResolvedHooks)
+    struct PlainHooks {
+        static constexpr bool unchecked = false;
+        void read(long) {}
+        void write(long, long, long) {}
+        void insert(long, size_t) {}
+        void erase(long, size_t) {}
+        void executed(size_t) {}
+        bool stopping() const { return false; }
+    };
+
+    struct HeatmapHooks {
+        static constexpr bool unchecked = false;
+        MemoryHeatmap& heatmap;
+        void read(long cell) { heatmap.recordRead(cell); }
+        void write(long cell, long, long) { heatmap.recordWrite(cell); }
+        void insert(long cell, size_t size) { heatmap.recordInsert(cell, size); }
+        void erase(long cell, size_t size) { heatmap.recordErase(cell, size); }
+        void executed(size_t) {}
+        bool stopping() const { return false; }
+    };
+
+    // Debugging specialization: stops the run once a watched cell is written,
+    // or once retired reaches target for runUntil(). Also feeds the heatmap
+    // and the execution counts when they are attached
+    struct WatchHooks {
+        static constexpr bool unchecked = false;
+        const std::set<size_t>& watches;
+        const DataMemory& memory;
+        const long& accumulator;
+        const size_t& pc;
+        MemoryHeatmap* heatmap;
+        std::vector<unsigned long>* counts;
+        WatchHit& hit;
+        const unsigned long& retired;
+        unsigned long target;
+        bool fired = false;
+
+        void read(long cell) {
+            if (heatmap) heatmap->recordRead(cell);
+        }
+        void write(long cell, long oldValue, long newValue) {
+            if (heatmap) heatmap->recordWrite(cell);
+            if (watches.count(cell)) fire(cell, oldValue, newValue);
+        }
+        // Each index from cell up takes the value below it, the accumulator at cell
+        void insert(long cell, size_t size) {
+            if (heatmap) heatmap->recordInsert(cell, size);
+            auto watched = watches.lower_bound(cell);
+            if (watched != watches.end() && *watched <= size) {
+                size_t at = *watched;
+                fire(at, (at < size) ? memory[at] : 0, (at == static_cast<size_t>(cell)) ? accumulator : memory[at - 1]);
+            }
+        }
+        // Each index from cell up takes the value above it
+        void erase(long cell, size_t size) {
+            if (heatmap) heatmap->recordErase(cell, size);
+            auto watched = watches.lower_bound(cell);
+            if (watched != watches.end() && *watched < size) {
+                size_t at = *watched;
+                fire(at, memory[at], (at + 1 < size) ? memory[at + 1] : 0);
+            }
+        }
+        // A streamed program can outgrow counts mid-run
+        void executed(size_t at) {
+            if (counts && at < counts->size()) (*counts)[at]++;
+        }
+        // Keep the lowest cell when one instruction writes several
+        void fire(size_t cell, long oldValue, long newValue) {
+            if (fired) return;
+            fired = true;
+            hit = WatchHit{ cell, pc, oldValue, newValue };
+        }
+        bool stopping() const { return fired || retired >= target; }
+    };
+
+    // Entry code of an optimized tier: CHECKMEM cells, CLEAR, ADDCONST accumulator, JUMPREL to the loop
+    const size_t TIER_PREFIX = 4;
+
+    // Source of GritVM::programId(), shared by every VM so ids never repeat
+    std::atomic<uint64_t> nextProgramId{1};
+
+    // The loaded program's form of an instruction of the optimized one
+    INSTRUCTION_SET checkedForm(INSTRUCTION_SET op) {
+        switch (op) {
+            case ATRAW:  return AT;
+            case SETRAW: return SET;
+            case ADDRAW: return ADDMEM;
+            case SUBRAW: return SUBMEM;
+            case MULRAW: return MULMEM;
+            case DIVRAW: return DIVMEM;
+            default:     return op;
+        }
+    }
+
+    struct GuardedHooks : PlainHooks {
+        static constexpr bool unchecked = true;
+        DataMemory& memory;
+        long& cell(long location) { return memory.at(location); }
+    };
+
+    // A program that cannot move cells, over memory holding every cell it
+    // names: each cell operand is an offset from the first cell, checked once
+    struct ResolvedHooks : PlainHooks {
+        static constexpr bool unchecked = true;
+        long* cells;
+        long& cell(long location) { return cells[location]; }
+    };
+
+    // Reports how a load ended to GVMMetrics when it goes out of scope
+    struct LoadMetric {
+        const STATUS& status;
+        std::chrono::steady_clock::time_point start;
+
+        explicit LoadMetric(const STATUS& status) : status(status), start(std::chrono::steady_clock::now()) {}
+        ~LoadMetric() {
+            if (std::uncaught_exceptions() == 0) {
+                GVMMetrics::recordLoad(status, std::chrono::steady_clock::now() - start);
+            }
+        }
+    };
+}
+
 // Constructor
-GritVM::GritVM() {
+GritVM::GritVM() : loadedId(0), publishedPc(0), instructionBudget(std::numeric_limits<unsigned long>::max()),
+                   nextCheckpoint(std::numeric_limits<unsigned long>::max()),
+                   profiler(nullptr), heatmap(nullptr), executionCounts(nullptr), recorder(nullptr), tierAfter(0),
+                   nextTierUp(std::numeric_limits<unsigned long>::max()), interpreted(nullptr),
+                   interpretedSize(0), watchFired(false),
+                   streamStatus(WAITING), streamDecoded(0), streamStop(false) {
+    setLimits(std::numeric_limits<size_t>::max(), std::numeric_limits<unsigned long>::max());
     reset();
 }
 
+// Destructor, the parser thread writes into instructMem so it must finish first
+GritVM::~GritVM() {
+    stopStreaming();
+}
+
 // Reset the VM
 STATUS GritVM::reset() {
+    stopStreaming();
     accumulator = 0;
+    std::fill(std::begin(scratch), std::end(scratch), 0);
     dataMem.clear();
     instructMem.clear();
+    sharedProgram.reset();
+    breakpoints.clear();
+    tierBlocked = false;
+    tierCode.clear();
+    tierOrigins.clear();
+    tierHeader = std::numeric_limits<size_t>::max();
+    watches.clear();
+    watchFired = false;
+    program = nullptr;
+    programSize = 0;
+    resolvableCells = std::numeric_limits<size_t>::max();
+    operandCells = std::numeric_limits<size_t>::max();
+    pc = 0;
+    retired = 0;
+    lastFault = Fault();
     machineStatus = WAITING;
     return machineStatus;
 }
 
+// Token checked by run() on backward jumps
+void GritVM::setCancellationToken(std::shared_ptr<const CancellationToken> token) {
+    cancelToken = std::move(token);
+}
+
+void GritVM::setInput(std::shared_ptr<InputSource> source) {
+    input = std::move(source);
+}
+
+void GritVM::setLimits(size_t maxCells, unsigned long maxInstructions) {
+    memoryLimit = maxCells;
+    instructionLimit = maxInstructions;
+    updateStop();
+}
+
+void GritVM::setInstructionBudget(unsigned long instructions) {
+    instructionBudget = instructions;
+    updateStop();
+}
+
+// Backward jumps only look further when retired reaches this
+void GritVM::updateStop() {
+    instructionStop = std::min({ instructionLimit, instructionBudget, nextCheckpoint, nextTierUp });
+}
+
+void GritVM::setTiering(unsigned long hotAfter) {
+    tierAfter = hotAfter;
+}
+
+void GritVM::setRecorder(ExecutionRecorder* checkpoints) {
+    recorder = checkpoints;
+    nextCheckpoint = recorder ? retired + recorder->interval() : std::numeric_limits<unsigned long>::max();
+    updateStop();
+}
+
+STATUS GritVM::resumeAt(size_t position, long value, unsigned long instructions, GVMView<long> registers) {
+    if (machineStatus != READY || position >= programSize) {
+        return machineStatus;
+    }
+    pc = position;
+    accumulator = value;
+    std::copy(registers.begin(), registers.begin() + std::min(registers.size, GVM_SCRATCH_REGISTERS), scratch);
+    retired = instructions;
+    machineStatus = PAUSED;
+    return machineStatus;
+}
+
+unsigned long GritVM::instructionsRetired() const {
+    return retired;
+}
+
+void GritVM::setProfiler(SamplingProfiler* sampler, const std::string& programName) {
+    profiler = sampler;
+    profileName = programName;
+}
+
+void GritVM::setHeatmap(MemoryHeatmap* counts) {
+    heatmap = counts;
+}
+
+void GritVM::setExecutionCounts(std::vector<unsigned long>* counts) {
+    executionCounts = counts;
+}
+
+bool GritVM::setGuardPages(bool on) {
+    return dataMem.setBackend(on ? DataMemory::GUARDED : DataMemory::HEAP);
+}
+
+bool GritVM::setMappedMemory(const std::string& file) {
+    return dataMem.setBackend(DataMemory::MAPPED, file);
+}
+
+GVMView<Instruction> GritVM::getProgram() const {
+    return GVMView<Instruction>(program, programSize);
+}
+
+// A replay has no breakpoints to step over, so it gets the instructions the traps cover
+GVMView<Instruction> GritVM::recordedProgram(std::vector<Instruction>& unpatched) const {
+    if (breakpoints.empty()) {
+        return getProgram();
+    }
+    unpatched.assign(program, program + programSize);
+    for (auto& saved : breakpoints) {
+        unpatched[saved.first] = saved.second;
+    }
+    return GVMView<Instruction>(unpatched.data(), unpatched.size());
+}
+
+// Patch a trap over the instruction, keeping the original to execute on resume
+bool GritVM::setBreakpoint(size_t index) {
+    if (index >= programSize && !(streamStatus.load() != WAITING && waitForInstruction(index))) {
+        return false;
+    }
+    if (breakpoints.count(index)) {
+        return true;
+    }
+    if (program != instructMem.data()) {
+        // Attached programs may be shared with other VMs, patch a private copy
+        instructMem.assign(program, program + programSize);
+        program = instructMem.data();
+        sharedProgram.reset();
+    }
+    breakpoints.emplace(index, instructMem[index]);
+    instructMem[index] = Instruction(BREAKPOINT);
+    return true;
+}
+
+bool GritVM::clearBreakpoint(size_t index) {
+    auto found = breakpoints.find(index);
+    if (found == breakpoints.end()) {
+        return false;
+    }
+    instructMem[index] = found->second;
+    breakpoints.erase(found);
+    return true;
+}
+
+void GritVM::clearBreakpoints() {
+    for (auto& saved : breakpoints) {
+        instructMem[saved.first] = saved.second;
+    }
+    breakpoints.clear();
+}
+
+bool GritVM::atBreakpoint() const {
+    return machineStatus == PAUSED && pc < programSize && program[pc].operation == BREAKPOINT;
+}
+
+void GritVM::watchCell(size_t cell) {
+    watches.insert(cell);
+}
+
+bool GritVM::unwatchCell(size_t cell) {
+    return watches.erase(cell) > 0;
+}
+
+void GritVM::clearWatches() {
+    watches.clear();
+}
+
+// Sized from GVMAnalysis::peakGrowth(), so INSERT never has to reallocate
+void GritVM::reserveMemory(GVMView<Instruction> code, size_t initialCells) {
+    dataMem.clear();
+    size_t growth;
+    if (GVMAnalysis::peakGrowth(code, growth)) {
+        dataMem.reserve(std::min(initialCells + growth, memoryLimit));
+    }
+}
+
+// Cells stay put for the whole run when nothing can INSERT or ERASE, so one
+// size check at the start of a run stands for every access's bounds check.
+// Otherwise guard pages out to the highest operand stand for them.
+// Only called on a whole program about to become READY; every load starts
+// from max, so nothing is skipped for code that is not known yet
+void GritVM::resolveOperands(GVMView<Instruction> code) {
+    size_t cells;
+    if (!code.empty() && GVMAnalysis::cellReach(code, cells)) {
+        operandCells = cells;
+        if (GVMAnalysis::hasFixedLayout(code)) {
+            resolvableCells = cells;
+        }
+    }
+}
+
 // Check valid memory access
 bool GritVM::validateMemoryAccess(long location) const {
     return (location >= 0 && static_cast<size_t>(location) < dataMem.size());
@@ -26,49 +359,323 @@ STATUS GritVM::load(const std::string filename, const std::vector<long>& initial
     if (machineStatus != WAITING) {
         return machineStatus;
     }
+    GVMTrace::Span span("load", filename);
+    resolvableCells = std::numeric_limits<size_t>::max();
+    operandCells = std::numeric_limits<size_t>::max();
+    LoadMetric metric(machineStatus);
 
-    std::ifstream file(filename);
+    std::ifstream file;
+    {
+        GVMTrace::Span open("open", filename);
+        file.open(filename);
+    }
     if (!file) {
         throw std::runtime_error("Unable to open file: " + filename);
     }
 
     instructMem.clear();
+    bool parsed;
+    {
+        GVMTrace::Span parse("parse", filename);
+        parsed = GVMHelper::parseProgram(file, instructMem);
+    }
+    if (!parsed) {
+        // The bad line is the one after the last instruction decoded
+        fail(FAULT_BAD_INSTRUCTION, instructMem.size());
+        return machineStatus;
+    }
+
+    if (initialMemory.size() > memoryLimit) {
+        fail(FAULT_MEMORY_LIMIT, 0);
+        lastFault.memorySize = initialMemory.size();
+        return machineStatus;
+    }
+
+    reserveMemory(GVMView<Instruction>(instructMem.data(), instructMem.size()), initialMemory.size());
+    resolveOperands(GVMView<Instruction>(instructMem.data(), instructMem.size()));
+    dataMem = initialMemory;
+    program = instructMem.data();
+    programSize = instructMem.size();
+    loadedId = nextProgramId.fetch_add(1);
+    pc = 0;
+    retired = 0;
+    machineStatus = instructMem.empty() ? WAITING : READY;
+
+    return machineStatus;
+}
+
+// Attach a program decoded elsewhere, the VM only keeps a reference to it
+STATUS GritVM::load(std::shared_ptr<const Instruction> decoded, size_t count,
+                    const std::vector<long>& initialMemory) {
+    if (machineStatus != WAITING) {
+        return machineStatus;
+    }
+    GVMTrace::Span span("attach");
+    resolvableCells = std::numeric_limits<size_t>::max();
+    operandCells = std::numeric_limits<size_t>::max();
+    LoadMetric metric(machineStatus);
+
+    if (initialMemory.size() > memoryLimit) {
+        fail(FAULT_MEMORY_LIMIT, 0);
+        lastFault.memorySize = initialMemory.size();
+        return machineStatus;
+    }
+
+    instructMem.clear();
+    sharedProgram = std::move(decoded);
+    program = sharedProgram.get();
+    programSize = program ? count : 0;
+    reserveMemory(GVMView<Instruction>(program, programSize), initialMemory.size());
+    resolveOperands(GVMView<Instruction>(program, programSize));
+    dataMem = initialMemory;
+    loadedId = nextProgramId.fetch_add(1);
+    pc = 0;
+    retired = 0;
+    machineStatus = (programSize == 0) ? WAITING : READY;
+
+    return machineStatus;
+}
+
+// Start decoding in the background and hand back control after the first instruction
+STATUS GritVM::loadStreaming(const std::string filename, const std::vector<long>& initialMemory) {
+    if (machineStatus != WAITING) {
+        return machineStatus;
+    }
+    GVMTrace::Span span("load-streaming", filename);
+    resolvableCells = std::numeric_limits<size_t>::max();
+    operandCells = std::numeric_limits<size_t>::max();
+    LoadMetric metric(machineStatus);
+
+    std::ifstream file(filename);
+    std::error_code error;
+    std::uintmax_t bytes = std::filesystem::file_size(filename, error);
+    if (!file || error) {
+        throw std::runtime_error("Unable to open file: " + filename);
+    }
+    if (initialMemory.size() > memoryLimit) {
+        fail(FAULT_MEMORY_LIMIT, 0);
+        lastFault.memorySize = initialMemory.size();
+        return machineStatus;
+    }
+
+    // Every instruction line takes at least 3 bytes ("AT\n"), so this capacity
+    // holds the file as it is now. The parser never appends past it, so decoded
+    // instructions never move under the run (see streamParse())
+    instructMem.clear();
+    instructMem.reserve(static_cast<size_t>(bytes / 2 + 1));
+    dataMem = initialMemory;
+    program = instructMem.data();
+    programSize = 0;
+    loadedId = nextProgramId.fetch_add(1);
+    pc = 0;
+    retired = 0;
+
+    streamDecoded.store(0);
+    streamStop.store(false);
+    streamStatus.store(RUNNING);
+    streamThread = std::thread(&GritVM::streamParse, this, std::move(file));
+
+    if (!waitForInstruction(0)) {
+        if (streamStatus.load() == ERRORED) {
+            fail(FAULT_BAD_INSTRUCTION, 0);
+        }
+        // Nothing to run: the parser is done, join it so the next load starts clean
+        stopStreaming();
+        programSize = 0;
+        return machineStatus;
+    }
+    machineStatus = READY;
+    return machineStatus;
+}
+
+// Parser thread: decode line by line, publishing each instruction as it is appended
+void GritVM::streamParse(std::ifstream file) {
+    GVMTrace::Span span("stream-parse");
+    const size_t notifyEvery = 1024;
     std::string line;
-    while (std::getline(file, line)) {
+    STATUS result = READY;
+
+    while (!streamStop.load(std::memory_order_relaxed) && std::getline(file, line)) {
         if (line.empty() || line[0] == '#') continue;
         Instruction inst = GVMHelper::parseInstruction(line);
-        if (inst.operation == UNKNOWN_INSTRUCTION) {
-            machineStatus = ERRORED;
-            return machineStatus;
+        // A full buffer means the file grew after it was sized; appending
+        // would move the instructions the run is executing, so that fails too
+        if (inst.operation == UNKNOWN_INSTRUCTION || instructMem.size() == instructMem.capacity()) {
+            result = ERRORED;
+            break;
         }
         instructMem.push_back(inst);
+        streamDecoded.store(instructMem.size(), std::memory_order_release);
+
+        if (instructMem.size() % notifyEvery == 1) {
+            std::lock_guard<std::mutex> lock(streamMutex);
+            streamProgress.notify_all();
+        }
     }
 
-    dataMem = initialMemory;
-    machineStatus = instructMem.empty() ? WAITING : READY;
-    if (!instructMem.empty()) {
-        currentInstruct = instructMem.begin();
+    std::lock_guard<std::mutex> lock(streamMutex);
+    streamStatus.store(result);
+    streamProgress.notify_all();
+}
+
+// Only reached when execution runs off the end of the decoded code
+bool GritVM::waitForInstruction(size_t index) {
+    auto available = [this, index]() {
+        return streamDecoded.load(std::memory_order_acquire) > index || streamStatus.load() != RUNNING;
+    };
+    if (!available()) {
+        std::unique_lock<std::mutex> lock(streamMutex);
+        // Wake up now and then so a cancelled run does not wait for the parser
+        while (!streamProgress.wait_for(lock, std::chrono::milliseconds(10), available)) {
+            if (cancelToken && cancelToken->isCancelled()) {
+                break;
+            }
+        }
     }
+    programSize = streamDecoded.load(std::memory_order_acquire);
+    return index < programSize;
+}
 
-    return machineStatus;
+void GritVM::stopStreaming() {
+    if (streamThread.joinable()) {
+        streamStop.store(true);
+        streamThread.join();
+    }
+    streamStatus.store(WAITING);
 }
 
 // Run the loaded program
 STATUS GritVM::run() {
-    if (machineStatus != READY) {
+    return resume(false, std::numeric_limits<unsigned long>::max());
+}
+
+// Execute one instruction and pause again
+STATUS GritVM::step() {
+    return resume(true, std::numeric_limits<unsigned long>::max());
+}
+
+STATUS GritVM::runUntil(unsigned long instructions) {
+    if ((machineStatus == READY || machineStatus == PAUSED) && retired >= instructions) {
+        machineStatus = PAUSED;
+        return machineStatus;
+    }
+    return resume(false, instructions);
+}
+
+STATUS GritVM::resume(bool stepping, unsigned long until) {
+    bool paused = (machineStatus == PAUSED);
+    if (machineStatus == READY) {
+        pc = 0;
+        if (recorder) {
+            std::vector<Instruction> unpatched;
+            recorder->checkpoint(recordedProgram(unpatched), retired, pc, accumulator, dataMem.view(), getScratch());
+            nextCheckpoint = retired + recorder->interval();
+            updateStop();
+        }
+    } else if (!paused) {
         return machineStatus;
     }
 
     machineStatus = RUNNING;
-    currentInstruct = instructMem.begin();
+    GVMTrace::Span span(stepping ? "step" : "run", profileName);
+    auto start = std::chrono::steady_clock::now();
+    unsigned long retiredBefore = retired;
+    if (profiler) {
+        profiler->enter(*this, profileName);
+    }
+
+    watchFired = false;
+    if (mayTierUp(stepping, until)) {
+        nextTierUp = retired + tierAfter;
+        updateStop();
+    }
+    if (until != std::numeric_limits<unsigned long>::max() || !watches.empty() || executionCounts) {
+        if (executionCounts && executionCounts->size() < programSize) {
+            executionCounts->resize(programSize);
+        }
+        WatchHooks hooks{ watches, dataMem, accumulator, pc, heatmap, executionCounts, watchHit, retired, until };
+        execute(hooks, paused, stepping);
+        watchFired = hooks.fired;
+    } else if (heatmap) {
+        HeatmapHooks hooks{ *heatmap };
+        execute(hooks, paused, stepping);
+    } else if (dataMem.size() >= resolvableCells) {
+        ResolvedHooks hooks{ {}, dataMem.data() };
+        execute(hooks, paused, stepping);
+    } else if (dataMem.guarded() && dataMem.guardReach(operandCells)) {
+        executeGuarded(paused, stepping);
+    } else {
+        PlainHooks hooks;
+        execute(hooks, paused, stepping);
+    }
+    if (interpreted) {
+        tierDown(pc, false);
+    }
+    nextTierUp = std::numeric_limits<unsigned long>::max();
+    updateStop();
+    if (stepping && machineStatus == RUNNING) {
+        machineStatus = PAUSED;
+    }
 
+    if (profiler) {
+        profiler->leave();
+    }
+    GVMMetrics::recordRun(machineStatus, retired - retiredBefore, std::chrono::steady_clock::now() - start);
+    return machineStatus;
+}
+
+void GritVM::executeGuarded(bool overTrap, bool single) {
+#ifdef GVM_HAVE_GUARD_PAGES
+    GuardTrap trap(dataMem);
+    if (sigsetjmp(trap.landing, 0) != 0) {
+        // Nothing of the faulting instruction took effect, and DataMemory::at()
+        // made sure every earlier write reached memory before it
+        fail(FAULT_BAD_ADDRESS, pc);
+        ++retired;
+        return;
+    }
+#endif
+    executeUnchecked(overTrap, single);
+}
+
+void GritVM::executeUnchecked(bool overTrap, bool single) {
+    GuardedHooks hooks{ {}, dataMem };
+    execute(hooks, overTrap, single);
+}
+
+// The interpreter loop proper
+template <class Hooks>
+void GritVM::execute(Hooks& hooks, bool overTrap, bool single) {
+    if (overTrap || single) {
+        // Execute the instruction a breakpoint covers instead of trapping again
+        publishedPc.store(pc, std::memory_order_relaxed);
+        auto saved = (program[pc].operation == BREAKPOINT) ? breakpoints.find(pc) : breakpoints.end();
+        hooks.executed(pc);
+        long jumpDistance = evaluate(saved != breakpoints.end() ? saved->second : program[pc], hooks);
+        ++retired;
+        if (machineStatus == RUNNING) {
+            advance(jumpDistance);
+        }
+        if (single) {
+            return;
+        }
+        if (hooks.stopping() && machineStatus == RUNNING) {
+            machineStatus = PAUSED;
+        }
+    }
     while (machineStatus == RUNNING) {
-        long jumpDistance = evaluate(*currentInstruct);
+        publishedPc.store(pc, std::memory_order_relaxed);
+        hooks.executed(pc);
+        long jumpDistance = evaluate(program[pc], hooks);
+        ++retired;
         if (machineStatus == RUNNING) {
             advance(jumpDistance);
         }
+        // Constant false, and compiled out, for every Hooks but WatchHooks
+        if (hooks.stopping() && machineStatus == RUNNING) {
+            machineStatus = PAUSED;
+        }
     }
-    return machineStatus;
 }
 
 // Handle constant operations
@@ -85,43 +692,80 @@ long GritVM::handleConstOperation(INSTRUCTION_SET operation, long constant) {
             break;
         case DIVCONST:
             if (constant == 0) {
-                machineStatus = ERRORED;
+                fail(FAULT_DIVIDE_BY_ZERO, pc);
                 return 1;
             }
             accumulator /= constant;
             break;
         default:
-            machineStatus = ERRORED;
+            fail(FAULT_BAD_INSTRUCTION, pc);
             break;
     }
     return 1;
 }
 
 // Handle memory operations
-long GritVM::handleMemOperation(INSTRUCTION_SET operation, long memLocation) {
-    if (!validateMemoryAccess(memLocation)) {
-        machineStatus = ERRORED;
-        return 1;
+template <class Hooks>
+long GritVM::handleMemOperation(INSTRUCTION_SET operation, long memLocation, Hooks& hooks) {
+    long value;
+    if constexpr (Hooks::unchecked) {
+        value = hooks.cell(memLocation);
+    } else {
+        value = dataMem[memLocation];
     }
+    hooks.read(memLocation);
     switch (operation) {
-        case ADDMEM:
-            accumulator += dataMem[memLocation];
+        case ADDMEM: case ADDRAW:
+            accumulator += value;
             break;
-        case SUBMEM:
-            accumulator -= dataMem[memLocation];
+        case SUBMEM: case SUBRAW:
+            accumulator -= value;
             break;
-        case MULMEM:
-            accumulator *= dataMem[memLocation];
+        case MULMEM: case MULRAW:
+            accumulator *= value;
             break;
-        case DIVMEM:
-            if (dataMem[memLocation] == 0) {
-                machineStatus = ERRORED;
+        case DIVMEM: case DIVRAW:
+            if (value == 0) {
+                fail(FAULT_DIVIDE_BY_ZERO, pc);
                 return 1;
             }
-            accumulator /= dataMem[memLocation];
+            accumulator /= value;
             break;
         default:
-            machineStatus = ERRORED;
+            fail(FAULT_BAD_INSTRUCTION, pc);
+            break;
+    }
+    return 1;
+}
+
+// Handle scratch register operations
+long GritVM::handleScratchOperation(INSTRUCTION_SET operation, long reg) {
+    if (static_cast<unsigned long>(reg) >= GVM_SCRATCH_REGISTERS) {
+        fail(FAULT_BAD_INSTRUCTION, pc);
+        return 1;
+    }
+    switch (operation) {
+        case SETTMP:
+            scratch[reg] = accumulator;
+            break;
+        case ATTMP:
+            accumulator = scratch[reg];
+            break;
+        case ADDTMP:
+            accumulator += scratch[reg];
+            break;
+        case SUBTMP:
+            accumulator -= scratch[reg];
+            break;
+        case MULTMP:
+            accumulator *= scratch[reg];
+            break;
+        default:
+            if (scratch[reg] == 0) {
+                fail(FAULT_DIVIDE_BY_ZERO, pc);
+                return 1;
+            }
+            accumulator /= scratch[reg];
             break;
     }
     return 1;
@@ -130,7 +774,7 @@ long GritVM::handleMemOperation(INSTRUCTION_SET operation, long memLocation) {
 // Handle jumps
 long GritVM::handleJump(INSTRUCTION_SET operation, long distance) {
     if (distance == 0) {
-        machineStatus = ERRORED;
+        fail(FAULT_ZERO_JUMP, pc);
         return 1;
     }
     switch (operation) {
@@ -141,51 +785,72 @@ long GritVM::handleJump(INSTRUCTION_SET operation, long distance) {
         case JUMPNZERO:
             return (accumulator != 0) ? distance : 1;
         default:
-            machineStatus = ERRORED;
+            fail(FAULT_BAD_INSTRUCTION, pc);
             return 1;
     }
 }
 
 // Evaluate an instruction
-long GritVM::evaluate(const Instruction& inst) {
+template <class Hooks>
+long GritVM::evaluate(const Instruction& inst, Hooks& hooks) {
     switch (inst.operation) {
         case CLEAR:
             accumulator = 0;
             return 1;
         case AT:
+            if constexpr (Hooks::unchecked) {
+                accumulator = hooks.cell(inst.argument);
+                return 1;
+            }
             if (!validateMemoryAccess(inst.argument)) {
-                machineStatus = ERRORED;
+                fail(FAULT_BAD_ADDRESS, pc);
                 return 1;
             }
+            hooks.read(inst.argument);
             accumulator = dataMem[inst.argument];
             return 1;
         case SET:
+            if constexpr (Hooks::unchecked) {
+                hooks.cell(inst.argument) = accumulator;
+                return 1;
+            }
             if (!validateMemoryAccess(inst.argument)) {
-                machineStatus = ERRORED;
+                fail(FAULT_BAD_ADDRESS, pc);
                 return 1;
             }
+            hooks.write(inst.argument, dataMem[inst.argument], accumulator);
             dataMem[inst.argument] = accumulator;
             return 1;
         case INSERT:
             if (static_cast<size_t>(inst.argument) > dataMem.size()) {
-                machineStatus = ERRORED;
+                fail(FAULT_BAD_INSERT, pc);
                 return 1;
             }
-            dataMem.insert(dataMem.begin() + inst.argument, accumulator);
+            if (dataMem.size() >= memoryLimit) {
+                fail(FAULT_MEMORY_LIMIT, pc);
+                return 1;
+            }
+            hooks.insert(inst.argument, dataMem.size());
+            dataMem.insert(inst.argument, accumulator);
             return 1;
         case ERASE:
             if (!validateMemoryAccess(inst.argument)) {
-                machineStatus = ERRORED;
+                fail(FAULT_BAD_ADDRESS, pc);
                 return 1;
             }
-            dataMem.erase(dataMem.begin() + inst.argument);
+            hooks.erase(inst.argument, dataMem.size());
+            dataMem.erase(inst.argument);
             return 1;
 
         case ADDCONST: case SUBCONST: case MULCONST: case DIVCONST:
             return handleConstOperation(inst.operation, inst.argument);
 
         case ADDMEM: case SUBMEM: case MULMEM: case DIVMEM:
-            return handleMemOperation(inst.operation, inst.argument);
+            if (!Hooks::unchecked && !validateMemoryAccess(inst.argument)) {
+                fail(FAULT_BAD_ADDRESS, pc);
+                return 1;
+            }
+            return handleMemOperation(inst.operation, inst.argument, hooks);
 
         case JUMPREL: case JUMPZERO: case JUMPNZERO:
             return handleJump(inst.operation, inst.argument);
@@ -200,57 +865,249 @@ long GritVM::evaluate(const Instruction& inst) {
             return 1;
         case CHECKMEM:
             if (dataMem.size() < static_cast<size_t>(inst.argument)) {
-                machineStatus = ERRORED;
+                fail(FAULT_CHECKMEM, pc);
             }
             return 1;
+        case INPUT:
+            if (input && input->next(accumulator)) {
+                return 1;
+            }
+            if (inst.argument == 0) {
+                machineStatus = HALTED;
+                return 1;
+            }
+            return inst.argument;
+        case BREAKPOINT:
+            trap();
+            return 0;
+
+        case SETTMP: case ATTMP: case ADDTMP: case SUBTMP: case MULTMP: case DIVTMP:
+            return handleScratchOperation(inst.operation, inst.argument);
+
+        // The MEMGUARD in front of the loop these sit in did the bounds check
+        case ATRAW:
+            hooks.read(inst.argument);
+            accumulator = dataMem[inst.argument];
+            return 1;
+        case SETRAW:
+            hooks.write(inst.argument, dataMem[inst.argument], accumulator);
+            dataMem[inst.argument] = accumulator;
+            return 1;
+        case ADDRAW: case SUBRAW: case MULRAW: case DIVRAW:
+            return handleMemOperation(inst.operation, inst.argument, hooks);
+        case MEMGUARD:
+            return (dataMem.size() >= static_cast<size_t>(inst.argument)) ? 1 : 2;
         default:
-            machineStatus = ERRORED;
+            fail(FAULT_BAD_INSTRUCTION, pc);
             return 1;
     }
 }
 
+// Decide whether a backward jump should stop the run, and with which status
+bool GritVM::stopRequested(size_t& target) {
+    if (recorder && retired >= nextCheckpoint) {
+        // The jump has not moved pc yet and changes nothing else, so this is
+        // exactly the state before it executed
+        std::vector<Instruction> unpatched;
+        recorder->checkpoint(recordedProgram(unpatched), retired - 1, pc, accumulator, dataMem.view(), getScratch());
+        nextCheckpoint = retired + recorder->interval();
+        updateStop();
+    }
+    bool cancelled = cancelToken && cancelToken->isCancelled();
+    bool stopping = cancelled || retired > instructionLimit || retired >= instructionBudget;
+    if (retired >= nextTierUp) {
+        nextTierUp = std::numeric_limits<unsigned long>::max();
+        updateStop();
+        if (!stopping && tierUp(target)) {
+            target = 0;
+        }
+    }
+    bool tieredDown = interpreted && stopping;
+    if (tieredDown) {
+        // Stop where the jump lands in the loaded program instead
+        tierDown(target, true);
+    }
+    if (cancelled) {
+        machineStatus = CANCELLED;
+    } else if (retired > instructionLimit) {
+        fail(FAULT_INSTRUCTION_LIMIT, pc);
+    } else if (retired >= instructionBudget) {
+        // The jump has retired, so finish it; run() must not execute and count it again
+        machineStatus = PAUSED;
+        if (!tieredDown) {
+            pc = target;
+        }
+    }
+    return machineStatus != RUNNING;
+}
+
+// Only the plain interpreters tier up; the others count, observe or stop at
+// instructions of the loaded program
+bool GritVM::mayTierUp(bool stepping, unsigned long until) const {
+    return tierAfter != 0 && !tierBlocked && !stepping && until == std::numeric_limits<unsigned long>::max()
+        && watches.empty() && !heatmap && !executionCounts && breakpoints.empty() && !recorder && !profiler
+        && streamStatus.load(std::memory_order_relaxed) == WAITING;
+}
+
+// The optimized program is the loaded one behind entry code that sets the
+// accumulator and jumps to header, so it starts in the state the loaded
+// program has at header. The entry code also has a CHECKMEM of the cells
+// there are now, which cannot fail but lets the optimizer rely on them. It
+// is kept for the next tier up in the same state
+bool GritVM::tierUp(size_t header) {
+    if (header != tierHeader || accumulator != tierAccumulator || dataMem.size() != tierCells) {
+        GVMTrace::Span span("tier-up", profileName);
+        // A backward jump past the start stops at the first instruction, which
+        // in the optimized program would be the entry code
+        for (size_t i = 0; i < programSize; i++) {
+            if (GVMAnalysis::isJump(program[i].operation) && program[i].argument < 0
+                && static_cast<size_t>(-program[i].argument) > i) {
+                tierBlocked = true;
+                return false;
+            }
+        }
+        // Code the run can no longer reach becomes HALT, so the only way into
+        // the loop from outside is the entry code and the loop gets a preheader
+        GVMView<Instruction> code(program, programSize);
+        std::vector<bool> reachable(programSize, false);
+        std::vector<size_t> work = { header };
+        while (!work.empty()) {
+            size_t at = work.back();
+            work.pop_back();
+            if (at >= programSize || reachable[at]) continue;
+            reachable[at] = true;
+            const Instruction& inst = program[at];
+            if (GVMAnalysis::isJump(inst.operation) && inst.argument != 0) {
+                work.push_back(GVMAnalysis::jumpTarget(code, at));
+            }
+            if (inst.operation != HALT && inst.operation != JUMPREL) {
+                work.push_back(at + 1);
+            }
+        }
+        std::vector<Instruction> entry = { Instruction(CHECKMEM, static_cast<long>(dataMem.size())),
+                                           Instruction(CLEAR, 0), Instruction(ADDCONST, accumulator),
+                                           Instruction(JUMPREL, static_cast<long>(header) + 1) };
+        for (size_t i = 0; i < programSize; i++) {
+            entry.push_back(reachable[i] ? program[i] : Instruction(HALT));
+        }
+        if (!GVMOptimize::optimize(GVMView<Instruction>(entry.data(), entry.size()), tierCode, &tierOrigins)) {
+            tierBlocked = true;
+            return false;
+        }
+        tierHeader = header;
+        tierAccumulator = accumulator;
+        tierCells = dataMem.size();
+    }
+    interpreted = program;
+    interpretedSize = programSize;
+    program = tierCode.data();
+    programSize = tierCode.size();
+    return true;
+}
+
+// Values are in their homes where a block starts, so the state there is the
+// loaded program's at the block's origin. A HALT, trap or fault carries the
+// origin of the block or value before it; the instruction itself is the first
+// like it from there
+void GritVM::tierDown(size_t at, bool atBlock) {
+    size_t position = interpretedSize;
+    if (at < tierCode.size() && tierOrigins[at] >= TIER_PREFIX) {
+        position = tierOrigins[at] - TIER_PREFIX;
+        for (size_t i = position; !atBlock && i < interpretedSize; i++) {
+            const Instruction& inst = interpreted[i];
+            if (inst.operation == checkedForm(tierCode[at].operation)
+                && (inst.argument == tierCode[at].argument || inst.operation == HALT)) {
+                position = i;
+                break;
+            }
+        }
+    }
+    program = interpreted;
+    programSize = interpretedSize;
+    interpreted = nullptr;
+    pc = position;
+    if (machineStatus == ERRORED && lastFault.code != FAULT_INSTRUCTION_LIMIT) {
+        lastFault.pc = position;
+        lastFault.operation = (position < programSize) ? program[position].operation : UNKNOWN_INSTRUCTION;
+        lastFault.argument = (position < programSize) ? program[position].argument : 0;
+    }
+}
+
+// Stop in front of the trap; it is not an instruction, so take back the count execute() adds
+void GritVM::trap() {
+    machineStatus = PAUSED;
+    --retired;
+}
+
+// Record the fault, reading the instruction only if it was decoded
+void GritVM::fail(FAULT_CODE code, size_t at) {
+    Instruction faulting(UNKNOWN_INSTRUCTION);
+    if (at < programSize) {
+        auto saved = breakpoints.find(at);
+        faulting = (saved != breakpoints.end()) ? saved->second : program[at];
+    }
+    machineStatus = ERRORED;
+    lastFault.code = code;
+    lastFault.pc = at;
+    lastFault.operation = faulting.operation;
+    lastFault.argument = faulting.argument;
+    lastFault.accumulator = accumulator;
+    lastFault.memorySize = dataMem.size();
+    GVMMetrics::recordFault(code);
+}
+
 // Advance the instruction pointer
 void GritVM::advance(long jumpDistance) {
     if (jumpDistance == 0) {
-        machineStatus = ERRORED;
+        fail(FAULT_ZERO_JUMP, pc);
         return;
     }
-    while (jumpDistance > 0 && currentInstruct != instructMem.end()) {
-        ++currentInstruct;
-        --jumpDistance;
-    }
-    while (jumpDistance < 0 && currentInstruct != instructMem.begin()) {
-        --currentInstruct;
-        ++jumpDistance;
+    // Jumps past the end stop there, jumps before the start stop at the first instruction
+    if (jumpDistance > 0) {
+        size_t distance = static_cast<size_t>(jumpDistance);
+        if (distance >= programSize - pc && streamStatus.load(std::memory_order_relaxed) != WAITING) {
+            // A streaming load may not have decoded the target yet
+            size_t target = pc + std::min(distance, std::numeric_limits<size_t>::max() - pc);
+            if (!waitForInstruction(target)) {
+                if (cancelToken && cancelToken->isCancelled()) {
+                    machineStatus = CANCELLED;
+                    return;
+                }
+                if (streamStatus.load() == ERRORED) {
+                    // The jump target is the line the parser could not decode
+                    fail(FAULT_BAD_INSTRUCTION, programSize);
+                    return;
+                }
+            }
+        }
+        pc += std::min(distance, programSize - pc);
+    } else {
+        // Every loop passes through here, so this is the only place a run can be stopped
+        size_t target = pc - std::min(static_cast<size_t>(-jumpDistance), pc);
+        if ((retired >= instructionStop || cancelToken) && stopRequested(target)) {
+            return;
+        }
+        pc = target;
     }
-    if (currentInstruct == instructMem.end()) {
+    if (pc == programSize) {
         machineStatus = HALTED;
     }
 }
 
 // Return current data memory
 std::vector<long> GritVM::getDataMem() {
-    return dataMem;
+    GVMTrace::Span span("getDataMem");
+    return dataMem.toVector();
+}
+
+VMState GritVM::inspect() const {
+    return VMState{ machineStatus, accumulator, pc,
+                    dataMem.view(), getProgram() };
 }
 
 // Print VM state
 void GritVM::printVM(bool printData, bool printInstruction) const {
-    std::cout << "Status: " << GVMHelper::statusToString(machineStatus) << std::endl;
-    std::cout << "Accumulator: " << accumulator << std::endl;
-
-    if (printData) {
-        std::cout << "*** Data Memory ***" << std::endl;
-        for (size_t i = 0; i < dataMem.size(); ++i) {
-            std::cout << "Location " << i << ": " << dataMem[i] << std::endl;
-        }
-    }
-    if (printInstruction) {
-        std::cout << "*** Instruction Memory ***" << std::endl;
-        int index = 0;
-        for (auto& inst : instructMem) {
-            std::cout << "Instruction " << index++ << ": "
-                      << GVMHelper::instructionToString(inst.operation)
-                      << " " << inst.argument << std::endl;
-        }
-    }
+    char buffer[1 << 16];
+    GVMHelper::formatState(std::cout, inspect(), buffer, sizeof(buffer), printData, printInstruction);
+    std::cout.flush();
 }
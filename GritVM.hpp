@@ -2,25 +2,174 @@
 #define GRITVM_H
 
 #include "GritVMBase.hpp"
-#include <list>
+#include "GritVMMemory.hpp"
 #include <vector>
 #include <string>
 #include <fstream>
+#include <memory>
+#include <atomic>
+#include <cstdint>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <map>
+#include <set>
+
+// Set from any thread to stop the GritVM runs using it. The VM polls it on
+// backward jumps only; code without them finishes within one pass over the program
+class CancellationToken {
+private:
+    std::atomic<bool> cancelled;
+
+public:
+    CancellationToken() : cancelled(false) {}
+
+    void cancel() { cancelled.store(true, std::memory_order_relaxed); }
+    void clear() { cancelled.store(false, std::memory_order_relaxed); }
+    bool isCancelled() const { return cancelled.load(std::memory_order_relaxed); }
+};
+
+// A watched data cell changed value, see GritVM::watchCell()
+struct WatchHit {
+    size_t cell;                                   // Watched index
+    size_t pc;                                     // Instruction that changed it
+    long oldValue;                                 // 0 if the cell did not exist before
+    long newValue;                                 // 0 if the cell no longer exists
+};
+
+class SamplingProfiler;
+class MemoryHeatmap;
+class ExecutionRecorder;
+class InputSource;
 
 class GritVM : public GritVMInterface {
 private:
-    std::vector<long> dataMem;                     // Holds data values
-    std::list<Instruction> instructMem;            // Holds instructions
-    std::list<Instruction>::iterator currentInstruct; 
+    DataMemory dataMem;                            // Holds data values
+    std::vector<Instruction> instructMem;          // Holds instructions decoded by load()
+    std::shared_ptr<const Instruction> sharedProgram; // Keeps an attached program alive
+    const Instruction* program;                    // Instructions being executed
+    size_t programSize;                            // Number of instructions in program
+    uint64_t loadedId;                             // See programId()
+    size_t resolvableCells;                        // Runs over at least this many cells need no bounds checks, max if none do
+    size_t operandCells;                           // Every cell operand is under this, max if unknown or one is negative
+    size_t pc;                                     // Index of the current instruction
+    std::atomic<size_t> publishedPc;               // Copy of pc for samplers on the running thread
     STATUS machineStatus;                          // Current status (WAITING, RUNNING, HALTED, etc.)
     long accumulator;                              // For arithmetic operations
+    long scratch[GVM_SCRATCH_REGISTERS];           // Values optimized code keeps out of data memory
+    std::shared_ptr<const CancellationToken> cancelToken; // Polled on backward jumps, may be null
+    std::shared_ptr<InputSource> input;            // Read by INPUT, may be null
+    Fault lastFault;                               // Why the program last became ERRORED
+
+    // Resource limits, see setLimits() and setInstructionBudget()
+    size_t memoryLimit;                            // Most cells dataMem may hold
+    unsigned long instructionLimit;                // Retiring more makes the run ERRORED
+    unsigned long instructionBudget;               // Retiring more pauses the run
+    unsigned long instructionStop;                 // min(instructionLimit, instructionBudget)
+    unsigned long retired;                         // Instructions executed since load()
+    unsigned long nextCheckpoint;                  // Value of retired to give recorder a checkpoint at
+
+    SamplingProfiler* profiler;                    // Samples this VM's runs, may be null
+    std::string profileName;                       // Program name reported by the profiler
+    MemoryHeatmap* heatmap;                        // Counts data memory accesses, may be null
+    std::vector<unsigned long>* executionCounts;   // Executions of each instruction, may be null
+    ExecutionRecorder* recorder;                   // Checkpoints this VM's runs, may be null
+
+    // Tiered execution, see setTiering()
+    unsigned long tierAfter;                       // Instructions a run retires before tiering up, 0 for never
+    unsigned long nextTierUp;                      // Value of retired to tier up at
+    bool tierBlocked;                              // The loaded program cannot be optimized
+    std::vector<Instruction> tierCode;             // Optimized program entered at tierHeader
+    std::vector<size_t> tierOrigins;               // Instruction of the entry program each came from
+    size_t tierHeader;                             // Loop header tierCode enters at, max if none
+    long tierAccumulator;                          // Accumulator tierCode enters with
+    size_t tierCells;                              // Data memory size tierCode enters with
+    const Instruction* interpreted;                // The loaded program while tierCode runs, else null
+    size_t interpretedSize;
+
+    // Instructions replaced by BREAKPOINT traps, by index
+    std::map<size_t, Instruction> breakpoints;
+
+    std::set<size_t> watches;                      // Watched data memory indices
+    WatchHit watchHit;                             // The last watch to fire
+    bool watchFired;                               // Paused by that watch
+
+    // Slow path of advance() once a backward jump to target finds a stop
+    // condition; moves target when the run changes tiers
+    bool stopRequested(size_t& target);
+
+    // True if the run about to start may move to the optimized tier
+    bool mayTierUp(bool stepping, unsigned long until) const;
+
+    // Continue the run in an optimized program entered at header of the loaded one
+    // with the current state, false (staying put) if there is none
+    bool tierUp(size_t header);
+
+    // Go back to the loaded program with the state the optimized one has at at;
+    // atBlock when at is where a jump lands, otherwise the instruction that
+    // stopped the run
+    void tierDown(size_t at, bool atBlock);
+
+    // Error path: record the machine state at instruction at and become ERRORED.
+    // Only called once something has failed, so it costs nothing when nothing does
+    GVM_COLD void fail(FAULT_CODE code, size_t at);
+
+    // Background decoding for loadStreaming()
+    std::thread streamThread;                      // Parser filling instructMem
+    std::atomic<STATUS> streamStatus;              // RUNNING while parsing, READY/ERRORED when done, WAITING if unused
+    std::atomic<size_t> streamDecoded;             // Instructions the parser has published
+    std::atomic<bool> streamStop;                  // Asks the parser to give up early
+    std::mutex streamMutex;
+    std::condition_variable streamProgress;
+
+    // Parser thread body for loadStreaming()
+    void streamParse(std::ifstream file);
+
+    // Block until instruction index is decoded or parsing ends, false if it never will be
+    bool waitForInstruction(size_t index);
+
+    // Stop and join the parser thread
+    void stopStreaming();
+
+    // The program for recorder: the loaded one, or a copy in unpatched with
+    // the original instructions in place of any breakpoint traps
+    GVMView<Instruction> recordedProgram(std::vector<Instruction>& unpatched) const;
+
+    // Recompute instructionStop after a limit, budget or checkpoint changes
+    void updateStop();
+
+    // Shared by run(), step() and runUntil()
+    STATUS resume(bool stepping, unsigned long until);
+
+    // Plain execute() over guard-paged memory, turning a fault on the guard page into ERRORED
+    void executeGuarded(bool overTrap, bool single);
+
+    // The execute() of executeGuarded(), never inlined into it so its sigsetjmp
+    // leaves the loop's state in registers
+    GVM_NOINLINE void executeUnchecked(bool overTrap, bool single);
+
+    // Interpreter loop, specialized on Hooks that observe data memory accesses
+    // (see the Hooks structs in GritVM.cpp); the plain specialization observes nothing.
+    // The first instruction is stepped over when resuming from a breakpoint or stepping
+    template <class Hooks>
+    void execute(Hooks& hooks, bool overTrap, bool single);
+
+    // A BREAKPOINT was reached
+    GVM_COLD void trap();
 
     // Evaluate the current instruction and decide how many steps to move
-    long evaluate(const Instruction& inst);
+    template <class Hooks>
+    long evaluate(const Instruction& inst, Hooks& hooks);
 
     // Move the instruction pointer by jumpDistance
     void advance(long jumpDistance);
 
+    // Clear data memory and reserve room for initialCells plus all program can INSERT
+    void reserveMemory(GVMView<Instruction> code, size_t initialCells);
+
+    // Set resolvableCells and operandCells for code, see GVMAnalysis::cellSpan()
+    void resolveOperands(GVMView<Instruction> code);
+
     // Check if memory access is valid
     bool validateMemoryAccess(long location) const;
 
@@ -28,7 +177,11 @@ private:
     long handleConstOperation(INSTRUCTION_SET op, long constant);
 
     // Handle operations with memory locations
-    long handleMemOperation(INSTRUCTION_SET op, long memLocation);
+    template <class Hooks>
+    long handleMemOperation(INSTRUCTION_SET op, long memLocation, Hooks& hooks);
+
+    // Handle scratch register operations of optimized programs
+    long handleScratchOperation(INSTRUCTION_SET op, long reg);
 
     // Handle jump instructions
     long handleJump(INSTRUCTION_SET op, long distance);
@@ -40,7 +193,24 @@ public:
     // Load GVM program from a file and initialize data memory
     STATUS load(const std::string filename, const std::vector<long>& initialMemory) override;
 
-    // Run the loaded program
+    // Execute an already decoded program in place (e.g. a mapped SharedProgram)
+    // without copying it; the VM holds a reference until reset()
+    STATUS load(std::shared_ptr<const Instruction> decoded, size_t count,
+                const std::vector<long>& initialMemory);
+
+    // Like load(), but returns as soon as the first instruction is decoded and
+    // keeps parsing in the background; run() only blocks when it reaches code
+    // that is not decoded yet. A bad instruction makes the run ERRORED when it
+    // is reached instead of failing the load
+    STATUS loadStreaming(const std::string filename, const std::vector<long>& initialMemory);
+
+    // True while a loadStreaming() parser is still decoding, so getProgram()
+    // is only the start of the program
+    bool decoding() const { return streamStatus.load() == RUNNING; }
+
+    // Run the loaded program. A program with no INSERT or ERASE, over memory
+    // holding every cell it names, has its accesses checked once up front
+    // instead of one by one, see GVMAnalysis::cellSpan()
     STATUS run() override;
 
     // Return current data memory contents
@@ -49,11 +219,143 @@ public:
     // Reset machine state
     STATUS reset() override;
 
-    // Print machine state for debugging
+    // Stop future runs with CANCELLED once token is cancelled; the data memory,
+    // accumulator and instruction position are left as they were for inspection
+    void setCancellationToken(std::shared_ptr<const CancellationToken> token);
+
+    // Take the values of INPUT instructions from source (nullptr for none, in
+    // which case INPUT finds the input already ended). Like the cancellation
+    // token it stays attached across reset() and load(). Programs with INPUT
+    // are never moved to the optimized tier, and an ExecutionRecorder replay
+    // reads the source again, so give it one that repeats the same values
+    void setInput(std::shared_ptr<InputSource> source);
+
+    // Caps for untrusted programs: loading or INSERTing past maxCells, or
+    // retiring more than maxInstructions, makes the run ERRORED. Like
+    // cancellation, the instruction count is checked on backward jumps, so a
+    // run may overshoot by less than one pass over the program
+    void setLimits(size_t maxCells, unsigned long maxInstructions);
+
+    // Stop the run with PAUSED once instructionsRetired() reaches instructions;
+    // calling run() again continues it, typically after raising the budget
+    void setInstructionBudget(unsigned long instructions);
+
+    // Instructions executed since the program was loaded, across paused runs
+    unsigned long instructionsRetired() const;
+
+    // Report this VM's runs to profiler under programName (nullptr to detach)
+    void setProfiler(SamplingProfiler* profiler, const std::string& programName);
+
+    // Count every data memory access of future runs into heatmap (nullptr to stop).
+    // Runs without a heatmap use an interpreter with no counting in it
+    void setHeatmap(MemoryHeatmap* heatmap);
+
+    // Count the executions of each instruction of future runs into counts,
+    // indexed by pc and grown to the program's size (nullptr to stop). Like
+    // the heatmap, the counting lives in its own interpreter specialization
+    void setExecutionCounts(std::vector<unsigned long>* counts);
+
+    // Keep data memory in an mmap region ending in PROT_NONE guard pages, so
+    // plain runs (no heatmap, watches or runUntil()) bounds check AT, SET and
+    // the *MEM operations in hardware: an access out of range faults, and a
+    // SIGSEGV handler makes the run ERRORED with FAULT_BAD_ADDRESS as before.
+    // The guard reaches the highest cell the program names; a program naming
+    // a negative cell, or one beyond 2 GiB of guard, is checked in software.
+    // False if guard pages are not available (Linux only). Turning them off
+    // moves data memory back to the heap
+    bool setGuardPages(bool on);
+
+    // Keep data memory in an mmap region that grows in place with mremap, so
+    // INSERT never copies the cells to grow. With file, the region is that
+    // file (created if missing): memory can outgrow RAM through the page
+    // cache, and the file holds the final cells once the VM lets go of it
+    // (another backend, or destruction) without a getDataMem() copy. Like
+    // setGuardPages() it outlives reset() and load(); false if not available
+    bool setMappedMemory(const std::string& file = std::string());
+
+    // Tiered execution. Once a run without heatmap, execution counts, watches,
+    // breakpoints, recorder or profiler has retired hotAfter instructions, the next
+    // backward jump moves it onto a GVMOptimize build of the program that is
+    // entered at that jump's target with the accumulator it has then: pc,
+    // accumulator and data memory carry over mid-run (on-stack replacement),
+    // so even a single long run reaches the optimized loop. Wherever the
+    // optimized program stops the run (budget, cancellation, limit, fault,
+    // HALT) the VM first moves back onto the loaded program with the same
+    // state, so pc, getFault() and the next run() all refer to the loaded
+    // program. While optimized, instructionsRetired() counts the optimized
+    // program's instructions. 0 (the default) turns tiering off
+    void setTiering(unsigned long hotAfter);
+
+    // The loaded instructions, with BREAKPOINT in place of the instructions
+    // breakpoints are set on
+    GVMView<Instruction> getProgram() const;
+
+    // Different for every load of every VM, so tools can tell programs apart
+    // without comparing their instructions. Breakpoints leave it alone
+    uint64_t programId() const { return loadedId; }
+
+    // Debugging. A breakpoint swaps the instruction at index for a BREAKPOINT
+    // trap, so runs without breakpoints pay nothing for them. Reaching one
+    // stops the run with PAUSED before the instruction executes; run() and
+    // step() then execute the original instruction and carry on. Programs
+    // attached by pointer are copied before they are patched
+    bool setBreakpoint(size_t index);
+    bool clearBreakpoint(size_t index);
+    void clearBreakpoints();
+
+    // True when paused on a breakpoint rather than by the instruction budget
+    bool atBreakpoint() const;
+
+    // Pause the run after any instruction that writes data memory index cell:
+    // a SET of it, or an INSERT or ERASE at or before it that moves another
+    // value into it. Runs with watches use their own interpreter
+    // specialization, so runs without any are unaffected
+    void watchCell(size_t cell);
+    bool unwatchCell(size_t cell);
+    void clearWatches();
+
+    // True when paused by a watch, which getWatchHit() describes
+    bool atWatchpoint() const { return machineStatus == PAUSED && watchFired; }
+    const WatchHit& getWatchHit() const { return watchHit; }
+
+    // Checkpoint future runs into recorder (nullptr to stop), see ExecutionRecorder
+    void setRecorder(ExecutionRecorder* recorder);
+
+    // Move a READY program to a recorded position and make it PAUSED there, so
+    // run() continues from that point
+    STATUS resumeAt(size_t pc, long accumulator, unsigned long instructionsRetired,
+                    GVMView<long> scratchRegisters = GVMView<long>());
+
+    // Like run(), but stop with PAUSED exactly when instructionsRetired()
+    // reaches instructions. Checks after every instruction, unlike the budget.
+    // Watches and the heatmap apply as in run(), so a watch can pause it sooner
+    STATUS runUntil(unsigned long instructions);
+
+    // Execute a single instruction of a READY or PAUSED program; the result is
+    // PAUSED unless the instruction ended the program
+    STATUS step();
+
+    // Index of the next instruction to execute and the accumulator, for
+    // inspecting a paused program
+    size_t getPc() const { return pc; }
+    long getAccumulator() const { return accumulator; }
+    GVMView<long> getScratch() const { return GVMView<long>(scratch, GVM_SCRATCH_REGISTERS); }
+
+    // Where and why the program became ERRORED; code is FAULT_NONE otherwise
+    const Fault& getFault() const { return lastFault; }
+
+    // Index of the instruction being executed, published for signal handlers
+    // interrupting the running thread
+    const std::atomic<size_t>& executingPc() const { return publishedPc; }
+
+    // Status, accumulator, pc, data memory and program without copying any of them
+    VMState inspect() const;
+
+    // Print machine state for debugging, see GVMHelper::formatState() for other streams
     void printVM(bool printData = true, bool printInstruction = true) const;
 
     // Destructor
-    ~GritVM() = default;
+    ~GritVM();
 
     // Prevent copying
     GritVM(const GritVM&) = delete;
@@ -0,0 +1,162 @@
+#include "GritVMAnalysis.hpp"
+#include <algorithm>
+#include <limits>
+#include <map>
+
+bool GVMAnalysis::isJump(INSTRUCTION_SET op) {
+  return op == JUMPREL || op == JUMPZERO || op == JUMPNZERO;
+}
+
+bool GVMAnalysis::isBranch(INSTRUCTION_SET op) {
+  return isJump(op) || op == INPUT;
+}
+
+bool GVMAnalysis::isCellAccess(INSTRUCTION_SET op) {
+  switch (op) {
+    case AT: case SET: case ADDMEM: case SUBMEM: case MULMEM: case DIVMEM:
+    case ATRAW: case SETRAW: case ADDRAW: case SUBRAW: case MULRAW: case DIVRAW:
+      return true;
+    default:
+      return false;
+  }
+}
+
+bool GVMAnalysis::isLayoutChange(INSTRUCTION_SET op) {
+  return op == INSERT || op == ERASE;
+}
+
+bool GVMAnalysis::hasFixedLayout(GVMView<Instruction> program) {
+  for (const Instruction& inst : program) {
+    if (isLayoutChange(inst.operation)) return false;
+  }
+  return true;
+}
+
+bool GVMAnalysis::cellSpan(GVMView<Instruction> program, size_t& cells) {
+  return hasFixedLayout(program) && cellReach(program, cells);
+}
+
+bool GVMAnalysis::cellReach(GVMView<Instruction> program, size_t& cells) {
+  cells = 0;
+  for (const Instruction& inst : program) {
+    if (!isCellAccess(inst.operation)) continue;
+    if (inst.argument < 0) return false;
+    cells = std::max(cells, static_cast<size_t>(inst.argument) + 1);
+  }
+  return true;
+}
+
+size_t GVMAnalysis::jumpTarget(GVMView<Instruction> program, size_t pc) {
+  long distance = program[pc].argument;
+  if (distance >= 0) {
+    return pc + std::min(static_cast<size_t>(distance), program.size - pc);
+  }
+  return pc - std::min(static_cast<size_t>(-distance), pc);
+}
+
+std::vector<bool> GVMAnalysis::blockLeaders(GVMView<Instruction> program) {
+  std::vector<bool> leaders(program.size, false);
+  if (program.empty()) return leaders;
+
+  leaders[0] = true;
+  for (size_t pc = 0; pc < program.size; pc++) {
+    INSTRUCTION_SET op = program[pc].operation;
+    if (isBranch(op)) {
+      size_t target = jumpTarget(program, pc);
+      if (target < program.size) leaders[target] = true;
+    }
+    if ((isBranch(op) || op == HALT) && pc + 1 < program.size) {
+      leaders[pc + 1] = true;
+    }
+  }
+  return leaders;
+}
+
+std::vector<GVMAnalysis::Loop> GVMAnalysis::findLoops(GVMView<Instruction> program) {
+  std::map<size_t, size_t> latchFor;
+  for (size_t pc = 0; pc < program.size; pc++) {
+    if (isBranch(program[pc].operation) && program[pc].argument < 0) {
+      size_t header = jumpTarget(program, pc);
+      latchFor[header] = std::max(latchFor[header], pc);
+    }
+  }
+
+  // The map is ordered by header, and an enclosing loop starts no later than its body
+  std::vector<Loop> loops;
+  for (auto& item : latchFor) {
+    loops.push_back({ item.first, item.second });
+  }
+  return loops;
+}
+
+std::vector<size_t> GVMAnalysis::loopNest(const std::vector<Loop>& loops, size_t pc) {
+  std::vector<size_t> nest;
+  for (size_t i = 0; i < loops.size(); i++) {
+    if (loops[i].header <= pc && pc <= loops[i].latch) nest.push_back(i);
+  }
+  return nest;
+}
+
+bool GVMAnalysis::peakGrowth(GVMView<Instruction> program, size_t& growth, size_t entry) {
+  growth = 0;
+  if (entry >= program.size) return true;
+
+  // Per block: net growth, highest point reached inside it, and successors
+  struct Block {
+    long net = 0;
+    long high = 0;
+    std::vector<size_t> succs;
+  };
+  std::vector<bool> leaders = blockLeaders(program);
+  leaders[entry] = true;
+  std::vector<size_t> blockAt(program.size + 1, 0);
+  std::vector<Block> blocks;
+  for (size_t pc = 0; pc < program.size; pc++) {
+    if (leaders[pc]) blocks.emplace_back();
+    blockAt[pc] = blocks.size() - 1;
+  }
+  for (size_t pc = 0; pc < program.size; pc++) {
+    Block& block = blocks[blockAt[pc]];
+    INSTRUCTION_SET op = program[pc].operation;
+    if (op == INSERT) block.high = std::max(block.high, ++block.net);
+    if (op == ERASE) block.net--;
+
+    bool last = (pc + 1 == program.size) || leaders[pc + 1];
+    if (!last) continue;
+    if (isBranch(op)) {
+      size_t target = jumpTarget(program, pc);
+      if (program[pc].argument != 0 && target < program.size) block.succs.push_back(blockAt[target]);
+    }
+    if (op != HALT && op != JUMPREL && pc + 1 < program.size && (!isJump(op) || program[pc].argument != 0)) {
+      block.succs.push_back(blockAt[pc + 1]);
+    }
+  }
+
+  // Longest paths from the entry. Passes run in program order, so each one
+  // settles one more level of loop nesting (plus one for code before an entry
+  // part way through); values still rising after that many passes come from
+  // a loop with net growth
+  const long UNREACHED = std::numeric_limits<long>::min();
+  const size_t MAX_PASSES = 16;
+  std::vector<long> start(blocks.size(), UNREACHED);
+  start[blockAt[entry]] = 0;
+  long peak = 0;
+  for (size_t pass = 0; ; pass++) {
+    bool changed = false;
+    for (size_t b = 0; b < blocks.size(); b++) {
+      if (start[b] == UNREACHED) continue;
+      peak = std::max(peak, start[b] + blocks[b].high);
+      long exit = start[b] + blocks[b].net;
+      for (size_t succ : blocks[b].succs) {
+        if (exit > start[succ]) {
+          start[succ] = exit;
+          changed = true;
+        }
+      }
+    }
+    if (!changed) break;
+    if (pass >= std::min(blocks.size(), MAX_PASSES) + (entry != 0)) return false;
+  }
+  growth = static_cast<size_t>(peak);
+  return true;
+}
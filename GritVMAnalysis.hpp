@@ -0,0 +1,62 @@
+#ifndef GRITVMANALYSIS_H
+#define GRITVMANALYSIS_H
+
+#include "GritVMBase.hpp"
+#include <vector>
+
+// Static control flow facts about a decoded program, shared by the profiler
+// and the optimization passes
+namespace GVMAnalysis {
+  // A backward jump at latch whose target is header; the loop body is [header, latch]
+  struct Loop {
+    size_t header;
+    size_t latch;
+  };
+
+  bool                isJump(INSTRUCTION_SET op);
+
+  // Jumps and INPUT, which jumps by its argument at the end of input. A
+  // branch with argument 0 has no taken edge: the jumps fault and INPUT halts
+  bool                isBranch(INSTRUCTION_SET op);
+
+  // Reads or writes the data cell named by its argument without moving cells
+  bool                isCellAccess(INSTRUCTION_SET op);
+
+  // INSERT and ERASE, which shift every cell after their argument
+  bool                isLayoutChange(INSTRUCTION_SET op);
+
+  // True when no instruction of program can move cells
+  bool                hasFixedLayout(GVMView<Instruction> program);
+
+  // One past the highest cell any access of program names, false when it
+  // names a negative one
+  bool                cellReach(GVMView<Instruction> program, size_t& cells);
+
+  // cellReach() of a program that cannot move cells, so a run over at least
+  // that many cells can skip every bounds check. False when program can move
+  // cells or names a negative one
+  bool                cellSpan(GVMView<Instruction> program, size_t& cells);
+
+  // Index a jump at pc lands on, clamped the same way GritVM::advance() clamps;
+  // program.size means the jump halts the program
+  size_t              jumpTarget(GVMView<Instruction> program, size_t pc);
+
+  // True for every instruction that starts a basic block
+  std::vector<bool>   blockLeaders(GVMView<Instruction> program);
+
+  // Loops ordered by header, enclosing loops before the loops they contain.
+  // Backward jumps to the same header are merged into one loop
+  std::vector<Loop>   findLoops(GVMView<Instruction> program);
+
+  // Indices into loops of the loops containing pc, outermost first
+  std::vector<size_t> loopNest(const std::vector<Loop>& loops, size_t pc);
+
+  // Most cells a run of program can add to data memory at any one time:
+  // INSERTs minus ERASEs along the path that grows it most. Exact for
+  // straight-line code and an upper bound otherwise. False when a loop may
+  // grow memory on every pass, so no bound exists. A run that is already
+  // part way through is measured from entry, the next instruction it executes
+  bool                peakGrowth(GVMView<Instruction> program, size_t& growth, size_t entry = 0);
+};
+
+#endif // GRITVMANALYSIS_H
@@ -1,21 +1,85 @@
 #include "GritVMBase.hpp"
 
+#include <algorithm>
+#include <charconv>
 #include <map>
 #include <sstream>
 #include <iterator>
 
-std::string GVMHelper::statusToString(STATUS s) {
+namespace {
+  // Fills a caller's buffer and passes it to a stream whenever it runs out of room
+  class ChunkWriter {
+  public:
+    ChunkWriter(std::ostream &out, char *buffer, size_t capacity)
+      : out(out), begin(buffer), pos(buffer), end(buffer + capacity) {}
+    ~ChunkWriter() { flush(); }
+
+    // Every call writes less than a line, which always fits in an empty buffer
+    ChunkWriter &operator<<(std::string_view text) {
+      reserve(text.size());
+      pos = std::copy(text.begin(), text.end(), pos);
+      return *this;
+    }
+    ChunkWriter &operator<<(long value) {
+      reserve(24);
+      pos = std::to_chars(pos, end, value).ptr;
+      return *this;
+    }
+    ChunkWriter &operator<<(size_t value) {
+      reserve(24);
+      pos = std::to_chars(pos, end, value).ptr;
+      return *this;
+    }
+
+  private:
+    std::ostream &out;
+    char *begin;
+    char *pos;
+    char *end;
+
+    void reserve(size_t bytes) {
+      if (static_cast<size_t>(end - pos) < bytes) flush();
+    }
+    void flush() {
+      out.write(begin, pos - begin);
+      pos = begin;
+    }
+  };
+}
+
+std::string_view GVMHelper::statusName(STATUS s) {
   switch (s) {
     case WAITING: return "WAITING";
     case READY:   return "READY";
     case RUNNING: return "RUNNING";
+    case PAUSED:  return "PAUSED";
     case HALTED:  return "HALTED";
     case ERRORED: return "ERRORED";
+    case CANCELLED: return "CANCELLED";
     default:      return "UNKNOWN";
   }
 }
 
-std::string GVMHelper::instructionToString(INSTRUCTION_SET s) {
+std::string GVMHelper::statusToString(STATUS s) {
+  return std::string(statusName(s));
+}
+
+std::string GVMHelper::faultToString(FAULT_CODE f) {
+  switch (f) {
+    case FAULT_NONE:              return "NONE";
+    case FAULT_BAD_INSTRUCTION:   return "BAD_INSTRUCTION";
+    case FAULT_BAD_ADDRESS:       return "BAD_ADDRESS";
+    case FAULT_BAD_INSERT:        return "BAD_INSERT";
+    case FAULT_DIVIDE_BY_ZERO:    return "DIVIDE_BY_ZERO";
+    case FAULT_ZERO_JUMP:         return "ZERO_JUMP";
+    case FAULT_CHECKMEM:          return "CHECKMEM";
+    case FAULT_MEMORY_LIMIT:      return "MEMORY_LIMIT";
+    case FAULT_INSTRUCTION_LIMIT: return "INSTRUCTION_LIMIT";
+    default:                      return "UNKNOWN";
+  }
+}
+
+std::string_view GVMHelper::instructionName(INSTRUCTION_SET s) {
   switch (s) {
     case CLEAR:     return "CLEAR";
     case AT:        return "AT";
@@ -37,17 +101,38 @@ std::string GVMHelper::instructionToString(INSTRUCTION_SET s) {
     case HALT:      return "HALT";
     case OUTPUT:    return "OUTPUT";
     case CHECKMEM:  return "CHECKMEM";
+    case INPUT:     return "INPUT";
+    case BREAKPOINT: return "BREAKPOINT";
+    case SETTMP:    return "SETTMP";
+    case ATTMP:     return "ATTMP";
+    case ADDTMP:    return "ADDTMP";
+    case SUBTMP:    return "SUBTMP";
+    case MULTMP:    return "MULTMP";
+    case DIVTMP:    return "DIVTMP";
+    case ATRAW:     return "ATRAW";
+    case SETRAW:    return "SETRAW";
+    case ADDRAW:    return "ADDRAW";
+    case SUBRAW:    return "SUBRAW";
+    case MULRAW:    return "MULRAW";
+    case DIVRAW:    return "DIVRAW";
+    case MEMGUARD:  return "MEMGUARD";
     default:        return "UNKNOWN_INSTRUCTION";
   }
 }
 
+std::string GVMHelper::instructionToString(INSTRUCTION_SET s) {
+  return std::string(instructionName(s));
+}
+
 STATUS GVMHelper::stringToStatus(std::string s) {
   static std::map<std::string, STATUS> statusMapping = {
     { "WAITING",  WAITING },
     { "READY",    READY   },
     { "RUNNING",  RUNNING },
+    { "PAUSED",   PAUSED  },
     { "HALTED",   HALTED  },
-    { "ERRORED",  ERRORED }
+    { "ERRORED",  ERRORED },
+    { "CANCELLED", CANCELLED }
   };
 
   return (statusMapping.count(s) == 0) ? UNKNOWN : statusMapping[s];
@@ -74,7 +159,8 @@ INSTRUCTION_SET GVMHelper::stringtoInstruction(std::string s) {
     { "NOOP", NOOP },
     { "HALT", HALT },
     { "OUTPUT", OUTPUT },
-    { "CHECKMEM", CHECKMEM }
+    { "CHECKMEM", CHECKMEM },
+    { "INPUT", INPUT }
   };
   
   return (instructionSetMapping.count(s) == 0) ? UNKNOWN_INSTRUCTION : instructionSetMapping[s];
@@ -98,4 +184,42 @@ Instruction GVMHelper::parseInstruction(std::string gvmLine) {
   }
  
   return Instruction(instruct, arg);
-}
\ No newline at end of file
+}
+
+bool GVMHelper::parseProgram(std::istream &in, std::vector<Instruction> &program) {
+  std::string line;
+  while (std::getline(in, line)) {
+    if (line.empty() || line[0] == '#') continue;
+    Instruction inst = GVMHelper::parseInstruction(line);
+    if (inst.operation == UNKNOWN_INSTRUCTION) return false;
+    program.push_back(inst);
+  }
+  return true;
+}
+
+void GVMHelper::formatState(std::ostream &out, const VMState &state, char *buffer, size_t capacity,
+                            bool printData, bool printInstruction) {
+  char fallback[256];
+  if (capacity < sizeof(fallback)) {
+    buffer = fallback;
+    capacity = sizeof(fallback);
+  }
+
+  ChunkWriter writer(out, buffer, capacity);
+  writer << "Status: " << statusName(state.status) << "\n";
+  writer << "Accumulator: " << state.accumulator << "\n";
+
+  if (printData) {
+    writer << "*** Data Memory ***\n";
+    for (size_t i = 0; i < state.memory.size; ++i) {
+      writer << "Location " << i << ": " << state.memory[i] << "\n";
+    }
+  }
+  if (printInstruction) {
+    writer << "*** Instruction Memory ***\n";
+    for (size_t i = 0; i < state.program.size; ++i) {
+      writer << "Instruction " << i << ": " << instructionName(state.program[i].operation)
+             << " " << state.program[i].argument << "\n";
+    }
+  }
+}
@@ -2,7 +2,17 @@
 #define GRITVMBASE_H
 
 #include <string>
+#include <string_view>
 #include <vector>
+#include <istream>
+#include <ostream>
+
+// Keeps rarely taken error paths out of line so they do not crowd the code around them
+#if defined(__GNUC__)
+#define GVM_COLD __attribute__((cold, noinline))
+#else
+#define GVM_COLD
+#endif
 
 // All possibly instructions the GritVM can run
 typedef enum _instruction_set {
@@ -24,19 +34,52 @@ typedef enum _instruction_set {
   // Misc Functions
   NOOP, HALT, OUTPUT, CHECKMEM,
 
+  // Read the next value of GritVM::setInput() into the accumulator; at the
+  // end of input jump by the argument instead, or halt if it is 0
+  INPUT,
+
   // USE ONLY FOR BAD TRANSLATIONS READS (Ex: Typos in gvm file)
-  UNKNOWN_INSTRUCTION
+  UNKNOWN_INSTRUCTION,
+
+  // Internal to the VM, never produced by parsing a .gvm file
+  BREAKPOINT,   // Trap planted by GritVM::setBreakpoint() over the real instruction
+
+  // Scratch registers for optimized programs, argument is the register
+  // (below GVM_SCRATCH_REGISTERS); they are not part of data memory
+  SETTMP, ATTMP, ADDTMP, SUBTMP, MULTMP, DIVTMP,
+
+  // AT, SET and the MEM forms without the bounds check, for loop copies
+  // entered only past a MEMGUARD that covers every cell they touch
+  ATRAW, SETRAW, ADDRAW, SUBRAW, MULRAW, DIVRAW,
+  MEMGUARD      // Skip the next instruction unless memory holds argument cells
 } INSTRUCTION_SET;
 
+const size_t GVM_SCRATCH_REGISTERS = 16;
+
 typedef enum _status {
   WAITING,  // Waiting to load a program 
   READY,    // Program loaded and ready to run
   RUNNING,  // Actively running a program
+  PAUSED,   // Stopped part way through a program, run() continues from where it stopped
   HALTED,   // Program halted, whether by a HALT instruction or reaching the end of instruction
   ERRORED,  // The program stopped because of an error
+  CANCELLED,// The program was stopped early through its CancellationToken
   UNKNOWN   // Unknown status. Should never happen in normal control flow
 } STATUS;
 
+// Why a program stopped with ERRORED
+typedef enum _fault_code {
+  FAULT_NONE,               // No error recorded
+  FAULT_BAD_INSTRUCTION,    // A line of the program could not be decoded
+  FAULT_BAD_ADDRESS,        // AT, SET, ERASE or a *MEM operation outside data memory
+  FAULT_BAD_INSERT,         // INSERT past the end of data memory
+  FAULT_DIVIDE_BY_ZERO,     // DIVCONST 0 or DIVMEM of a zero cell
+  FAULT_ZERO_JUMP,          // A jump of distance 0
+  FAULT_CHECKMEM,           // CHECKMEM found too few cells
+  FAULT_MEMORY_LIMIT,       // Data memory would exceed GritVM::setLimits()
+  FAULT_INSTRUCTION_LIMIT,  // The run retired more instructions than GritVM::setLimits() allows
+  FAULT_COUNT
+} FAULT_CODE;
 
 typedef struct _instruction {
   INSTRUCTION_SET operation; long argument;
@@ -44,6 +87,41 @@ typedef struct _instruction {
   _instruction(INSTRUCTION_SET i, long arg = 0) : operation(i), argument(arg) {};
 } Instruction;
 
+// Read-only window onto storage owned by a GritVM
+template <typename T>
+struct GVMView {
+  const T* data;
+  size_t   size;
+
+  GVMView(const T* d = nullptr, size_t n = 0) : data(d), size(n) {};
+  const T* begin() const { return data; }
+  const T* end() const { return data + size; }
+  const T& operator[](size_t i) const { return data[i]; }
+  bool empty() const { return size == 0; }
+};
+
+// What a GritVM looks like from outside; the views point into the VM and stay
+// valid until it next runs, loads or resets
+typedef struct _vm_state {
+  STATUS                status;
+  long                  accumulator;
+  size_t                pc;           // Next instruction to execute
+  GVMView<long>         memory;
+  GVMView<Instruction>  program;
+} VMState;
+
+// Machine state at the instruction that made a run ERRORED
+typedef struct _fault {
+  FAULT_CODE      code;
+  size_t          pc;           // Index of the faulting instruction
+  INSTRUCTION_SET operation;    // UNKNOWN_INSTRUCTION when it could not be decoded
+  long            argument;
+  long            accumulator;
+  size_t          memorySize;   // Data memory cells at the time
+
+  _fault() : code(FAULT_NONE), pc(0), operation(UNKNOWN_INSTRUCTION), argument(0), accumulator(0), memorySize(0) {};
+} Fault;
+
 class GritVMInterface {
 public:
   virtual STATUS              load(const std::string filename, const std::vector<long> &initialMemory) = 0;
@@ -54,10 +132,24 @@ public:
 
 namespace GVMHelper {
   std::string     statusToString(STATUS s);
+  std::string     faultToString(FAULT_CODE f);
   STATUS          stringToStatus(std::string s);
   std::string     instructionToString(INSTRUCTION_SET s);
+
+  // The same names without building a string
+  std::string_view statusName(STATUS s);
+  std::string_view instructionName(INSTRUCTION_SET s);
+
+  // Write state as printVM() shows it. Text is formatted into buffer with
+  // std::to_chars and handed to out one full buffer at a time; a capacity
+  // under 256 bytes is replaced by a buffer of that size
+  void            formatState(std::ostream &out, const VMState &state, char *buffer, size_t capacity,
+                              bool printData = true, bool printInstruction = true);
   INSTRUCTION_SET stringtoInstruction(std::string s);
   Instruction     parseInstruction(std::string gvmLine);
+
+  // Decode every non-comment line of a gvm program, false on a bad instruction
+  bool            parseProgram(std::istream &in, std::vector<Instruction> &program);
 };
 
 #endif /* GRITVM_H */
\ No newline at end of file
@@ -0,0 +1,193 @@
+#include "GritVMFusion.hpp"
+#include "GritVM.hpp"
+#include "GritVMAnalysis.hpp"
+#include <algorithm>
+#include <limits>
+
+namespace {
+  // Code for part k of a fused instruction, inside its case of GritVM::evaluate()
+  void writePart(std::ostream& out, INSTRUCTION_SET op, size_t k, bool last) {
+    const std::string indent = "            ";
+    const std::string arg = "arg" + std::to_string(k);
+    const std::string at = (k == 0) ? "pc" : "pc + " + std::to_string(k);
+    const std::string offset = (k == 0) ? "" : std::to_string(k) + " + ";
+
+    auto fault = [&](const std::string& condition, const char* code) {
+      out << indent << "if (" << condition << ") {\n"
+          << indent << "    fail(" << code << ", " << at << ");\n"
+          << indent << "    return 1;\n"
+          << indent << "}\n";
+    };
+    auto cell = [&]() { fault("!validateMemoryAccess(" + arg + ")", "FAULT_BAD_ADDRESS"); };
+
+    if (op != CLEAR && op != NOOP && op != OUTPUT) {
+      out << indent << "const long " << arg << " = "
+          << ((k == 0) ? std::string("inst.argument") : "program[" + at + "].argument") << ";\n";
+    }
+    switch (op) {
+      case CLEAR:
+        out << indent << "accumulator = 0;\n";
+        break;
+      case NOOP:
+        break;
+      case OUTPUT:
+        out << indent << "std::cout << accumulator << std::endl;\n";
+        break;
+      case AT:
+        cell();
+        out << indent << "hooks.read(" << arg << ");\n"
+            << indent << "accumulator = dataMem[" << arg << "];\n";
+        break;
+      case SET:
+        cell();
+        out << indent << "hooks.write(" << arg << ", dataMem[" << arg << "], accumulator);\n"
+            << indent << "dataMem[" << arg << "] = accumulator;\n";
+        break;
+      case ADDMEM: case SUBMEM: case MULMEM:
+        cell();
+        out << indent << "hooks.read(" << arg << ");\n"
+            << indent << "accumulator " << (op == ADDMEM ? "+" : op == SUBMEM ? "-" : "*")
+            << "= dataMem[" << arg << "];\n";
+        break;
+      case DIVMEM:
+        cell();
+        out << indent << "hooks.read(" << arg << ");\n";
+        fault("dataMem[" + arg + "] == 0", "FAULT_DIVIDE_BY_ZERO");
+        out << indent << "accumulator /= dataMem[" << arg << "];\n";
+        break;
+      case ADDCONST: case SUBCONST: case MULCONST:
+        out << indent << "accumulator " << (op == ADDCONST ? "+" : op == SUBCONST ? "-" : "*")
+            << "= " << arg << ";\n";
+        break;
+      case DIVCONST:
+        fault(arg + " == 0", "FAULT_DIVIDE_BY_ZERO");
+        out << indent << "accumulator /= " << arg << ";\n";
+        break;
+      case INSERT:
+        fault("static_cast<size_t>(" + arg + ") > dataMem.size()", "FAULT_BAD_INSERT");
+        fault("dataMem.size() >= memoryLimit", "FAULT_MEMORY_LIMIT");
+        out << indent << "hooks.insert(" << arg << ", dataMem.size());\n"
+            << indent << "dataMem.insert(" << arg << ", accumulator);\n";
+        break;
+      case ERASE:
+        cell();
+        out << indent << "hooks.erase(" << arg << ", dataMem.size());\n"
+            << indent << "dataMem.erase(" << arg << ");\n";
+        break;
+      case CHECKMEM:
+        fault("dataMem.size() < static_cast<size_t>(" + arg + ")", "FAULT_CHECKMEM");
+        break;
+      case JUMPREL:
+        fault(arg + " == 0", "FAULT_ZERO_JUMP");
+        out << indent << "return " << offset << arg << ";\n";
+        return;
+      case JUMPZERO: case JUMPNZERO:
+        fault(arg + " == 0", "FAULT_ZERO_JUMP");
+        out << indent << "return (accumulator " << (op == JUMPZERO ? "==" : "!=") << " 0) ? "
+            << offset << arg << " : " << (k + 1) << ";\n";
+        return;
+      default:
+        break;
+    }
+    if (last) out << indent << "return " << (k + 1) << ";\n";
+  }
+}
+
+bool GVMFusion::fusable(INSTRUCTION_SET op) {
+  return op < UNKNOWN_INSTRUCTION && op != HALT && op != INPUT;
+}
+
+void GVMFusion::add(Counts& counts, GVMView<Instruction> program,
+                    const std::vector<unsigned long>& executions, size_t maxLength) {
+  for (size_t first = 0; first < program.size && first < executions.size(); first++) {
+    unsigned long weight = executions[first];
+    if (weight == 0) continue;
+    std::vector<INSTRUCTION_SET> ops;
+    for (size_t pc = first; pc < program.size && ops.size() < maxLength; pc++) {
+      INSTRUCTION_SET op = program[pc].operation;
+      if (!fusable(op)) break;
+      ops.push_back(op);
+      if (ops.size() >= 2) {
+        Candidate& candidate = counts[ops];
+        candidate.ops = ops;
+        candidate.executions += weight;
+        candidate.saved += weight * (ops.size() - 1);
+        candidate.sites++;
+      }
+      // Control leaves a fused instruction only at its end
+      if (GVMAnalysis::isJump(op)) break;
+    }
+  }
+}
+
+std::vector<unsigned long> GVMFusion::staticExecutions(GVMView<Instruction> program) {
+  std::vector<GVMAnalysis::Loop> loops = GVMAnalysis::findLoops(program);
+  std::vector<unsigned long> executions(program.size, 1);
+  for (size_t pc = 0; pc < program.size; pc++) {
+    size_t depth = GVMAnalysis::loopNest(loops, pc).size();
+    for (size_t d = 0; d < depth && executions[pc] <= std::numeric_limits<unsigned long>::max() / LOOP_WEIGHT; d++) {
+      executions[pc] *= LOOP_WEIGHT;
+    }
+  }
+  return executions;
+}
+
+STATUS GVMFusion::countExecutions(const std::string& file, const std::vector<long>& memory,
+                                  std::vector<Instruction>& program, std::vector<unsigned long>& executions,
+                                  unsigned long maxInstructions) {
+  GritVM vm;
+  STATUS status = vm.load(file, memory);
+  GVMView<Instruction> code = vm.getProgram();
+  program.assign(code.begin(), code.end());
+  executions.assign(program.size(), 0);
+  if (status != READY) return status;
+
+  // One run with a counting interpreter, rather than a run per instruction
+  vm.setExecutionCounts(&executions);
+  return vm.runUntil(maxInstructions);
+}
+
+std::vector<GVMFusion::Candidate> GVMFusion::rank(const Counts& counts, size_t top) {
+  std::vector<Candidate> ranked;
+  for (const auto& item : counts) ranked.push_back(item.second);
+  std::stable_sort(ranked.begin(), ranked.end(), [](const Candidate& a, const Candidate& b) {
+    return a.saved != b.saved ? a.saved > b.saved : a.executions > b.executions;
+  });
+  if (ranked.size() > top) ranked.resize(top);
+  return ranked;
+}
+
+void GVMFusion::report(std::ostream& out, const std::vector<Candidate>& ranked) {
+  for (size_t i = 0; i < ranked.size(); i++) {
+    const Candidate& candidate = ranked[i];
+    out << (i + 1) << ". " << candidate.saved << " dispatches saved, " << candidate.executions
+        << " executions, " << candidate.sites << " sites:";
+    for (INSTRUCTION_SET op : candidate.ops) out << ' ' << GVMHelper::instructionName(op);
+    out << '\n';
+  }
+}
+
+std::string GVMFusion::opcodeName(const Candidate& candidate) {
+  std::string name = "FUSED";
+  for (INSTRUCTION_SET op : candidate.ops) {
+    name += '_';
+    name += GVMHelper::instructionName(op);
+  }
+  return name;
+}
+
+void GVMFusion::writeHandlers(std::ostream& out, const std::vector<Candidate>& ranked) {
+  out << "// INSTRUCTION_SET, after the internal opcodes\n";
+  for (const Candidate& candidate : ranked) {
+    out << "  " << opcodeName(candidate) << ",\n";
+  }
+  out << "\n// GritVM::evaluate()\n";
+  for (const Candidate& candidate : ranked) {
+    out << "        // " << candidate.executions << " executions, " << candidate.saved << " dispatches saved\n"
+        << "        case " << opcodeName(candidate) << ": {\n";
+    for (size_t k = 0; k < candidate.ops.size(); k++) {
+      writePart(out, candidate.ops[k], k, k + 1 == candidate.ops.size());
+    }
+    out << "        }\n";
+  }
+}
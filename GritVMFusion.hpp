@@ -0,0 +1,70 @@
+#ifndef GRITVMFUSION_H
+#define GRITVMFUSION_H
+
+#include "GritVMBase.hpp"
+#include <map>
+#include <ostream>
+#include <string>
+#include <vector>
+
+// Superinstruction mining. Every run of 2 to maxLength consecutive
+// instructions of a program is a candidate for one fused instruction that
+// does the work of all of them in a single dispatch. Candidates are counted
+// over a corpus of programs, weighted by how often each one ran (from a
+// counted run, or estimated from loop nesting), and ranked by the dispatches
+// fusing them would save. For the best ones the opcode and the case for
+// GritVM::evaluate() can be generated.
+//
+// A fused instruction replaces only the first instruction of a match and
+// reads its other arguments from the instructions after it, which stay in
+// place, so jumps into the middle of a match still work and nothing but the
+// first opcode has to change when a program is rewritten.
+namespace GVMFusion {
+  struct Candidate {
+    std::vector<INSTRUCTION_SET> ops;
+    unsigned long executions = 0;                  // Times the sequence ran from its first instruction
+    unsigned long saved = 0;                       // Dispatches fusing it saves: executions * (ops.size() - 1)
+    size_t sites = 0;                              // Places it occurs in the corpus
+  };
+
+  typedef std::map<std::vector<INSTRUCTION_SET>, Candidate> Counts;
+
+  // Estimate of how much more often code in a loop runs than code around it
+  const unsigned long LOOP_WEIGHT = 10;
+
+  // May be part of a fused instruction; jumps only as the last part. HALT,
+  // INPUT, BREAKPOINT and the VM's internal opcodes are left alone
+  bool        fusable(INSTRUCTION_SET op);
+
+  // Add the sequences of program to counts, each weighted by executions of
+  // its first instruction (executions.size() == program.size)
+  void        add(Counts& counts, GVMView<Instruction> program,
+                  const std::vector<unsigned long>& executions, size_t maxLength = 3);
+
+  // Executions of each instruction of program guessed from loop nesting:
+  // LOOP_WEIGHT to the power of the loops around it
+  std::vector<unsigned long> staticExecutions(GVMView<Instruction> program);
+
+  // Run file on memory, counting the executions of each instruction, for at
+  // most maxInstructions. Returns how the run ended, PAUSED if it was cut
+  // short; program receives the decoded instructions
+  STATUS      countExecutions(const std::string& file, const std::vector<long>& memory,
+                              std::vector<Instruction>& program, std::vector<unsigned long>& executions,
+                              unsigned long maxInstructions);
+
+  // The top candidates by dispatches saved, most first
+  std::vector<Candidate> rank(const Counts& counts, size_t top);
+
+  // One line per candidate: rank, dispatches saved, executions, sites, opcodes
+  void        report(std::ostream& out, const std::vector<Candidate>& ranked);
+
+  // Opcode for candidate, e.g. FUSED_AT_ADDMEM_SET
+  std::string opcodeName(const Candidate& candidate);
+
+  // INSTRUCTION_SET entries and GritVM::evaluate() cases for ranked, in the
+  // interpreter's own style. A fault in part k of a fused instruction is
+  // reported at pc + k; the run stays on the fused instruction
+  void        writeHandlers(std::ostream& out, const std::vector<Candidate>& ranked);
+};
+
+#endif // GRITVMFUSION_H
@@ -0,0 +1,86 @@
+#include "GritVMHeatmap.hpp"
+#include "GritVMAnalysis.hpp"
+#include <algorithm>
+#include <numeric>
+#include <sstream>
+
+unsigned long MemoryHeatmap::totalShifted() const {
+    unsigned long total = 0;
+    for (const Cell& cell : counts) {
+        total += cell.shifted;
+    }
+    return total;
+}
+
+void MemoryHeatmap::report(std::ostream& out) const {
+    out << "cell reads writes inserts erases shifted\n";
+    for (size_t i = 0; i < counts.size(); ++i) {
+        const Cell& c = counts[i];
+        if (c.reads + c.writes + c.inserts + c.erases == 0) continue;
+        out << i << " " << c.reads << " " << c.writes << " " << c.inserts
+            << " " << c.erases << " " << c.shifted << "\n";
+    }
+}
+
+// Rank positions by traffic and, when cells never move, renumber the program to match
+LayoutAdvice MemoryHeatmap::adviseLayout(GVMView<Instruction> program) const {
+    LayoutAdvice advice;
+    size_t cellCount = counts.size();
+
+    std::vector<size_t> order(cellCount);
+    std::iota(order.begin(), order.end(), 0);
+    std::stable_sort(order.begin(), order.end(), [this](size_t a, size_t b) {
+        return counts[a].reads + counts[a].writes > counts[b].reads + counts[b].writes;
+    });
+    advice.newIndexOf.resize(cellCount);
+    for (size_t i = 0; i < cellCount; ++i) {
+        advice.newIndexOf[order[i]] = i;
+    }
+
+    // Positions where INSERT/ERASE are expensive, worst first
+    std::vector<size_t> shifting;
+    for (size_t i = 0; i < cellCount; ++i) {
+        if (counts[i].shifted != 0) shifting.push_back(i);
+    }
+    std::stable_sort(shifting.begin(), shifting.end(), [this](size_t a, size_t b) {
+        return counts[a].shifted > counts[b].shifted;
+    });
+    for (size_t i : shifting) {
+        std::ostringstream note;
+        note << "position " << i << ": " << counts[i].inserts << " inserts and " << counts[i].erases
+             << " erases shifted " << counts[i].shifted
+             << " cells; keep scratch cells at the end of memory so they shift nothing";
+        advice.notes.push_back(note.str());
+    }
+
+    if (!GVMAnalysis::hasFixedLayout(program)) {
+        advice.notes.push_back("INSERT/ERASE move cells while running, so the renumbering is not applied");
+        return advice;
+    }
+
+    advice.applicable = true;
+    advice.program.assign(program.begin(), program.end());
+    for (Instruction& inst : advice.program) {
+        if (GVMAnalysis::isCellAccess(inst.operation) && inst.argument >= 0
+            && static_cast<size_t>(inst.argument) < cellCount) {
+            inst.argument = static_cast<long>(advice.newIndexOf[inst.argument]);
+        }
+    }
+    return advice;
+}
+
+std::vector<long> LayoutAdvice::toNewLayout(const std::vector<long>& memory) const {
+    std::vector<long> moved(memory);
+    for (size_t i = 0; i < newIndexOf.size() && i < memory.size(); ++i) {
+        if (newIndexOf[i] < moved.size()) moved[newIndexOf[i]] = memory[i];
+    }
+    return moved;
+}
+
+std::vector<long> LayoutAdvice::toOriginalLayout(const std::vector<long>& memory) const {
+    std::vector<long> moved(memory);
+    for (size_t i = 0; i < newIndexOf.size() && i < memory.size(); ++i) {
+        if (newIndexOf[i] < memory.size()) moved[i] = memory[newIndexOf[i]];
+    }
+    return moved;
+}
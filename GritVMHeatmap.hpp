@@ -0,0 +1,62 @@
+#ifndef GRITVMHEATMAP_H
+#define GRITVMHEATMAP_H
+
+#include "GritVMBase.hpp"
+#include <ostream>
+#include <string>
+#include <vector>
+
+// A cell renumbering suggested by MemoryHeatmap::adviseLayout()
+struct LayoutAdvice {
+    bool applicable = false;                       // False when INSERT/ERASE move cells at run time
+    std::vector<size_t> newIndexOf;                // Old cell index -> new cell index
+    std::vector<Instruction> program;              // The program renumbered (empty unless applicable)
+    std::vector<std::string> notes;                // Human readable findings, hottest first
+
+    // Move memory between the original and the new numbering; cells past
+    // newIndexOf are left where they are
+    std::vector<long> toNewLayout(const std::vector<long>& memory) const;
+    std::vector<long> toOriginalLayout(const std::vector<long>& memory) const;
+};
+
+// Access counts per data memory position, filled in by GritVM runs given
+// this heatmap with GritVM::setHeatmap(). Positions are indices at the time
+// of the access, so a cell that moves because of an INSERT or ERASE is
+// counted under its new index from then on.
+class MemoryHeatmap {
+public:
+    struct Cell {
+        unsigned long reads = 0;                   // AT and the arithmetic *MEM operations
+        unsigned long writes = 0;                  // SET
+        unsigned long inserts = 0;                 // INSERT at this position
+        unsigned long erases = 0;                  // ERASE at this position
+        unsigned long shifted = 0;                 // Cells moved by those INSERTs and ERASEs
+    };
+
+    void recordRead(long cell) { at(cell).reads++; }
+    void recordWrite(long cell) { at(cell).writes++; }
+    void recordInsert(long cell, size_t size) { Cell& c = at(cell); c.inserts++; c.shifted += size - cell; }
+    void recordErase(long cell, size_t size) { Cell& c = at(cell); c.erases++; c.shifted += size - cell - 1; }
+
+    const std::vector<Cell>& cells() const { return counts; }
+    unsigned long totalShifted() const;
+    void clear() { counts.clear(); }
+
+    // One line per touched position: reads, writes, inserts, erases, cells shifted
+    void report(std::ostream& out) const;
+
+    // Suggest a numbering that puts the hottest cells first. For programs
+    // without INSERT or ERASE the renumbered program is produced as well;
+    // otherwise only notes about costly INSERT/ERASE positions are given
+    LayoutAdvice adviseLayout(GVMView<Instruction> program) const;
+
+private:
+    std::vector<Cell> counts;
+
+    Cell& at(long cell) {
+        if (static_cast<size_t>(cell) >= counts.size()) counts.resize(cell + 1);
+        return counts[cell];
+    }
+};
+
+#endif // GRITVMHEATMAP_H
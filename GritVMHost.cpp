@@ -0,0 +1,184 @@
+#include "GritVMHost.hpp"
+#include "GritVMAnalysis.hpp"
+#include <algorithm>
+#include <stdexcept>
+
+namespace {
+    std::atomic<uint64_t> nextHostId{1};
+
+    // Add without wrapping past ULONG_MAX, quotas use it to mean unlimited
+    unsigned long saturatingAdd(unsigned long a, unsigned long b) {
+        return (b > ULONG_MAX - a) ? ULONG_MAX : a + b;
+    }
+}
+
+GritVMHost::GritVMHost(unsigned flushEvery)
+    : flushEvery(std::max(flushEvery, 1u)), hostId(nextHostId.fetch_add(1)) {}
+
+void GritVMHost::addTenant(const std::string& name, const TenantQuota& quota) {
+    std::lock_guard<std::mutex> lock(tenantsMutex);
+    std::shared_ptr<Tenant>& tenant = tenants[name];
+    if (!tenant) {
+        tenant = std::make_shared<Tenant>();
+    }
+    tenant->quota = quota;
+}
+
+std::shared_ptr<GritVMHost::Tenant> GritVMHost::find(const std::string& name, TenantQuota* quota) {
+    std::lock_guard<std::mutex> lock(tenantsMutex);
+    auto found = tenants.find(name);
+    if (found == tenants.end()) {
+        throw std::invalid_argument("Unknown tenant: " + name);
+    }
+    if (quota) {
+        *quota = found->second->quota;
+    }
+    return found->second;
+}
+
+GritVMHost::Pending::Pending(std::shared_ptr<Tenant> owner) : tenant(std::move(owner)) {
+    std::lock_guard<std::mutex> lock(tenant->pendingMutex);
+    tenant->pending.insert(this);
+}
+
+GritVMHost::Pending::~Pending() {
+    std::lock_guard<std::mutex> lock(tenant->pendingMutex);
+    tenant->pending.erase(this);
+    fold(*this);
+}
+
+// This thread's counters, keyed by host so several hosts can share a thread.
+// They are destroyed, and so folded, when the thread exits
+GritVMHost::PendingMap& GritVMHost::localPending() {
+    static thread_local PendingMap local;
+    return local;
+}
+
+GritVMHost::Pending& GritVMHost::pending(const std::shared_ptr<Tenant>& tenant) {
+    std::unique_ptr<Pending>& mine = localPending()[std::make_pair(hostId, static_cast<const void*>(tenant.get()))];
+    if (!mine) {
+        mine = std::make_unique<Pending>(tenant);
+    }
+    return *mine;
+}
+
+void GritVMHost::fold(Pending& mine) {
+    unsigned long instructions = mine.instructions.exchange(0);
+    mine.tenant->instructions.fetch_add(instructions, std::memory_order_relaxed);
+    mine.tenant->totalInstructions.fetch_add(instructions, std::memory_order_relaxed);
+    mine.tenant->runs.fetch_add(mine.runs.exchange(0), std::memory_order_relaxed);
+}
+
+// Fold the counters of every thread that has run for tenant
+void GritVMHost::foldAll(Tenant& tenant) {
+    std::lock_guard<std::mutex> lock(tenant.pendingMutex);
+    for (Pending* other : tenant.pending) {
+        fold(*other);
+    }
+}
+
+void GritVMHost::flush() {
+    auto& local = localPending();
+    for (auto it = local.begin(); it != local.end(); ) {
+        if (it->first.first == hostId) {
+            it = local.erase(it);
+        } else {
+            ++it;
+        }
+    }
+}
+
+// Claim cells from the tenant's memory quota, unlimited quotas are not tracked
+bool GritVMHost::reserveCells(Tenant& tenant, size_t cells, size_t quota) {
+    if (quota == SIZE_MAX) {
+        return true;
+    }
+    size_t reserved = tenant.cellsReserved.load();
+    do {
+        if (cells > quota - std::min(reserved, quota)) {
+            return false;
+        }
+    } while (!tenant.cellsReserved.compare_exchange_weak(reserved, reserved + cells));
+    return true;
+}
+
+STATUS GritVMHost::run(const std::string& name, GritVM& vm) {
+    TenantQuota quota;
+    std::shared_ptr<Tenant> tenant = find(name, &quota);
+    Pending& mine = pending(tenant);
+
+    // Hold only the cells the rest of the run can reach, all the VM may have
+    // when that has no bound
+    size_t cap = std::min(quota.cellsPerVM, quota.cells);
+    size_t cells = cap;
+    size_t growth;
+    VMState state = vm.inspect();
+    if (!vm.decoding() && GVMAnalysis::peakGrowth(state.program, growth, state.pc)) {
+        cells = std::min(cap, state.memory.size + std::min(growth, SIZE_MAX - state.memory.size));
+    }
+
+    unsigned long used = tenant->instructions.load(std::memory_order_relaxed)
+                       + mine.instructions.load(std::memory_order_relaxed);
+    if (used >= quota.instructions || !reserveCells(*tenant, cells, quota.cells)) {
+        tenant->paused.fetch_add(1, std::memory_order_relaxed);
+        return PAUSED;
+    }
+
+    unsigned long before = vm.instructionsRetired();
+    vm.setLimits(cells, saturatingAdd(before, quota.instructionsPerRun));
+    vm.setInstructionBudget(saturatingAdd(before, quota.instructions - used));
+    STATUS status = vm.run();
+
+    if (quota.cells != SIZE_MAX) {
+        tenant->cellsReserved.fetch_sub(cells);
+    }
+    if (status == PAUSED) {
+        tenant->paused.fetch_add(1, std::memory_order_relaxed);
+    } else if (status == ERRORED) {
+        tenant->errored.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    mine.instructions.fetch_add(vm.instructionsRetired() - before, std::memory_order_relaxed);
+    mine.runs.fetch_add(1, std::memory_order_relaxed);
+    if (++mine.runsSinceFold >= flushEvery) {
+        mine.runsSinceFold = 0;
+        fold(mine);
+    }
+    return status;
+}
+
+STATUS GritVMHost::submit(const std::string& name, GritVM& vm, const std::string& filename,
+                          const std::vector<long>& initialMemory) {
+    TenantQuota quota;
+    find(name, &quota);
+    vm.setLimits(std::min(quota.cellsPerVM, quota.cells), quota.instructionsPerRun);
+
+    STATUS status = vm.load(filename, initialMemory);
+    if (status != READY) {
+        return status;
+    }
+    return run(name, vm);
+}
+
+TenantUsage GritVMHost::usage(const std::string& name) {
+    std::shared_ptr<Tenant> tenant = find(name);
+    foldAll(*tenant);
+
+    TenantUsage usage;
+    usage.instructions = tenant->instructions.load();
+    usage.totalInstructions = tenant->totalInstructions.load();
+    usage.runs = tenant->runs.load();
+    usage.paused = tenant->paused.load();
+    usage.errored = tenant->errored.load();
+    usage.cellsReserved = tenant->cellsReserved.load();
+    return usage;
+}
+
+void GritVMHost::newPeriod() {
+    std::lock_guard<std::mutex> lock(tenantsMutex);
+    for (auto& item : tenants) {
+        // Usage from before the new period still counts towards the total
+        foldAll(*item.second);
+        item.second->instructions.store(0);
+    }
+}
@@ -0,0 +1,110 @@
+#ifndef GRITVMHOST_H
+#define GRITVMHOST_H
+
+#include "GritVM.hpp"
+#include <atomic>
+#include <climits>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <string>
+#include <vector>
+
+// Limits applied to every run of one tenant
+struct TenantQuota {
+    size_t cellsPerVM = SIZE_MAX;                  // Largest data memory a single VM may hold
+    size_t cells = SIZE_MAX;                       // Cells the tenant's running VMs may hold together
+    unsigned long instructionsPerRun = ULONG_MAX;  // A run retiring more is ERRORED, counted afresh for each run() of a paused VM
+    unsigned long instructions = ULONG_MAX;        // Budget per accounting period, runs past it are PAUSED
+};
+
+// Aggregated usage of one tenant
+struct TenantUsage {
+    unsigned long instructions = 0;                // Retired in the current accounting period
+    unsigned long totalInstructions = 0;           // Retired since the tenant was added
+    unsigned long runs = 0;                        // Calls to run() that executed code
+    unsigned long paused = 0;                      // Runs paused or not started for lack of quota
+    unsigned long errored = 0;                     // Runs that ended ERRORED, including cap violations
+    size_t cellsReserved = 0;                      // Cells reserved by runs in progress
+};
+
+// Runs GritVMs on behalf of tenants. Each run gets a per-VM memory cap and an
+// instruction budget carved out of the tenant's quota, and holds the cells it
+// can reach (see GVMAnalysis::peakGrowth()) against the tenant's cell quota
+// while it runs. Instruction usage is counted in per-thread counters that only
+// their own thread adds to, so concurrent runs never contend on them. They are
+// folded into the tenant totals every flushEvery runs, when their thread
+// exits, and whenever usage() or newPeriod() reads the totals; between folds
+// admission decisions may miss up to flushEvery runs' worth of usage per
+// other thread.
+class GritVMHost {
+public:
+    explicit GritVMHost(unsigned flushEvery = 32);
+
+    // Register a tenant or replace its quota
+    void addTenant(const std::string& tenant, const TenantQuota& quota);
+
+    // Run (or continue) an already loaded vm for tenant. Returns PAUSED without
+    // running when the tenant's instruction budget or cell quota is used up,
+    // or when the budget runs out part way; calling run() again later continues.
+    // Throws std::invalid_argument for an unknown tenant
+    STATUS run(const std::string& tenant, GritVM& vm);
+
+    // Load filename under the tenant's memory cap, then run it
+    STATUS submit(const std::string& tenant, GritVM& vm, const std::string& filename,
+                  const std::vector<long>& initialMemory);
+
+    // Usage including every thread's pending counters
+    TenantUsage usage(const std::string& tenant);
+
+    // Start a new accounting period, clearing per-period instruction usage
+    void newPeriod();
+
+    // Fold this thread's pending counters into the tenant totals now
+    void flush();
+
+private:
+    struct Pending;
+
+    struct Tenant {
+        TenantQuota quota;
+        std::atomic<unsigned long> instructions{0};
+        std::atomic<unsigned long> totalInstructions{0};
+        std::atomic<unsigned long> runs{0};
+        std::atomic<unsigned long> paused{0};
+        std::atomic<unsigned long> errored{0};
+        std::atomic<size_t> cellsReserved{0};
+        std::mutex pendingMutex;
+        std::set<Pending*> pending;                // Every thread's counters for this tenant
+    };
+
+    // Counters a thread has not yet folded into its Tenant. Only the owning
+    // thread adds to them; a fold from any thread takes them with exchange()
+    struct Pending {
+        std::shared_ptr<Tenant> tenant;
+        std::atomic<unsigned long> instructions{0};
+        std::atomic<unsigned long> runs{0};
+        unsigned runsSinceFold = 0;
+
+        explicit Pending(std::shared_ptr<Tenant> tenant);
+        ~Pending();                                // Folds what is left, e.g. when the thread exits
+    };
+
+    typedef std::map<std::pair<uint64_t, const void*>, std::unique_ptr<Pending>> PendingMap;
+
+    const unsigned flushEvery;
+    const uint64_t hostId;                         // Keys this host's thread-local counters
+    std::mutex tenantsMutex;
+    std::map<std::string, std::shared_ptr<Tenant>> tenants;
+
+    std::shared_ptr<Tenant> find(const std::string& tenant, TenantQuota* quota = nullptr);
+    static PendingMap& localPending();
+    Pending& pending(const std::shared_ptr<Tenant>& tenant);
+    static void fold(Pending& pending);
+    static void foldAll(Tenant& tenant);
+    static bool reserveCells(Tenant& tenant, size_t cells, size_t quota);
+};
+
+#endif // GRITVMHOST_H
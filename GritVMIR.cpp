@@ -0,0 +1,689 @@
+#include "GritVMIR.hpp"
+#include "GritVMAnalysis.hpp"
+#include "GritVMTrace.hpp"
+#include <algorithm>
+#include <map>
+#include <set>
+
+namespace {
+  using namespace GVMIR;
+
+  // SSA construction after Braun et al., "Simple and Efficient Construction of
+  // Static Single Assignment Form". Blocks are filled in program order; a
+  // block is sealed once all its predecessors are filled, and reads in an
+  // unsealed block get a phi whose operands are added when it is sealed
+  class Builder {
+  public:
+    explicit Builder(Function& function)
+      : fn(function), defs(function.blocks.size()), incomplete(function.blocks.size()),
+        unfilled(function.blocks.size()), sealed(function.blocks.size(), false) {
+      for (size_t b = 0; b < fn.blocks.size(); b++) {
+        unfilled[b] = fn.blocks[b].preds.size();
+        if (unfilled[b] == 0) sealed[b] = true;
+      }
+    }
+
+    void write(long home, size_t block, size_t value) {
+      defs[block][home] = value;
+    }
+
+    // The version of home live at the end of block
+    size_t read(long home, size_t block) {
+      std::vector<size_t> path;
+      std::set<size_t> seen;
+      size_t value;
+      while (true) {
+        auto found = defs[block].find(home);
+        if (found != defs[block].end()) {
+          value = found->second;
+          break;
+        }
+        const std::vector<size_t>& preds = fn.blocks[block].preds;
+        if (!sealed[block]) {
+          value = fn.add(IR_PHI, home, 0, {}, block, fn.blocks[block].origin);
+          incomplete[block][home] = value;
+          write(home, block, value);
+          break;
+        }
+        if (preds.size() == 1 && seen.insert(block).second) {
+          // Follow straight-line chains without recursing
+          path.push_back(block);
+          block = preds[0];
+          continue;
+        }
+        if (preds.size() <= 1) {
+          value = param(home);
+        } else {
+          value = fn.add(IR_PHI, home, 0, {}, block, fn.blocks[block].origin);
+          write(home, block, value);
+          addOperands(value, block);
+        }
+        break;
+      }
+      for (size_t visited : path) {
+        write(home, visited, value);
+      }
+      return value;
+    }
+
+    // All of block's values are built; seal the successors this completes
+    void filled(size_t block) {
+      for (size_t succ : fn.successors(block)) {
+        if (--unfilled[succ] == 0) seal(succ);
+      }
+    }
+
+  private:
+    Function& fn;
+    std::vector<std::map<long, size_t>> defs;      // Current version of each home per block
+    std::vector<std::map<long, size_t>> incomplete; // Phis waiting for their block to be sealed
+    std::vector<size_t> unfilled;                  // Predecessors not filled yet
+    std::vector<bool> sealed;
+    std::map<long, size_t> params;
+
+    void seal(size_t block) {
+      sealed[block] = true;
+      for (auto& phi : incomplete[block]) {
+        addOperands(phi.second, block);
+      }
+      incomplete[block].clear();
+    }
+
+    void addOperands(size_t phi, size_t block) {
+      std::vector<size_t> operands;
+      for (size_t pred : fn.blocks[block].preds) {
+        operands.push_back(read(fn.values[phi].home, pred));
+      }
+      fn.values[phi].operands = operands;
+    }
+
+    size_t param(long home) {
+      auto found = params.find(home);
+      if (found != params.end()) return found->second;
+      size_t value = fn.add(IR_PARAM, home, home == HOME_ACC ? 0 : home, {}, 0, 0);
+      params[home] = value;
+      return value;
+    }
+  };
+
+  OPCODE arithmetic(INSTRUCTION_SET op) {
+    switch (op) {
+      case ADDCONST: case ADDMEM: return IR_ADD;
+      case SUBCONST: case SUBMEM: return IR_SUB;
+      case MULCONST: case MULMEM: return IR_MUL;
+      default:                    return IR_DIV;
+    }
+  }
+
+  INSTRUCTION_SET constForm(OPCODE op) {
+    switch (op) {
+      case IR_ADD: return ADDCONST;
+      case IR_SUB: return SUBCONST;
+      case IR_MUL: return MULCONST;
+      default:     return DIVCONST;
+    }
+  }
+
+  INSTRUCTION_SET memForm(OPCODE op) {
+    switch (op) {
+      case IR_ADD: return ADDMEM;
+      case IR_SUB: return SUBMEM;
+      case IR_MUL: return MULMEM;
+      default:     return DIVMEM;
+    }
+  }
+
+  INSTRUCTION_SET tempForm(OPCODE op) {
+    switch (op) {
+      case IR_ADD: return ADDTMP;
+      case IR_SUB: return SUBTMP;
+      case IR_MUL: return MULTMP;
+      default:     return DIVTMP;
+    }
+  }
+
+  INSTRUCTION_SET rawForm(INSTRUCTION_SET op) {
+    switch (op) {
+      case AT:     return ATRAW;
+      case SET:    return SETRAW;
+      case ADDMEM: return ADDRAW;
+      case SUBMEM: return SUBRAW;
+      case MULMEM: return MULRAW;
+      case DIVMEM: return DIVRAW;
+      default:     return op;
+    }
+  }
+
+  // Follow phis folded into other values until a live value is reached
+  size_t resolve(const std::vector<size_t>& replaced, size_t value) {
+    while (value != NO_VALUE && replaced[value] != NO_VALUE) {
+      value = replaced[value];
+    }
+    return value;
+  }
+
+  // Replace phis whose operands are all one value (or the phi itself) by that value
+  void removeTrivialPhis(Function& fn) {
+    std::vector<size_t> replaced(fn.values.size(), NO_VALUE);
+    bool changed = true;
+    while (changed) {
+      changed = false;
+      for (size_t v = 0; v < fn.values.size(); v++) {
+        Value& phi = fn.values[v];
+        if (phi.op != IR_PHI || replaced[v] != NO_VALUE) continue;
+        size_t same = NO_VALUE;
+        bool trivial = true;
+        for (size_t operand : phi.operands) {
+          operand = resolve(replaced, operand);
+          if (operand == same || operand == v) continue;
+          if (same != NO_VALUE) {
+            trivial = false;
+            break;
+          }
+          same = operand;
+        }
+        if (trivial && same != NO_VALUE) {
+          replaced[v] = same;
+          changed = true;
+        }
+      }
+    }
+
+    for (size_t v = 0; v < fn.values.size(); v++) {
+      if (replaced[v] != NO_VALUE) {
+        fn.values[v].op = IR_REMOVED;
+        fn.values[v].operands.clear();
+        continue;
+      }
+      for (size_t& operand : fn.values[v].operands) {
+        operand = resolve(replaced, operand);
+      }
+    }
+    for (Block& block : fn.blocks) {
+      block.condition = resolve(replaced, block.condition);
+      std::vector<size_t> kept;
+      for (size_t v : block.values) {
+        if (fn.values[v].op != IR_REMOVED) kept.push_back(v);
+      }
+      block.values = kept;
+    }
+  }
+
+  // Writes the GVM instructions for one value at a time
+  class Emitter {
+  public:
+    Emitter(const Function& function, std::vector<Instruction>& program, std::vector<size_t>* origins)
+      : fn(function), out(program), origins(origins) {}
+
+    void emit(INSTRUCTION_SET op, long argument, size_t origin) {
+      out.push_back(Instruction(unchecked ? rawForm(op) : op, argument));
+      if (origins) origins->push_back(blockOrigin != NO_VALUE ? blockOrigin : origin);
+      blockOrigin = NO_VALUE;
+    }
+
+    // The next instruction emitted starts a block that begins at origin
+    void startBlock(size_t origin) {
+      blockOrigin = origin;
+    }
+
+    // Cell accesses skip the bounds check while set
+    void setUnchecked(bool set) {
+      unchecked = set;
+    }
+
+    // Make value the accumulator's contents, false if it has nowhere to come from
+    bool toAccumulator(size_t value, size_t origin) {
+      const Value& v = fn.values[value];
+      if (v.home == HOME_ACC) return true;
+      if (v.home >= 0) {
+        emit(AT, v.home, origin);
+        return true;
+      }
+      if (isTemp(v.home)) {
+        emit(ATTMP, static_cast<long>(tempIndex(v.home)), origin);
+        return true;
+      }
+      if (v.op == IR_CONST) {
+        emit(CLEAR, 0, origin);
+        if (v.argument != 0) emit(ADDCONST, v.argument, origin);
+        return true;
+      }
+      if (v.op == IR_LOAD) {
+        emit(AT, v.argument, origin);
+        return true;
+      }
+      return false;
+    }
+
+    // Values are computed in the accumulator, then moved to their home
+    bool value(size_t index) {
+      const Value& v = fn.values[index];
+      if (!compute(v)) return false;
+      if (v.home >= 0 && v.op != IR_PARAM && v.op != IR_PHI) {
+        emit(SET, v.home, v.origin);
+      } else if (isTemp(v.home) && v.op != IR_PARAM && v.op != IR_PHI) {
+        emit(SETTMP, static_cast<long>(tempIndex(v.home)), v.origin);
+      }
+      return true;
+    }
+
+  private:
+    const Function& fn;
+    std::vector<Instruction>& out;
+    std::vector<size_t>* origins;
+    bool unchecked = false;
+    size_t blockOrigin = NO_VALUE;
+
+    bool compute(const Value& v) {
+      switch (v.op) {
+        case IR_PARAM: case IR_PHI: case IR_REMOVED:
+          return true;
+        case IR_CONST:
+          // Immediates are emitted by their users
+          if (v.home == HOME_NONE) return true;
+          emit(CLEAR, 0, v.origin);
+          if (v.argument != 0) emit(ADDCONST, v.argument, v.origin);
+          return true;
+        case IR_COPY:
+          return toAccumulator(v.operands[0], v.origin);
+        case IR_ADD: case IR_SUB: case IR_MUL: case IR_DIV: {
+          if (!toAccumulator(v.operands[0], v.origin)) return false;
+          const Value& rhs = fn.values[v.operands[1]];
+          if (rhs.op == IR_CONST && rhs.home == HOME_NONE) {
+            emit(constForm(v.op), rhs.argument, v.origin);
+          } else if (rhs.home >= 0) {
+            emit(memForm(v.op), rhs.home, v.origin);
+          } else if (isTemp(rhs.home)) {
+            emit(tempForm(v.op), static_cast<long>(tempIndex(rhs.home)), v.origin);
+          } else if (rhs.op == IR_LOAD && rhs.home == HOME_NONE) {
+            emit(memForm(v.op), rhs.argument, v.origin);
+          } else {
+            return false;
+          }
+          return true;
+        }
+        case IR_LOAD:
+          if (v.home != HOME_NONE) emit(AT, v.argument, v.origin);
+          return true;
+        case IR_STORE:
+          if (!toAccumulator(v.operands[0], v.origin)) return false;
+          emit(SET, v.argument, v.origin);
+          return true;
+        case IR_INSERT:
+          if (!toAccumulator(v.operands[0], v.origin)) return false;
+          emit(INSERT, v.argument, v.origin);
+          return true;
+        case IR_ERASE:
+          emit(ERASE, v.argument, v.origin);
+          return true;
+        case IR_CHECKMEM:
+          emit(CHECKMEM, v.argument, v.origin);
+          return true;
+        case IR_OUTPUT:
+          if (!toAccumulator(v.operands[0], v.origin)) return false;
+          emit(OUTPUT, 0, v.origin);
+          return true;
+      }
+      return false;
+    }
+  };
+}
+
+size_t GVMIR::Function::add(OPCODE op, long home, long argument, std::vector<size_t> operands,
+                            size_t block, size_t origin) {
+  values.push_back(Value{ op, home, argument, std::move(operands), block, origin });
+  size_t index = values.size() - 1;
+  std::vector<size_t>& list = blocks[block].values;
+  if (op == IR_PHI) {
+    // Phis stay ahead of everything else in their block
+    size_t at = 0;
+    while (at < list.size() && values[list[at]].op == IR_PHI) at++;
+    list.insert(list.begin() + at, index);
+  } else if (op == IR_PARAM) {
+    list.insert(list.begin(), index);
+  } else {
+    list.push_back(index);
+  }
+  return index;
+}
+
+std::vector<size_t> GVMIR::Function::successors(size_t block) const {
+  const Block& b = blocks[block];
+  std::vector<size_t> out;
+  switch (b.kind) {
+    case TERM_JUMP:
+      if (b.taken != EXIT_BLOCK) out.push_back(b.taken);
+      break;
+    case TERM_ZERO: case TERM_NONZERO:
+      if (b.taken != EXIT_BLOCK) out.push_back(b.taken);
+      if (b.next != EXIT_BLOCK && b.next != b.taken) out.push_back(b.next);
+      break;
+    default:
+      break;
+  }
+  return out;
+}
+
+bool GVMIR::build(GVMView<Instruction> program, Function& fn) {
+  GVMTrace::Span span("ssa-build");
+  fn = Function();
+  bool promote = GVMAnalysis::hasFixedLayout(program);
+  for (const Instruction& inst : program) {
+    // INPUT takes a value from outside on every execution and has no IR form
+    if (inst.operation >= UNKNOWN_INSTRUCTION || inst.operation == INPUT) return false;
+    if (GVMAnalysis::isCellAccess(inst.operation) && inst.argument < 0) promote = false;
+  }
+  fn.promotedCells = promote;
+
+  // Block 0 is the entry, then one block per leader in program order
+  std::vector<bool> leaders = GVMAnalysis::blockLeaders(program);
+  std::vector<size_t> blockAt(program.size + 1, EXIT_BLOCK);
+  fn.blocks.emplace_back();
+  for (size_t pc = 0; pc < program.size; pc++) {
+    if (leaders[pc]) {
+      blockAt[pc] = fn.blocks.size();
+      fn.blocks.emplace_back();
+      fn.blocks.back().origin = pc;
+    }
+  }
+  for (size_t b = 0; b < fn.blocks.size(); b++) fn.layout.push_back(b);
+  fn.blocks[0].taken = program.empty() ? EXIT_BLOCK : 1;
+
+  // Terminators, from the last instruction of each block
+  for (size_t b = 1; b < fn.blocks.size(); b++) {
+    Block& block = fn.blocks[b];
+    size_t end = (b + 1 < fn.blocks.size()) ? fn.blocks[b + 1].origin : program.size;
+    const Instruction& last = program[end - 1];
+    size_t following = (b + 1 < fn.blocks.size()) ? b + 1 : EXIT_BLOCK;
+    block.next = following;
+    if (GVMAnalysis::isJump(last.operation)) {
+      if (last.argument == 0) {
+        block.kind = TERM_TRAP;
+        block.trap = last;
+      } else {
+        block.kind = (last.operation == JUMPREL) ? TERM_JUMP
+                   : (last.operation == JUMPZERO) ? TERM_ZERO : TERM_NONZERO;
+        block.taken = blockAt[GVMAnalysis::jumpTarget(program, end - 1)];
+      }
+    } else if (last.operation == HALT) {
+      block.kind = TERM_HALT;
+    } else {
+      block.taken = following;
+    }
+  }
+  for (size_t b = 0; b < fn.blocks.size(); b++) {
+    for (size_t succ : fn.successors(b)) {
+      fn.blocks[succ].preds.push_back(b);
+    }
+  }
+
+  Builder ssa(fn);
+  ssa.filled(0);
+  for (size_t b = 1; b < fn.blocks.size(); b++) {
+    size_t end = (b + 1 < fn.blocks.size()) ? fn.blocks[b + 1].origin : program.size;
+    for (size_t pc = fn.blocks[b].origin; pc < end; pc++) {
+      const Instruction& inst = program[pc];
+      long k = inst.argument;
+      switch (inst.operation) {
+        case CLEAR:
+          ssa.write(HOME_ACC, b, fn.add(IR_CONST, HOME_ACC, 0, {}, b, pc));
+          break;
+        case AT:
+          ssa.write(HOME_ACC, b, promote ? fn.add(IR_COPY, HOME_ACC, 0, { ssa.read(k, b) }, b, pc)
+                                         : fn.add(IR_LOAD, HOME_ACC, k, {}, b, pc));
+          break;
+        case SET:
+          if (promote) {
+            ssa.write(k, b, fn.add(IR_COPY, k, 0, { ssa.read(HOME_ACC, b) }, b, pc));
+          } else {
+            fn.add(IR_STORE, HOME_NONE, k, { ssa.read(HOME_ACC, b) }, b, pc);
+          }
+          break;
+        case INSERT:
+          fn.add(IR_INSERT, HOME_NONE, k, { ssa.read(HOME_ACC, b) }, b, pc);
+          break;
+        case ERASE:
+          fn.add(IR_ERASE, HOME_NONE, k, {}, b, pc);
+          break;
+        case ADDCONST: case SUBCONST: case MULCONST: case DIVCONST: {
+          size_t acc = ssa.read(HOME_ACC, b);
+          size_t constant = fn.add(IR_CONST, HOME_NONE, k, {}, b, pc);
+          ssa.write(HOME_ACC, b, fn.add(arithmetic(inst.operation), HOME_ACC, 0, { acc, constant }, b, pc));
+          break;
+        }
+        case ADDMEM: case SUBMEM: case MULMEM: case DIVMEM: {
+          size_t acc = ssa.read(HOME_ACC, b);
+          size_t cell = promote ? ssa.read(k, b) : fn.add(IR_LOAD, HOME_NONE, k, {}, b, pc);
+          ssa.write(HOME_ACC, b, fn.add(arithmetic(inst.operation), HOME_ACC, 0, { acc, cell }, b, pc));
+          break;
+        }
+        case OUTPUT:
+          fn.add(IR_OUTPUT, HOME_NONE, 0, { ssa.read(HOME_ACC, b) }, b, pc);
+          break;
+        case CHECKMEM:
+          fn.add(IR_CHECKMEM, HOME_NONE, k, {}, b, pc);
+          break;
+        case JUMPZERO: case JUMPNZERO:
+          if (fn.blocks[b].kind != TERM_TRAP) {
+            fn.blocks[b].condition = ssa.read(HOME_ACC, b);
+          }
+          break;
+        default:
+          // NOOP, HALT and JUMPREL produce no values
+          break;
+      }
+    }
+    ssa.filled(b);
+  }
+
+  removeTrivialPhis(fn);
+  return true;
+}
+
+bool GVMIR::lower(const Function& fn, std::vector<Instruction>& program, std::vector<size_t>* origins) {
+  GVMTrace::Span span("ssa-lower");
+  program.clear();
+  if (origins) origins->clear();
+  Emitter emitter(fn, program, origins);
+
+  std::vector<size_t> loopOf(fn.blocks.size(), NO_VALUE);
+  for (size_t l = 0; l < fn.versioned.size(); l++) {
+    for (size_t b : fn.versioned[l].blocks) loopOf[b] = l;
+  }
+
+  struct Fixup {
+    size_t at;
+    size_t target;
+    size_t from;
+    bool   fast;
+  };
+  std::vector<size_t> start(fn.blocks.size(), NO_VALUE);
+  std::vector<size_t> fastStart(fn.blocks.size(), NO_VALUE);
+  std::vector<size_t> guardStart(fn.versioned.size(), NO_VALUE);
+  std::vector<Fixup> fixups;
+
+  // Where a jump out of block from lands, NO_VALUE if not emitted yet. The
+  // unchecked copy of a loop stays in itself, and entering a versioned loop
+  // from outside goes through its guard
+  auto entry = [&](size_t target, size_t from, bool fast) {
+    size_t loop = loopOf[target];
+    if (fast && loop != NO_VALUE && loop == loopOf[from]) return fastStart[target];
+    if (loop != NO_VALUE && fn.versioned[loop].header == target && loopOf[from] != loop) return guardStart[loop];
+    return start[target];
+  };
+
+  auto jump = [&](INSTRUCTION_SET op, size_t target, size_t from, bool fast, size_t origin) {
+    // A jump back to where it is emitted would have distance 0, which is an error
+    if (target != EXIT_BLOCK && entry(target, from, fast) == program.size()) {
+      emitter.emit(NOOP, 0, origin);
+    }
+    fixups.push_back({ program.size(), target, from, fast });
+    emitter.emit(op, 0, origin);
+  };
+
+  // following is the block reached by falling off the end of b
+  auto emitBlock = [&](size_t b, size_t following, bool fast) {
+    const Block& block = fn.blocks[b];
+    emitter.startBlock(block.origin);
+    for (size_t v : block.values) {
+      if (!emitter.value(v)) return false;
+    }
+    size_t origin = block.origin;
+    if (!block.values.empty()) origin = fn.values[block.values.back()].origin;
+
+    switch (block.kind) {
+      case TERM_JUMP:
+        if (block.taken != following) jump(JUMPREL, block.taken, b, fast, origin);
+        break;
+      case TERM_ZERO: case TERM_NONZERO:
+        if (!emitter.toAccumulator(block.condition, origin)) return false;
+        jump(block.kind == TERM_ZERO ? JUMPZERO : JUMPNZERO, block.taken, b, fast, origin);
+        if (block.next != following) jump(JUMPREL, block.next, b, fast, origin);
+        break;
+      case TERM_HALT:
+        emitter.emit(HALT, 0, origin);
+        break;
+      case TERM_TRAP:
+        emitter.emit(block.trap.operation, block.trap.argument, origin);
+        break;
+    }
+    return true;
+  };
+
+  // With loop copies after it, the last block cannot fall off the end of the program
+  size_t nothing = fn.blocks.size();
+  for (size_t i = 0; i < fn.layout.size(); i++) {
+    size_t b = fn.layout[i];
+    size_t following = (i + 1 < fn.layout.size()) ? fn.layout[i + 1]
+                     : fn.versioned.empty() ? EXIT_BLOCK : nothing;
+    size_t loop = loopOf[b];
+    if (loop != NO_VALUE && fn.versioned[loop].header == b) {
+      guardStart[loop] = program.size();
+      emitter.emit(MEMGUARD, fn.versioned[loop].cells, fn.blocks[b].origin);
+      jump(JUMPREL, b, b, true, fn.blocks[b].origin);
+    }
+    start[b] = program.size();
+    if (!emitBlock(b, following, false)) return false;
+  }
+
+  for (const VersionedLoop& loop : fn.versioned) {
+    emitter.setUnchecked(true);
+    for (size_t i = 0; i < loop.blocks.size(); i++) {
+      fastStart[loop.blocks[i]] = program.size();
+      if (!emitBlock(loop.blocks[i], (i + 1 < loop.blocks.size()) ? loop.blocks[i + 1] : nothing, true)) {
+        return false;
+      }
+    }
+    emitter.setUnchecked(false);
+  }
+
+  // An empty program would never run, where the program it came from halts
+  if (program.empty() && fn.blocks.size() > 1) {
+    emitter.emit(NOOP, 0, fn.blocks[1].origin);
+  }
+
+  for (const Fixup& fixup : fixups) {
+    size_t target = (fixup.target == EXIT_BLOCK) ? program.size() : entry(fixup.target, fixup.from, fixup.fast);
+    program[fixup.at].argument = static_cast<long>(target) - static_cast<long>(fixup.at);
+  }
+  return true;
+}
+
+std::string GVMIR::verify(const Function& fn) {
+  GVMTrace::Span span("verify");
+  if (fn.blocks.empty()) return "no entry block";
+  std::set<size_t> laidOut(fn.layout.begin(), fn.layout.end());
+  if (laidOut.size() != fn.blocks.size() || fn.layout.size() != fn.blocks.size()) {
+    return "layout does not list every block once";
+  }
+  if (fn.layout[0] != 0) return "entry block is not laid out first";
+
+  for (size_t b = 0; b < fn.blocks.size(); b++) {
+    const Block& block = fn.blocks[b];
+    std::string where = "block " + std::to_string(b) + ": ";
+    for (size_t target : { block.taken, block.next }) {
+      if (target != EXIT_BLOCK && target >= fn.blocks.size()) return where + "jumps to a missing block";
+    }
+    if ((block.kind == TERM_ZERO || block.kind == TERM_NONZERO)
+        && (block.condition >= fn.values.size() || fn.values[block.condition].op == IR_REMOVED)) {
+      return where + "branch without a condition";
+    }
+    bool pastPhis = false;
+    for (size_t v : block.values) {
+      if (v >= fn.values.size()) return where + "lists a missing value";
+      const Value& value = fn.values[v];
+      if (value.block != b) return where + "lists value " + std::to_string(v) + " of another block";
+      if (value.op == IR_PHI) {
+        if (pastPhis) return where + "phi " + std::to_string(v) + " after other values";
+        if (value.operands.size() != block.preds.size()) return where + "phi " + std::to_string(v) + " does not match the predecessors";
+      } else if (value.op != IR_PARAM) {
+        pastPhis = true;
+      }
+      for (size_t operand : value.operands) {
+        if (operand >= fn.values.size() || fn.values[operand].op == IR_REMOVED) {
+          return where + "value " + std::to_string(v) + " uses a missing value";
+        }
+      }
+    }
+    for (size_t succ : fn.successors(b)) {
+      const std::vector<size_t>& preds = fn.blocks[succ].preds;
+      if (std::find(preds.begin(), preds.end(), b) == preds.end()) {
+        return where + "is not a predecessor of block " + std::to_string(succ);
+      }
+    }
+  }
+
+  std::set<size_t> versionedBlocks;
+  for (const VersionedLoop& loop : fn.versioned) {
+    if (std::find(loop.blocks.begin(), loop.blocks.end(), loop.header) == loop.blocks.end()) {
+      return "versioned loop at block " + std::to_string(loop.header) + " does not hold its header";
+    }
+    for (size_t b : loop.blocks) {
+      if (b == 0 || b >= fn.blocks.size() || !versionedBlocks.insert(b).second) {
+        return "versioned loop at block " + std::to_string(loop.header) + " lists block " + std::to_string(b) + " badly";
+      }
+    }
+  }
+  return std::string();
+}
+
+void GVMIR::print(std::ostream& out, const Function& fn) {
+  static const char* names[] = { "param", "const", "phi", "copy", "add", "sub", "mul", "div",
+                                 "load", "store", "insert", "erase", "checkmem", "output", "removed" };
+  auto home = [](long h) {
+    return (h == HOME_ACC) ? std::string("acc") : (h == HOME_NONE) ? std::string("-")
+         : isTemp(h) ? "t" + std::to_string(tempIndex(h)) : "[" + std::to_string(h) + "]";
+  };
+  auto target = [](size_t b) {
+    return (b == EXIT_BLOCK) ? std::string("exit") : "b" + std::to_string(b);
+  };
+
+  for (size_t b : fn.layout) {
+    const Block& block = fn.blocks[b];
+    out << "b" << b << ":";
+    for (size_t pred : block.preds) out << " <- b" << pred;
+    out << "\n";
+    for (size_t v : block.values) {
+      const Value& value = fn.values[v];
+      out << "  %" << v << " " << home(value.home) << " = " << names[value.op];
+      if (value.op == IR_CONST || value.op == IR_PARAM || value.op == IR_LOAD || value.op == IR_STORE
+          || value.op == IR_INSERT || value.op == IR_ERASE || value.op == IR_CHECKMEM) {
+        out << " " << value.argument;
+      }
+      for (size_t operand : value.operands) out << " %" << operand;
+      out << "\n";
+    }
+    switch (block.kind) {
+      case TERM_JUMP:    out << "  jump " << target(block.taken) << "\n"; break;
+      case TERM_ZERO:    out << "  if %" << block.condition << " == 0 " << target(block.taken) << " else " << target(block.next) << "\n"; break;
+      case TERM_NONZERO: out << "  if %" << block.condition << " != 0 " << target(block.taken) << " else " << target(block.next) << "\n"; break;
+      case TERM_HALT:    out << "  halt\n"; break;
+      case TERM_TRAP:    out << "  trap " << GVMHelper::instructionName(block.trap.operation) << " 0\n"; break;
+    }
+  }
+  for (const VersionedLoop& loop : fn.versioned) {
+    out << "versioned b" << loop.header << " if cells >= " << loop.cells << ":";
+    for (size_t b : loop.blocks) out << " b" << b;
+    out << "\n";
+  }
+}
@@ -0,0 +1,115 @@
+#ifndef GRITVMIR_H
+#define GRITVMIR_H
+
+#include "GritVMBase.hpp"
+#include <ostream>
+#include <string>
+#include <vector>
+
+// SSA form of a GVM program for the optimization passes and code generators.
+//
+// Every value has a home: the accumulator, a data cell, or none (immediates
+// and side effects). The accumulator is always an SSA variable. Cells are too
+// when the program has a fixed layout (no INSERT or ERASE), in which case AT
+// and SET become copies between homes; otherwise cells stay in memory and are
+// reached through LOAD and STORE. A phi merges the versions of one home at a
+// block with several predecessors.
+//
+// Versions of one home never overlap, so leaving SSA needs no copies: every
+// value is already where lower() expects it. Passes that break that rule
+// must move values to a home of their own, which can be one of the VM's
+// scratch registers.
+namespace GVMIR {
+  const long   HOME_ACC = -1;
+  const long   HOME_NONE = -2;
+  const long   HOME_TEMP0 = -3;                    // Scratch register t is HOME_TEMP0 - t
+  const size_t NO_VALUE = static_cast<size_t>(-1);
+  const size_t EXIT_BLOCK = static_cast<size_t>(-1);   // Jump target that ends the program
+
+  typedef enum _opcode {
+    IR_PARAM,       // Home's value when the program starts (0 for the accumulator)
+    IR_CONST,       // argument
+    IR_PHI,         // One operand per predecessor, in Block::preds order
+    IR_COPY,        // operands[0] moved to this value's home
+    IR_ADD, IR_SUB, IR_MUL, IR_DIV,   // operands[0] op operands[1]
+    IR_LOAD,        // Cell argument read from memory
+    IR_STORE,       // operands[0] written to cell argument
+    IR_INSERT,      // operands[0] inserted at cell argument
+    IR_ERASE,       // Cell argument erased
+    IR_CHECKMEM,    // Error unless memory holds argument cells
+    IR_OUTPUT,      // Print operands[0]
+    IR_REMOVED      // Left behind by a pass, ignored everywhere
+  } OPCODE;
+
+  typedef enum _terminator {
+    TERM_JUMP,      // To taken
+    TERM_ZERO,      // To taken if condition is zero, else to next
+    TERM_NONZERO,   // To taken if condition is not zero, else to next
+    TERM_HALT,
+    TERM_TRAP       // A jump of distance 0, re-emitted as trap so it still errors
+  } TERMINATOR;
+
+  inline long   tempHome(size_t reg) { return HOME_TEMP0 - static_cast<long>(reg); }
+  inline bool   isTemp(long home) { return home <= HOME_TEMP0; }
+  inline size_t tempIndex(long home) { return static_cast<size_t>(HOME_TEMP0 - home); }
+
+  struct Value {
+    OPCODE op;
+    long   home;                                   // HOME_ACC, HOME_NONE, a cell index or a tempHome()
+    long   argument;
+    std::vector<size_t> operands;
+    size_t block;
+    size_t origin;                                 // GVM instruction it came from
+  };
+
+  struct Block {
+    std::vector<size_t> values;                    // Phis first, then in execution order
+    std::vector<size_t> preds;
+    TERMINATOR kind;
+    size_t taken;
+    size_t next;
+    size_t condition;                              // Accumulator value a branch tests
+    Instruction trap;
+    size_t origin;                                 // First GVM instruction, or the jump into it for block 0
+
+    Block() : kind(TERM_JUMP), taken(EXIT_BLOCK), next(EXIT_BLOCK), condition(NO_VALUE), trap(NOOP), origin(0) {}
+  };
+
+  // A loop lower() emits twice: as is, and after the rest of the program as
+  // a copy with unchecked cell accesses. Entering the loop from outside runs
+  // a MEMGUARD that picks the copy once for the whole loop
+  struct VersionedLoop {
+    size_t header;
+    std::vector<size_t> blocks;                    // In layout order
+    long   cells;                                  // Memory size that makes every access in blocks valid
+  };
+
+  struct Function {
+    std::vector<Value> values;
+    std::vector<Block> blocks;                     // blocks[0] is an empty entry holding the params
+    std::vector<size_t> layout;                    // Order lower() emits blocks in
+    bool promotedCells = false;                    // Cells are SSA variables rather than memory
+    std::vector<VersionedLoop> versioned;          // Never sharing a block
+
+    size_t add(OPCODE op, long home, long argument, std::vector<size_t> operands, size_t block, size_t origin);
+    std::vector<size_t> successors(size_t block) const;
+  };
+
+  // Build SSA form of program, false if it holds INPUT or instructions that are not GVM (e.g. BREAKPOINT)
+  bool        build(GVMView<Instruction> program, Function& function);
+
+  // Emit GVM instructions for function; origins, when given, receives the
+  // origin of each emitted instruction. The first instruction of a block
+  // gets the block's origin instead, since every value is in its home there
+  // and the state matches the source program's at that instruction. False
+  // if a value is not where its users can reach it
+  bool        lower(const Function& function, std::vector<Instruction>& program,
+                    std::vector<size_t>* origins = nullptr);
+
+  // Empty when function is well formed, otherwise the first problem found
+  std::string verify(const Function& function);
+
+  void        print(std::ostream& out, const Function& function);
+};
+
+#endif // GRITVMIR_H
@@ -0,0 +1,54 @@
+#include "GritVMInput.hpp"
+#include <algorithm>
+
+bool BufferInput::next(long& value) {
+    if (position >= values.size()) {
+        return false;
+    }
+    value = values[position++];
+    return true;
+}
+
+// A failed extraction zeroes its target, so read into a local
+bool StreamInput::next(long& value) {
+    long read;
+    if (!(in >> read)) {
+        return false;
+    }
+    value = read;
+    return true;
+}
+
+RingBufferInput::RingBufferInput(size_t capacity) : ring(std::max<size_t>(capacity, 1)), head(0), count(0), closed(false) {}
+
+bool RingBufferInput::push(long value) {
+    std::unique_lock<std::mutex> lock(mutex);
+    notFull.wait(lock, [this] { return closed || count < ring.size(); });
+    if (closed) {
+        return false;
+    }
+    ring[(head + count) % ring.size()] = value;
+    count++;
+    notEmpty.notify_one();
+    return true;
+}
+
+void RingBufferInput::close() {
+    std::lock_guard<std::mutex> lock(mutex);
+    closed = true;
+    notFull.notify_all();
+    notEmpty.notify_all();
+}
+
+bool RingBufferInput::next(long& value) {
+    std::unique_lock<std::mutex> lock(mutex);
+    notEmpty.wait(lock, [this] { return closed || count > 0; });
+    if (count == 0) {
+        return false;
+    }
+    value = ring[head];
+    head = (head + 1) % ring.size();
+    count--;
+    notFull.notify_one();
+    return true;
+}
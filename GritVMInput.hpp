@@ -0,0 +1,77 @@
+#ifndef GRITVMINPUT_H
+#define GRITVMINPUT_H
+
+#include <condition_variable>
+#include <istream>
+#include <mutex>
+#include <utility>
+#include <vector>
+
+// Where INPUT instructions take their values from, see GritVM::setInput().
+// A source hands out each value once, so a program reading it holds only the
+// value in hand and can work through input of any length in fixed memory
+class InputSource {
+public:
+    virtual ~InputSource() = default;
+
+    // The next value, false (leaving value alone) once the input has ended
+    virtual bool next(long& value) = 0;
+};
+
+// Values of a vector, in order
+class BufferInput : public InputSource {
+public:
+    explicit BufferInput(std::vector<long> values) : values(std::move(values)), position(0) {}
+
+    bool next(long& value) override;
+
+    // Values handed out so far
+    size_t consumed() const { return position; }
+
+private:
+    std::vector<long> values;
+    size_t position;
+};
+
+// Whitespace separated numbers read from a stream one at a time as INPUT asks
+// for them, so a file or pipe is never read ahead of the program. The input
+// ends at the end of the stream or at the first word that is not a number.
+// The stream must outlive the source
+class StreamInput : public InputSource {
+public:
+    explicit StreamInput(std::istream& in) : in(in) {}
+
+    bool next(long& value) override;
+
+private:
+    std::istream& in;
+};
+
+// Bounded queue between a producer thread and a running program: push()
+// waits while it is full and next() waits while it is empty, so the program
+// runs as fast as the producer feeds it in capacity cells of memory. The
+// input ends once close() is called and the queued values are read.
+// Cancelling the run does not wake an INPUT waiting here; close() does
+class RingBufferInput : public InputSource {
+public:
+    explicit RingBufferInput(size_t capacity);
+
+    // Queue value, false if the buffer was closed
+    bool push(long value);
+
+    // No more values will be pushed
+    void close();
+
+    bool next(long& value) override;
+
+private:
+    std::vector<long> ring;
+    size_t head;                                   // Index of the oldest value
+    size_t count;                                  // Values queued
+    bool closed;
+    std::mutex mutex;
+    std::condition_variable notFull;
+    std::condition_variable notEmpty;
+};
+
+#endif // GRITVMINPUT_H
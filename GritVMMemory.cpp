@@ -0,0 +1,304 @@
+#include "GritVMMemory.hpp"
+#include <cstring>
+#include <mutex>
+#include <stdexcept>
+#include <new>
+
+#ifdef GVM_HAVE_GUARD_PAGES
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+namespace {
+    const size_t MIN_RESERVATION = 1 << 20;          // Bytes, address space only until touched
+    const size_t MAX_GUARD = size_t(1) << 31;        // Bytes, address space only, never touched
+
+    thread_local GuardTrap* armed = nullptr;
+    struct sigaction previous;
+    std::once_flag installed;
+
+    size_t pageSize() {
+        static const size_t size = static_cast<size_t>(sysconf(_SC_PAGESIZE));
+        return size;
+    }
+
+    size_t roundToPages(size_t bytes) {
+        return (bytes + pageSize() - 1) / pageSize() * pageSize();
+    }
+
+    void onFault(int signal, siginfo_t* info, void* context) {
+        GuardTrap* trap = armed;
+        if (trap && trap->memory.inGuard(info->si_addr)) {
+            siglongjmp(trap->landing, 1);
+        }
+        // Not ours: hand it on, or fault again with the default action
+        if ((previous.sa_flags & SA_SIGINFO) && previous.sa_sigaction) {
+            previous.sa_sigaction(signal, info, context);
+        } else if (previous.sa_handler != SIG_DFL && previous.sa_handler != SIG_IGN) {
+            previous.sa_handler(signal);
+        } else {
+            struct sigaction fallback = {};
+            fallback.sa_handler = SIG_DFL;
+            sigaction(SIGSEGV, &fallback, nullptr);
+        }
+    }
+
+    void install() {
+        struct sigaction action = {};
+        action.sa_sigaction = onFault;
+        // SA_NODEFER so leaving the handler by siglongjmp does not leave SIGSEGV blocked
+        action.sa_flags = SA_SIGINFO | SA_NODEFER;
+        sigemptyset(&action.sa_mask);
+        sigaction(SIGSEGV, &action, &previous);
+    }
+}
+
+GuardTrap::GuardTrap(const DataMemory& memory) : memory(memory), outer(armed) {
+    std::call_once(installed, install);
+    armed = this;
+}
+
+GuardTrap::~GuardTrap() {
+    armed = outer;
+}
+#endif
+
+DataMemory::DataMemory() : kind(HEAP), cells(nullptr), count(0), region(nullptr), reserved(0), accessible(0), guard(0), fd(-1) {}
+
+DataMemory::~DataMemory() {
+    release();
+}
+
+bool DataMemory::setBackend(BACKEND backend, const std::string& file) {
+    if (backend == kind && backend != MAPPED) {
+        return true;
+    }
+    std::vector<long> values = toVector();
+    release();
+    if (backend == HEAP) {
+        *this = values;
+        return true;
+    }
+#ifdef GVM_HAVE_GUARD_PAGES
+    if (backend == MAPPED && !file.empty()) {
+        fd = open(file.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    }
+    bool mapped = (backend == MAPPED) ? (file.empty() || fd >= 0) && mapGrowable(values.size())
+                                      : mapGuarded(values.size(), pageSize());
+    if (mapped) {
+        kind = backend;
+        *this = values;
+        return true;
+    }
+    release();
+#else
+    (void)file;
+#endif
+    *this = values;
+    return false;
+}
+
+void DataMemory::reserve(size_t wanted) {
+    if (kind != HEAP) {
+        ensure(wanted);
+        return;
+    }
+    heap.reserve(wanted);
+    cells = heap.data();
+}
+
+void DataMemory::insert(size_t index, long value) {
+    switch (kind) {
+        case HEAP:
+            heap.insert(heap.begin() + index, value);
+            cells = heap.data();
+            count = heap.size();
+            return;
+        case GUARDED: {
+            // The cells below index move down one
+            ensure(count + 1);
+            long* first = cells - 1;
+            std::memmove(first, cells, index * sizeof(long));
+            first[index] = value;
+            cells = first;
+            count++;
+            return;
+        }
+        case MAPPED:
+            ensure(count + 1);
+            std::memmove(cells + index + 1, cells + index, (count - index) * sizeof(long));
+            cells[index] = value;
+            count++;
+            return;
+    }
+}
+
+void DataMemory::erase(size_t index) {
+    switch (kind) {
+        case HEAP:
+            heap.erase(heap.begin() + index);
+            cells = heap.data();
+            count = heap.size();
+            return;
+        case GUARDED:
+            std::memmove(cells + 1, cells, index * sizeof(long));
+            cells++;
+            count--;
+            return;
+        case MAPPED:
+            std::memmove(cells + index, cells + index + 1, (count - index - 1) * sizeof(long));
+            count--;
+            return;
+    }
+}
+
+void DataMemory::clear() {
+    count = 0;
+    if (kind == GUARDED) {
+        cells = end();
+    } else if (kind == HEAP) {
+        heap.clear();
+        cells = heap.data();
+    }
+}
+
+DataMemory& DataMemory::operator=(const std::vector<long>& values) {
+    if (kind == HEAP) {
+        heap = values;
+        cells = heap.data();
+        count = heap.size();
+        return *this;
+    }
+    clear();
+    ensure(values.size());
+    if (kind == GUARDED) cells = end() - values.size();
+    std::copy(values.begin(), values.end(), cells);
+    count = values.size();
+    return *this;
+}
+
+std::vector<long> DataMemory::toVector() const {
+    return std::vector<long>(cells, cells + count);
+}
+
+bool DataMemory::inGuard(const void* address) const {
+    const char* byte = static_cast<const char*>(address);
+    return kind == GUARDED && byte >= region + reserved && byte < region + reserved + guard;
+}
+
+// Moves the cells to a new region when the guard has to grow, which a
+// program pays for once, at the start of its first guarded run
+bool DataMemory::guardReach(size_t cells) {
+#ifdef GVM_HAVE_GUARD_PAGES
+    if (kind != GUARDED || cells > MAX_GUARD / sizeof(long)) {
+        return false;
+    }
+    size_t bytes = roundToPages(cells * sizeof(long));
+    return bytes <= guard || mapGuarded(count, bytes);
+#else
+    (void)cells;
+    return false;
+#endif
+}
+
+void DataMemory::ensure(size_t wanted) {
+#ifdef GVM_HAVE_GUARD_PAGES
+    size_t bytes = wanted * sizeof(long);
+    if (kind == MAPPED) {
+        if (bytes <= reserved) return;
+        // Doubling keeps a long run of INSERTs to few mremap calls; the kernel
+        // moves page table entries, not the cells
+        size_t size = std::max(roundToPages(bytes), reserved * 2);
+        if (fd >= 0 && ftruncate(fd, static_cast<off_t>(size)) != 0) throw std::bad_alloc();
+        void* moved = mremap(region, reserved, size, MREMAP_MAYMOVE);
+        if (moved == MAP_FAILED) throw std::bad_alloc();
+        region = static_cast<char*>(moved);
+        reserved = size;
+        cells = reinterpret_cast<long*>(region);
+        return;
+    }
+
+    if (bytes <= accessible) return;
+    if (bytes > reserved) {
+        if (!mapGuarded(std::max(wanted, reserved / sizeof(long) * 2), guard)) throw std::bad_alloc();
+        return;
+    }
+    // Open up twice what is needed, so a run of INSERTs costs few mprotect calls
+    size_t grown = std::min(reserved, roundToPages(std::max(bytes, accessible * 2)));
+    if (mprotect(region + reserved - grown, grown - accessible, PROT_READ | PROT_WRITE) != 0) {
+        throw std::bad_alloc();
+    }
+    accessible = grown;
+#else
+    (void)wanted;
+#endif
+}
+
+// Reserve a region for wanted cells plus guardBytes of guard and move the cells to its top
+bool DataMemory::mapGuarded(size_t wanted, size_t guardBytes) {
+#ifdef GVM_HAVE_GUARD_PAGES
+    size_t size = std::max(MIN_RESERVATION, roundToPages(wanted * sizeof(long)));
+    guardBytes = std::max(guardBytes, pageSize());
+    void* mapped = mmap(nullptr, size + guardBytes, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (mapped == MAP_FAILED) return false;
+    char* next = static_cast<char*>(mapped);
+    size_t open = std::max(pageSize(), roundToPages(wanted * sizeof(long)));
+    if (mprotect(next + size - open, open, PROT_READ | PROT_WRITE) != 0) {
+        munmap(mapped, size + guardBytes);
+        return false;
+    }
+
+    long* first = reinterpret_cast<long*>(next + size) - count;
+    std::copy(cells, cells + count, first);
+    if (region) munmap(region, reserved + guard);
+    region = next;
+    reserved = size;
+    accessible = open;
+    guard = guardBytes;
+    cells = first;
+    return true;
+#else
+    (void)wanted;
+    (void)guardBytes;
+    return false;
+#endif
+}
+
+// Map fd (or anonymous memory) for wanted cells; only called on empty memory
+bool DataMemory::mapGrowable(size_t wanted) {
+#ifdef GVM_HAVE_GUARD_PAGES
+    size_t size = std::max(MIN_RESERVATION, roundToPages(wanted * sizeof(long)));
+    if (fd >= 0 && ftruncate(fd, static_cast<off_t>(size)) != 0) return false;
+    void* mapped = (fd >= 0) ? mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0)
+                             : mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (mapped == MAP_FAILED) return false;
+    region = static_cast<char*>(mapped);
+    reserved = size;
+    cells = reinterpret_cast<long*>(region);
+    return true;
+#else
+    (void)wanted;
+    return false;
+#endif
+}
+
+void DataMemory::release() {
+#ifdef GVM_HAVE_GUARD_PAGES
+    if (region) {
+        munmap(region, reserved + guard);
+    }
+    if (fd >= 0) {
+        // Leave exactly the cells behind
+        (void)!ftruncate(fd, static_cast<off_t>(count * sizeof(long)));
+        close(fd);
+    }
+#endif
+    kind = HEAP;
+    heap = std::vector<long>();
+    cells = nullptr;
+    count = 0;
+    region = nullptr;
+    reserved = accessible = guard = 0;
+    fd = -1;
+}
@@ -0,0 +1,126 @@
+#ifndef GRITVMMEMORY_H
+#define GRITVMMEMORY_H
+
+#include "GritVMBase.hpp"
+#include <atomic>
+#include <string>
+#include <vector>
+
+#ifdef __linux__
+#include <setjmp.h>
+#define GVM_HAVE_GUARD_PAGES 1
+// Keeps a function out of a caller that calls sigsetjmp, where the compiler
+// would keep its locals in memory rather than registers
+#define GVM_NOINLINE __attribute__((noinline))
+#else
+#define GVM_NOINLINE
+#endif
+
+// Data memory of a GritVM, with three backends:
+//
+// HEAP     A std::vector.
+// GUARDED  The top of an mmap region with PROT_NONE pages right after the
+//          last cell. Growing moves the first cell down rather than the last
+//          one up, so those pages always start exactly one past the end and
+//          every index from size() up to guardReach() lands on them.
+// MAPPED   The bottom of an mmap region that grows in place with mremap, so
+//          growing never copies cells. The region can be a file, shared, so
+//          memory can outgrow RAM through the page cache; when the memory
+//          lets go of the file it is cut to exactly the cells, 8 bytes each
+//          in native byte order.
+//
+// GUARDED and MAPPED are only available on Linux.
+class DataMemory {
+public:
+    typedef enum _backend { HEAP, GUARDED, MAPPED } BACKEND;
+
+    DataMemory();
+    ~DataMemory();
+    DataMemory(const DataMemory&) = delete;
+    DataMemory& operator=(const DataMemory&) = delete;
+
+    // Move the cells to backend (file only applies to MAPPED, empty for an
+    // anonymous mapping). False if backend is not available, in which case
+    // the cells end up on the heap
+    bool setBackend(BACKEND backend, const std::string& file = std::string());
+    BACKEND backend() const { return kind; }
+    bool guarded() const { return kind == GUARDED; }
+
+    size_t size() const { return count; }
+    bool empty() const { return count == 0; }
+    long* data() { return cells; }
+    const long* data() const { return cells; }
+    GVMView<long> view() const { return GVMView<long>(cells, count); }
+    long& operator[](size_t index) { return cells[index]; }
+    long operator[](size_t index) const { return cells[index]; }
+
+    // Guarded memory only: the cell at location, which must be at least 0 and
+    // under guardReach(), without a bounds check. One past the cells faults on
+    // the guard pages; the fence keeps every earlier write visible to whoever
+    // catches that fault
+    long& at(long location) {
+        std::atomic_signal_fence(std::memory_order_seq_cst);
+        return cells[location];
+    }
+
+    // Guarded memory only: widen the guard pages so every location under
+    // cells is either a cell or faults in at(). False, changing nothing, if
+    // that takes more address space than a guard may have
+    bool guardReach(size_t cells);
+
+    // Make room for cells in all, so growing to that many never moves the cells
+    void reserve(size_t cells);
+
+    void insert(size_t index, long value);
+    void erase(size_t index);
+    void clear();
+    DataMemory& operator=(const std::vector<long>& values);
+    std::vector<long> toVector() const;
+
+    // True if address is on this memory's guard pages
+    bool inGuard(const void* address) const;
+
+private:
+    BACKEND kind;
+    std::vector<long> heap;                        // The cells of HEAP memory
+    long* cells;                                   // First cell, in heap or region
+    size_t count;
+    char* region;                                  // mmap region of GUARDED and MAPPED memory
+    size_t reserved;                               // Bytes of region holding cells (below the guard page if GUARDED)
+    size_t accessible;                             // GUARDED: bytes at the top of those that are readable and writable
+    size_t guard;                                  // GUARDED: bytes of PROT_NONE pages after the cells
+    int fd;                                        // File behind MAPPED memory, -1 if anonymous
+
+    long* end() const { return reinterpret_cast<long*>(region + reserved); }
+
+    // Room for wanted cells, growing the region when it is too small
+    void ensure(size_t wanted);
+
+    // Map a new region for wanted cells and move the cells into it
+    bool mapGuarded(size_t wanted, size_t guardBytes);
+    bool mapGrowable(size_t wanted);
+
+    // Unmap the region, leaving an empty heap memory
+    void release();
+};
+
+#ifdef GVM_HAVE_GUARD_PAGES
+// While one exists, a fault on memory's guard page on the constructing thread
+// lands on landing (with sigsetjmp) instead of killing the process. Other
+// SIGSEGVs go to whichever handler was installed before the first GuardTrap
+class GuardTrap {
+public:
+    explicit GuardTrap(const DataMemory& memory);
+    ~GuardTrap();
+    GuardTrap(const GuardTrap&) = delete;
+    GuardTrap& operator=(const GuardTrap&) = delete;
+
+    sigjmp_buf landing;
+    const DataMemory& memory;
+
+private:
+    GuardTrap* outer;                              // Trap this one shadows, restored when it goes
+};
+#endif
+
+#endif // GRITVMMEMORY_H
@@ -0,0 +1,379 @@
+#include "GritVMMetrics.hpp"
+#include <cerrno>
+#include <cstring>
+#include <mutex>
+#include <set>
+#include <sstream>
+#include <stdexcept>
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#define GVM_HAVE_SOCKETS 1
+#endif
+
+using GVMMetrics::LatencyHistogram;
+
+namespace {
+  // Single-writer increment: no read-modify-write instruction is needed
+  void bump(std::atomic<uint64_t>& counter, uint64_t amount = 1) {
+    counter.store(counter.load(std::memory_order_relaxed) + amount, std::memory_order_relaxed);
+  }
+
+  struct Shard;
+
+  std::mutex shardsMutex;                          // Guards shards and retired
+  std::set<Shard*> shards;
+  GVMMetrics::Snapshot retired;                    // Totals of threads that have exited
+
+  // One thread's metrics, registered for as long as the thread lives
+  struct Shard {
+    std::atomic<uint64_t> loads[UNKNOWN + 1] = {};
+    std::atomic<uint64_t> runs[UNKNOWN + 1] = {};
+    std::atomic<uint64_t> faults[FAULT_COUNT] = {};
+    std::atomic<uint64_t> instructions{0};
+    std::atomic<uint64_t> cacheHits{0};
+    std::atomic<uint64_t> cacheMisses{0};
+    LatencyHistogram loadLatency;
+    LatencyHistogram runLatency;
+
+    Shard() {
+      std::lock_guard<std::mutex> lock(shardsMutex);
+      shards.insert(this);
+    }
+
+    ~Shard() {
+      std::lock_guard<std::mutex> lock(shardsMutex);
+      addTo(retired);
+      shards.erase(this);
+    }
+
+    void addTo(GVMMetrics::Snapshot& out) const {
+      for (int s = 0; s <= UNKNOWN; s++) {
+        out.loads[s] += loads[s].load(std::memory_order_relaxed);
+        out.runs[s] += runs[s].load(std::memory_order_relaxed);
+      }
+      for (int f = 0; f < FAULT_COUNT; f++) {
+        out.faults[f] += faults[f].load(std::memory_order_relaxed);
+      }
+      out.instructions += instructions.load(std::memory_order_relaxed);
+      out.cacheHits += cacheHits.load(std::memory_order_relaxed);
+      out.cacheMisses += cacheMisses.load(std::memory_order_relaxed);
+      out.loadLatency.merge(loadLatency);
+      out.runLatency.merge(runLatency);
+    }
+  };
+
+  Shard& localShard() {
+    thread_local Shard shard;
+    return shard;
+  }
+
+  size_t statusIndex(STATUS status) {
+    return (status >= WAITING && status <= UNKNOWN) ? status : UNKNOWN;
+  }
+
+  // Exact decimal seconds, e.g. 1023 -> "0.000001023"
+  std::string seconds(uint64_t nanos) {
+    std::string fraction = std::to_string(nanos % 1000000000 + 1000000000).substr(1);
+    fraction.erase(fraction.find_last_not_of('0') + 1);
+    return std::to_string(nanos / 1000000000) + (fraction.empty() ? "" : "." + fraction);
+  }
+
+  void writeHistogram(std::ostream& out, const char* name, const char* help, const LatencyHistogram& histogram) {
+    out << "# HELP " << name << " " << help << "\n";
+    out << "# TYPE " << name << " histogram\n";
+    // Buckets from 1us to about 68s, doubling. Each limit is an HDR bucket
+    // bound, which is exclusive, so le is one nanosecond under it
+    for (int exponent = 10; exponent <= 36; exponent++) {
+      uint64_t limit = uint64_t(1) << exponent;
+      out << name << "_bucket{le=\"" << seconds(limit - 1) << "\"} "
+          << histogram.countBelow(limit) << "\n";
+    }
+    out << name << "_bucket{le=\"+Inf\"} " << histogram.count() << "\n";
+    out << name << "_sum " << seconds(histogram.sum()) << "\n";
+    out << name << "_count " << histogram.count() << "\n";
+  }
+}
+
+LatencyHistogram::LatencyHistogram() : total(0) {
+  for (auto& bucket : buckets) bucket.store(0, std::memory_order_relaxed);
+}
+
+size_t LatencyHistogram::bucketFor(uint64_t nanos) {
+  const uint64_t sub = uint64_t(1) << SUB_BITS;
+  if (nanos < sub) return static_cast<size_t>(nanos);
+  int msb = 63 - __builtin_clzll(nanos);
+  size_t fraction = static_cast<size_t>((nanos >> (msb - SUB_BITS)) & (sub - 1));
+  return (static_cast<size_t>(msb - SUB_BITS + 1) << SUB_BITS) + fraction;
+}
+
+uint64_t LatencyHistogram::bucketLimit(size_t bucket) {
+  const size_t sub = size_t(1) << SUB_BITS;
+  if (bucket < sub) return bucket + 1;
+  int msb = static_cast<int>(bucket >> SUB_BITS) - 1 + SUB_BITS;
+  uint64_t width = uint64_t(1) << (msb - SUB_BITS);
+  uint64_t lower = (sub + (bucket & (sub - 1))) * width;
+  return (lower + width < lower) ? UINT64_MAX : lower + width;
+}
+
+void LatencyHistogram::record(uint64_t nanos) {
+  bump(buckets[bucketFor(nanos)]);
+  bump(total, nanos);
+}
+
+void LatencyHistogram::merge(const LatencyHistogram& other) {
+  for (size_t i = 0; i < BUCKETS; i++) {
+    uint64_t count = other.buckets[i].load(std::memory_order_relaxed);
+    if (count) bump(buckets[i], count);
+  }
+  bump(total, other.total.load(std::memory_order_relaxed));
+}
+
+uint64_t LatencyHistogram::count() const {
+  uint64_t count = 0;
+  for (auto& bucket : buckets) count += bucket.load(std::memory_order_relaxed);
+  return count;
+}
+
+uint64_t LatencyHistogram::sum() const {
+  return total.load(std::memory_order_relaxed);
+}
+
+uint64_t LatencyHistogram::countBelow(uint64_t nanos) const {
+  uint64_t count = 0;
+  for (size_t i = 0; i < BUCKETS && bucketLimit(i) <= nanos; i++) {
+    count += buckets[i].load(std::memory_order_relaxed);
+  }
+  return count;
+}
+
+uint64_t LatencyHistogram::percentile(double q) const {
+  uint64_t all = count();
+  if (all == 0) return 0;
+  uint64_t wanted = static_cast<uint64_t>(q * static_cast<double>(all));
+  uint64_t seen = 0;
+  for (size_t i = 0; i < BUCKETS; i++) {
+    seen += buckets[i].load(std::memory_order_relaxed);
+    if (seen > wanted || seen == all) return bucketLimit(i);
+  }
+  return UINT64_MAX;
+}
+
+void GVMMetrics::recordLoad(STATUS status, std::chrono::nanoseconds elapsed) {
+  Shard& shard = localShard();
+  bump(shard.loads[statusIndex(status)]);
+  shard.loadLatency.record(static_cast<uint64_t>(elapsed.count()));
+}
+
+void GVMMetrics::recordRun(STATUS status, unsigned long instructions, std::chrono::nanoseconds elapsed) {
+  Shard& shard = localShard();
+  bump(shard.runs[statusIndex(status)]);
+  bump(shard.instructions, instructions);
+  shard.runLatency.record(static_cast<uint64_t>(elapsed.count()));
+}
+
+void GVMMetrics::recordCacheLookup(bool hit) {
+  Shard& shard = localShard();
+  bump(hit ? shard.cacheHits : shard.cacheMisses);
+}
+
+void GVMMetrics::recordFault(FAULT_CODE code) {
+  if (code >= FAULT_NONE && code < FAULT_COUNT) {
+    bump(localShard().faults[code]);
+  }
+}
+
+void GVMMetrics::snapshot(Snapshot& out) {
+  std::lock_guard<std::mutex> lock(shardsMutex);
+  for (int s = 0; s <= UNKNOWN; s++) {
+    out.loads[s] += retired.loads[s];
+    out.runs[s] += retired.runs[s];
+  }
+  for (int f = 0; f < FAULT_COUNT; f++) {
+    out.faults[f] += retired.faults[f];
+  }
+  out.instructions += retired.instructions;
+  out.cacheHits += retired.cacheHits;
+  out.cacheMisses += retired.cacheMisses;
+  out.loadLatency.merge(retired.loadLatency);
+  out.runLatency.merge(retired.runLatency);
+  for (Shard* shard : shards) {
+    shard->addTo(out);
+  }
+}
+
+std::string GVMMetrics::prometheusText() {
+  Snapshot totals;
+  snapshot(totals);
+  std::ostringstream out;
+
+  out << "# HELP gritvm_loads_total Programs loaded, by resulting status\n";
+  out << "# TYPE gritvm_loads_total counter\n";
+  for (int s = 0; s <= UNKNOWN; s++) {
+    if (totals.loads[s] == 0) continue;
+    out << "gritvm_loads_total{status=\"" << GVMHelper::statusToString(static_cast<STATUS>(s)) << "\"} "
+        << totals.loads[s] << "\n";
+  }
+
+  out << "# HELP gritvm_runs_total Calls to run(), by final status\n";
+  out << "# TYPE gritvm_runs_total counter\n";
+  for (int s = 0; s <= UNKNOWN; s++) {
+    if (totals.runs[s] == 0) continue;
+    out << "gritvm_runs_total{status=\"" << GVMHelper::statusToString(static_cast<STATUS>(s)) << "\"} "
+        << totals.runs[s] << "\n";
+  }
+
+  out << "# HELP gritvm_faults_total Loads and runs that ended ERRORED, by reason\n";
+  out << "# TYPE gritvm_faults_total counter\n";
+  for (int f = FAULT_NONE + 1; f < FAULT_COUNT; f++) {
+    if (totals.faults[f] == 0) continue;
+    out << "gritvm_faults_total{reason=\"" << GVMHelper::faultToString(static_cast<FAULT_CODE>(f)) << "\"} "
+        << totals.faults[f] << "\n";
+  }
+
+  out << "# HELP gritvm_instructions_retired_total Instructions executed\n";
+  out << "# TYPE gritvm_instructions_retired_total counter\n";
+  out << "gritvm_instructions_retired_total " << totals.instructions << "\n";
+
+  out << "# HELP gritvm_program_cache_lookups_total Program registry lookups\n";
+  out << "# TYPE gritvm_program_cache_lookups_total counter\n";
+  out << "gritvm_program_cache_lookups_total{result=\"hit\"} " << totals.cacheHits << "\n";
+  out << "gritvm_program_cache_lookups_total{result=\"miss\"} " << totals.cacheMisses << "\n";
+
+  writeHistogram(out, "gritvm_load_duration_seconds", "Time spent in load()", totals.loadLatency);
+  writeHistogram(out, "gritvm_run_duration_seconds", "Time spent in run()", totals.runLatency);
+  return out.str();
+}
+
+GVMMetrics::Endpoint::Endpoint() : listenFd(-1), wakeFd{-1, -1}, boundPort(0) {}
+
+GVMMetrics::Endpoint::~Endpoint() {
+  stop();
+}
+
+#ifdef GVM_HAVE_SOCKETS
+
+void GVMMetrics::Endpoint::listenTcp(unsigned short port) {
+  stop();
+  listenFd = socket(AF_INET, SOCK_STREAM, 0);
+  int reuse = 1;
+  setsockopt(listenFd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+
+  sockaddr_in address = {};
+  address.sin_family = AF_INET;
+  address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  address.sin_port = htons(port);
+  socklen_t length = sizeof(address);
+  if (listenFd < 0 || bind(listenFd, reinterpret_cast<sockaddr*>(&address), sizeof(address)) != 0
+      || getsockname(listenFd, reinterpret_cast<sockaddr*>(&address), &length) != 0) {
+    stop();
+    throw std::runtime_error("Unable to listen for metrics on port " + std::to_string(port));
+  }
+  boundPort = ntohs(address.sin_port);
+  start();
+}
+
+void GVMMetrics::Endpoint::listenUnix(const std::string& path) {
+  stop();
+  sockaddr_un address = {};
+  address.sun_family = AF_UNIX;
+  if (path.size() >= sizeof(address.sun_path)) {
+    throw std::runtime_error("Metrics socket path too long: " + path);
+  }
+  std::strcpy(address.sun_path, path.c_str());
+  unlink(path.c_str());
+
+  listenFd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (listenFd < 0 || bind(listenFd, reinterpret_cast<sockaddr*>(&address), sizeof(address)) != 0) {
+    stop();
+    throw std::runtime_error("Unable to listen for metrics on " + path);
+  }
+  unixPath = path;
+  start();
+}
+
+void GVMMetrics::Endpoint::start() {
+  if (listen(listenFd, 16) != 0 || pipe(wakeFd) != 0) {
+    stop();
+    throw std::runtime_error("Unable to start the metrics endpoint");
+  }
+  server = std::thread(&Endpoint::serve, this);
+}
+
+void GVMMetrics::Endpoint::stop() {
+  if (server.joinable()) {
+    char wake = 0;
+    (void)!write(wakeFd[1], &wake, 1);
+    server.join();
+  }
+  for (int* fd : { &listenFd, &wakeFd[0], &wakeFd[1] }) {
+    if (*fd >= 0) close(*fd);
+    *fd = -1;
+  }
+  if (!unixPath.empty()) {
+    unlink(unixPath.c_str());
+    unixPath.clear();
+  }
+  boundPort = 0;
+}
+
+// Answer each connection with the current metrics, whatever it asked for
+void GVMMetrics::Endpoint::serve() {
+  pollfd fds[2] = { { listenFd, POLLIN, 0 }, { wakeFd[0], POLLIN, 0 } };
+  while (true) {
+    if (poll(fds, 2, -1) < 0) {
+      if (errno == EINTR || errno == EAGAIN) continue;
+      return;
+    }
+    if (fds[1].revents) return;
+
+    int client = accept(listenFd, nullptr, nullptr);
+    if (client < 0) {
+      if (errno == EINTR || errno == EAGAIN || errno == EWOULDBLOCK || errno == ECONNABORTED) continue;
+      if (errno == EMFILE || errno == ENFILE || errno == ENOBUFS || errno == ENOMEM) {
+        // Out of descriptors or memory: wait for some to be freed, still answering stop()
+        if (poll(&fds[1], 1, 100) > 0) return;
+        continue;
+      }
+      return;
+    }
+
+    // Read the request head so the client does not see a reset, but do not wait for slow clients
+    char request[1024];
+    pollfd readable = { client, POLLIN, 0 };
+    if (poll(&readable, 1, 100) > 0) {
+      (void)!read(client, request, sizeof(request));
+    }
+
+    std::string body = prometheusText();
+    std::string response = "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: "
+                         + std::to_string(body.size()) + "\r\nConnection: close\r\n\r\n" + body;
+    for (size_t sent = 0; sent < response.size(); ) {
+      ssize_t written = send(client, response.data() + sent, response.size() - sent, MSG_NOSIGNAL);
+      if (written <= 0) break;
+      sent += static_cast<size_t>(written);
+    }
+    close(client);
+  }
+}
+
+#else
+
+void GVMMetrics::Endpoint::listenTcp(unsigned short) {
+  throw std::runtime_error("Metrics endpoints are not supported here");
+}
+
+void GVMMetrics::Endpoint::listenUnix(const std::string&) {
+  throw std::runtime_error("Metrics endpoints are not supported here");
+}
+
+void GVMMetrics::Endpoint::start() {}
+void GVMMetrics::Endpoint::stop() {}
+void GVMMetrics::Endpoint::serve() {}
+
+#endif
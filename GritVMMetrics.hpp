@@ -0,0 +1,93 @@
+#ifndef GRITVMMETRICS_H
+#define GRITVMMETRICS_H
+
+#include "GritVMBase.hpp"
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <string>
+#include <thread>
+
+// Fleet metrics for GritVM. Every thread records into its own shard of
+// counters and latency histograms with plain relaxed stores, so recording
+// never contends; shards are only summed when a snapshot is taken. Text is
+// produced in the Prometheus exposition format.
+namespace GVMMetrics {
+  // Log-linear (HDR style) histogram of nanosecond values: 8 sub-buckets per
+  // power of two, so any value is kept to within 12.5%
+  class LatencyHistogram {
+  public:
+    static const int    SUB_BITS = 3;
+    static const size_t BUCKETS = (64 - SUB_BITS + 1) << SUB_BITS;
+
+    LatencyHistogram();
+
+    // Only the owning thread may record
+    void     record(uint64_t nanos);
+    void     merge(const LatencyHistogram& other);
+
+    uint64_t count() const;
+    uint64_t sum() const;
+    uint64_t countBelow(uint64_t nanos) const;     // Values < nanos, nanos a power of two
+
+    // Upper bound of the bucket holding the q-quantile (0 <= q <= 1)
+    uint64_t percentile(double q) const;
+
+    static size_t   bucketFor(uint64_t nanos);
+    static uint64_t bucketLimit(size_t bucket);    // Exclusive upper bound
+
+  private:
+    std::atomic<uint64_t> buckets[BUCKETS];
+    std::atomic<uint64_t> total;
+  };
+
+  void recordLoad(STATUS status, std::chrono::nanoseconds elapsed);
+  void recordRun(STATUS status, unsigned long instructions, std::chrono::nanoseconds elapsed);
+  void recordCacheLookup(bool hit);
+  void recordFault(FAULT_CODE code);
+
+  // Totals over every thread, past and present
+  struct Snapshot {
+    uint64_t loads[UNKNOWN + 1] = {};              // By resulting STATUS
+    uint64_t runs[UNKNOWN + 1] = {};               // By final STATUS
+    uint64_t faults[FAULT_COUNT] = {};             // ERRORED loads and runs, by FAULT_CODE
+    uint64_t instructions = 0;
+    uint64_t cacheHits = 0;
+    uint64_t cacheMisses = 0;
+    LatencyHistogram loadLatency;
+    LatencyHistogram runLatency;
+  };
+
+  void        snapshot(Snapshot& out);
+  std::string prometheusText();
+
+  // Serves prometheusText() to every connection on a local endpoint
+  class Endpoint {
+  public:
+    Endpoint();
+    ~Endpoint();
+
+    // Listen on 127.0.0.1:port (0 picks a free port, see port()). Throws on failure
+    void listenTcp(unsigned short port);
+    // Listen on a Unix domain socket at path. Throws on failure
+    void listenUnix(const std::string& path);
+    void stop();
+
+    unsigned short port() const { return boundPort; }
+
+    Endpoint(const Endpoint&) = delete;
+    Endpoint& operator=(const Endpoint&) = delete;
+
+  private:
+    int listenFd;
+    int wakeFd[2];
+    unsigned short boundPort;
+    std::string unixPath;
+    std::thread server;
+
+    void start();
+    void serve();
+  };
+};
+
+#endif // GRITVMMETRICS_H
@@ -0,0 +1,508 @@
+#include "GritVMOptimize.hpp"
+#include "GritVMTrace.hpp"
+#include <algorithm>
+#include <map>
+#include <set>
+
+using namespace GVMIR;
+
+namespace {
+  // Scratch register 0 holds the accumulator while a preheader computes; the rest hold hoisted values
+  const size_t SAVE_REGISTER = 0;
+
+  struct NaturalLoop {
+    size_t header;
+    std::set<size_t> blocks;
+  };
+
+  std::vector<size_t> reversePostorder(const Function& fn) {
+    std::vector<size_t> order;
+    std::vector<bool> seen(fn.blocks.size(), false);
+    std::vector<std::pair<size_t, size_t>> stack = { { 0, 0 } };
+    seen[0] = true;
+    while (!stack.empty()) {
+      size_t block = stack.back().first;
+      std::vector<size_t> succs = fn.successors(block);
+      if (stack.back().second < succs.size()) {
+        size_t succ = succs[stack.back().second++];
+        if (!seen[succ]) {
+          seen[succ] = true;
+          stack.push_back({ succ, 0 });
+        }
+      } else {
+        order.push_back(block);
+        stack.pop_back();
+      }
+    }
+    std::reverse(order.begin(), order.end());
+    return order;
+  }
+
+  // Immediate dominators (Cooper, Harvey and Kennedy); NO_VALUE for unreachable blocks
+  std::vector<size_t> dominators(const Function& fn) {
+    std::vector<size_t> order = reversePostorder(fn);
+    std::vector<size_t> position(fn.blocks.size(), NO_VALUE);
+    for (size_t i = 0; i < order.size(); i++) position[order[i]] = i;
+
+    std::vector<size_t> idom(fn.blocks.size(), NO_VALUE);
+    idom[0] = 0;
+    bool changed = true;
+    while (changed) {
+      changed = false;
+      for (size_t i = 1; i < order.size(); i++) {
+        size_t block = order[i];
+        size_t best = NO_VALUE;
+        for (size_t pred : fn.blocks[block].preds) {
+          if (idom[pred] == NO_VALUE) continue;
+          if (best == NO_VALUE) {
+            best = pred;
+            continue;
+          }
+          size_t a = pred, b = best;
+          while (a != b) {
+            while (position[a] > position[b]) a = idom[a];
+            while (position[b] > position[a]) b = idom[b];
+          }
+          best = a;
+        }
+        if (best != idom[block]) {
+          idom[block] = best;
+          changed = true;
+        }
+      }
+    }
+    return idom;
+  }
+
+  bool dominates(const std::vector<size_t>& idom, size_t a, size_t b) {
+    if (idom[b] == NO_VALUE) return false;
+    while (b != a && b != 0) b = idom[b];
+    return b == a;
+  }
+
+  // Loops by header, innermost (smallest) first
+  std::vector<NaturalLoop> naturalLoops(const Function& fn, const std::vector<size_t>& idom) {
+    std::map<size_t, std::set<size_t>> bodies;
+    for (size_t latch = 0; latch < fn.blocks.size(); latch++) {
+      for (size_t header : fn.successors(latch)) {
+        if (!dominates(idom, header, latch)) continue;
+        std::set<size_t>& body = bodies[header];
+        body.insert(header);
+        std::vector<size_t> work = { latch };
+        while (!work.empty()) {
+          size_t block = work.back();
+          work.pop_back();
+          if (!body.insert(block).second && block != latch) continue;
+          if (block == header) continue;
+          for (size_t pred : fn.blocks[block].preds) {
+            if (!body.count(pred)) work.push_back(pred);
+          }
+        }
+      }
+    }
+    std::vector<NaturalLoop> loops;
+    for (auto& item : bodies) loops.push_back({ item.first, item.second });
+    std::sort(loops.begin(), loops.end(), [](const NaturalLoop& a, const NaturalLoop& b) {
+      return a.blocks.size() < b.blocks.size();
+    });
+    return loops;
+  }
+
+  // Give header a block of its own to enter it from, NO_VALUE if it is entered from several places
+  size_t preheader(Function& fn, const NaturalLoop& loop) {
+    std::vector<size_t>& preds = fn.blocks[loop.header].preds;
+    size_t outside = NO_VALUE;
+    for (size_t pred : preds) {
+      if (loop.blocks.count(pred)) continue;
+      if (outside != NO_VALUE) return NO_VALUE;
+      outside = pred;
+    }
+    if (outside == NO_VALUE) return NO_VALUE;
+    if (outside != 0 && fn.successors(outside).size() == 1 && fn.blocks[outside].kind == TERM_JUMP) {
+      return outside;
+    }
+
+    size_t added = fn.blocks.size();
+    fn.blocks.emplace_back();
+    Block& block = fn.blocks.back();
+    block.taken = loop.header;
+    block.next = loop.header;
+    block.origin = fn.blocks[loop.header].origin;
+    block.preds = { outside };
+
+    Block& from = fn.blocks[outside];
+    if (from.taken == loop.header) from.taken = added;
+    if (from.next == loop.header) from.next = added;
+    std::replace(fn.blocks[loop.header].preds.begin(), fn.blocks[loop.header].preds.end(), outside, added);
+    fn.layout.insert(std::find(fn.layout.begin(), fn.layout.end(), loop.header), added);
+    return added;
+  }
+
+  // Cells certain to exist once control reaches block: data memory never
+  // shrinks in these programs, so any access or CHECKMEM on the way proves it
+  struct KnownCells {
+    long size = 0;
+    std::set<long> cells;
+    bool has(long cell) const { return cell >= 0 && (cell < size || cells.count(cell)); }
+  };
+
+  KnownCells knownCells(const Function& fn, const std::vector<size_t>& idom, size_t block) {
+    KnownCells known;
+    for (size_t b = block; ; b = idom[b]) {
+      for (size_t v : fn.blocks[b].values) {
+        const Value& value = fn.values[v];
+        switch (value.op) {
+          case IR_CHECKMEM: known.size = std::max(known.size, value.argument); break;
+          case IR_INSERT:   known.size = std::max(known.size, value.argument + 1); break;
+          case IR_LOAD: case IR_STORE: known.cells.insert(value.argument); break;
+          case IR_COPY:
+            if (value.home >= 0) known.cells.insert(value.home);
+            if (fn.values[value.operands[0]].home >= 0) known.cells.insert(fn.values[value.operands[0]].home);
+            break;
+          case IR_ADD: case IR_SUB: case IR_MUL: case IR_DIV:
+            if (fn.values[value.operands[1]].home >= 0) known.cells.insert(fn.values[value.operands[1]].home);
+            if (fn.values[value.operands[1]].op == IR_LOAD) known.cells.insert(fn.values[value.operands[1]].argument);
+            break;
+          default:
+            break;
+        }
+      }
+      if (b == 0 || idom[b] == NO_VALUE) break;
+    }
+    return known;
+  }
+
+  // Emits code of its own when lowered, rather than being folded into a user
+  bool emitsCode(const Value& value) {
+    return value.op != IR_PARAM && value.op != IR_PHI && value.op != IR_REMOVED
+        && !((value.op == IR_CONST || value.op == IR_LOAD) && value.home == HOME_NONE);
+  }
+
+  // Memory size covering every cell the loop's code names; false if it names
+  // none, names a cell that cannot exist, or erases cells
+  bool loopCells(const Function& fn, const NaturalLoop& loop, long& cells) {
+    long highest = -1;
+    bool valid = true;
+    auto name = [&](long cell) {
+      if (cell < 0) valid = false;
+      highest = std::max(highest, cell);
+    };
+    for (size_t b : loop.blocks) {
+      for (size_t v : fn.blocks[b].values) {
+        const Value& value = fn.values[v];
+        if (value.op == IR_ERASE) return false;
+        if (value.op == IR_LOAD || value.op == IR_STORE) name(value.argument);
+        if (value.home >= 0 && value.op != IR_PHI && value.op != IR_PARAM) name(value.home);
+        for (size_t operand : value.operands) {
+          const Value& used = fn.values[operand];
+          if (used.home >= 0) name(used.home);
+          if (used.op == IR_LOAD) name(used.argument);
+        }
+      }
+      size_t condition = fn.blocks[b].condition;
+      if (condition != NO_VALUE && fn.values[condition].home >= 0) name(fn.values[condition].home);
+    }
+    cells = highest + 1;
+    return valid && highest >= 0;
+  }
+
+  class Hoister {
+  public:
+    Hoister(Function& function) : fn(function), nextRegister(SAVE_REGISTER + 1) {}
+
+    size_t run() {
+      size_t moved = 0;
+      std::set<size_t> done;
+      bool changed = true;
+      while (changed) {
+        changed = false;
+        std::vector<size_t> idom = dominators(fn);
+        for (const NaturalLoop& loop : naturalLoops(fn, idom)) {
+          if (!done.insert(loop.header).second) continue;
+          size_t blocksBefore = fn.blocks.size();
+          moved += hoist(loop);
+          if (fn.blocks.size() != blocksBefore) {
+            // A new preheader changes the dominator tree, start over
+            changed = true;
+            break;
+          }
+        }
+      }
+      return moved;
+    }
+
+  private:
+    Function& fn;
+    size_t nextRegister;
+    std::vector<std::vector<size_t>> users;        // Values using each value
+    std::set<size_t> phiUsed;                      // Values some phi or branch reads directly
+
+    void findUsers() {
+      users.assign(fn.values.size(), {});
+      phiUsed.clear();
+      for (size_t v = 0; v < fn.values.size(); v++) {
+        for (size_t operand : fn.values[v].operands) {
+          users[operand].push_back(v);
+          if (fn.values[v].op == IR_PHI) phiUsed.insert(operand);
+        }
+      }
+      for (const Block& block : fn.blocks) {
+        if (block.condition != NO_VALUE) phiUsed.insert(block.condition);
+      }
+    }
+
+    bool layoutFixed() const {
+      if (fn.promotedCells) return true;
+      for (const Value& value : fn.values) {
+        if (value.op == IR_ERASE) return false;
+      }
+      return true;
+    }
+
+    size_t hoist(const NaturalLoop& loop) {
+      findUsers();
+      auto inLoop = [&](size_t v) { return loop.blocks.count(fn.values[v].block) > 0; };
+
+      // Cells the loop writes or moves
+      bool movesCells = false;
+      std::set<long> written;
+      for (size_t b : loop.blocks) {
+        for (size_t v : fn.blocks[b].values) {
+          const Value& value = fn.values[v];
+          if (value.op == IR_INSERT || value.op == IR_ERASE) movesCells = true;
+          if (value.op == IR_STORE) written.insert(value.argument);
+        }
+      }
+
+      // Values with the same result on every iteration, grown to a fixed point
+      std::set<size_t> invariant;
+      bool grew = true;
+      while (grew) {
+        grew = false;
+        for (size_t b : loop.blocks) {
+          for (size_t v : fn.blocks[b].values) {
+            if (invariant.count(v) || phiUsed.count(v)) continue;
+            const Value& value = fn.values[v];
+            bool candidate = false;
+            switch (value.op) {
+              case IR_CONST:
+                candidate = (value.home == HOME_NONE || value.home == HOME_ACC);
+                break;
+              case IR_LOAD:
+                candidate = (value.home == HOME_NONE || value.home == HOME_ACC)
+                         && !movesCells && !written.count(value.argument);
+                break;
+              case IR_COPY:
+                candidate = (value.home == HOME_ACC && fn.values[value.operands[0]].home >= 0);
+                break;
+              case IR_ADD: case IR_SUB: case IR_MUL:
+                candidate = (value.home == HOME_ACC);
+                break;
+              default:
+                break;
+            }
+            for (size_t operand : value.operands) {
+              if (inLoop(operand) ? !invariant.count(operand) : fn.values[operand].home == HOME_ACC) {
+                // Accumulator values from before the loop are not in the accumulator any more
+                candidate = false;
+              }
+            }
+            if (candidate) {
+              invariant.insert(v);
+              grew = true;
+            }
+          }
+        }
+      }
+
+      // Chains worth moving end in an arithmetic value used once, by code that stays in the loop
+      std::vector<size_t> roots;
+      for (size_t b : fn.layout) {
+        if (!loop.blocks.count(b)) continue;
+        for (size_t v : fn.blocks[b].values) {
+          const Value& value = fn.values[v];
+          if (!invariant.count(v) || value.op < IR_ADD || value.op > IR_MUL) continue;
+          if (users[v].size() == 1 && !invariant.count(users[v][0])) roots.push_back(v);
+        }
+      }
+      if (roots.empty()) return 0;
+
+      size_t header = preheader(fn, loop);
+      if (header == NO_VALUE) return 0;
+      std::vector<size_t> idom = dominators(fn);
+      KnownCells known = knownCells(fn, idom, header);
+      bool fixed = layoutFixed();
+
+      // Operands first, so the preheader computes every chain bottom up
+      std::vector<size_t> order;
+      std::set<size_t> placed;
+      for (size_t root : roots) {
+        if (nextRegister >= GVM_SCRATCH_REGISTERS) break;
+        std::vector<size_t> chain;
+        std::vector<size_t> work = { root };
+        while (!work.empty()) {
+          size_t v = work.back();
+          work.pop_back();
+          if (!inLoop(v) || placed.count(v)) continue;
+          chain.push_back(v);
+          for (size_t operand : fn.values[v].operands) work.push_back(operand);
+        }
+        // Moved reads run even if the loop would have stopped before them
+        bool proven = fixed;
+        size_t emitting = 0;
+        for (size_t v : chain) {
+          const Value& value = fn.values[v];
+          if (value.op == IR_LOAD && !known.has(value.argument)) proven = false;
+          for (size_t operand : value.operands) {
+            if (fn.values[operand].home >= 0 && !known.has(fn.values[operand].home)) proven = false;
+          }
+          if (emitsCode(value)) emitting++;
+        }
+        // One instruction stays behind to fetch the result, so a chain must save more than that
+        if (!proven || emitting < 2) continue;
+        std::reverse(chain.begin(), chain.end());
+        for (size_t v : chain) {
+          placed.insert(v);
+          order.push_back(v);
+        }
+      }
+      if (order.empty()) return 0;
+
+      // Results used only by the next value computed stay in the accumulator, the rest get registers
+      std::vector<size_t> emitted;
+      for (size_t v : order) {
+        if (emitsCode(fn.values[v])) emitted.push_back(v);
+      }
+      for (size_t i = 0; i < emitted.size(); i++) {
+        size_t v = emitted[i];
+        bool feedsNext = users[v].size() == 1 && i + 1 < emitted.size() && users[v][0] == emitted[i + 1]
+                      && fn.values[emitted[i + 1]].operands[0] == v;
+        if (!feedsNext) {
+          if (nextRegister >= GVM_SCRATCH_REGISTERS) return 0;
+          fn.values[v].home = tempHome(nextRegister++);
+        }
+      }
+
+      // Keep the accumulator the loop is entered with
+      size_t entering = accumulatorEntering(loop, header);
+      Block& pre = fn.blocks[header];
+      size_t origin = pre.origin;
+      size_t saved = NO_VALUE;
+      if (entering != NO_VALUE) {
+        saved = fn.add(IR_COPY, tempHome(SAVE_REGISTER), 0, { entering }, header, origin);
+      }
+      for (size_t v : order) {
+        Value& value = fn.values[v];
+        std::vector<size_t>& from = fn.blocks[value.block].values;
+        from.erase(std::find(from.begin(), from.end(), v));
+        value.block = header;
+        fn.blocks[header].values.push_back(v);
+      }
+      if (entering != NO_VALUE) {
+        size_t restored = fn.add(IR_COPY, HOME_ACC, 0, { saved }, header, origin);
+        replaceInLoop(loop, header, entering, restored);
+      }
+      return order.size();
+    }
+
+    // The accumulator value flowing into the loop, NO_VALUE if the loop never reads it
+    size_t accumulatorEntering(const NaturalLoop& loop, size_t header) {
+      const Block& head = fn.blocks[loop.header];
+      size_t slot = std::find(head.preds.begin(), head.preds.end(), header) - head.preds.begin();
+      for (size_t v : head.values) {
+        const Value& value = fn.values[v];
+        if (value.op == IR_PHI && value.home == HOME_ACC) return value.operands[slot];
+      }
+      for (size_t b : loop.blocks) {
+        for (size_t v : fn.blocks[b].values) {
+          for (size_t operand : fn.values[v].operands) {
+            if (fn.values[operand].home == HOME_ACC && !loop.blocks.count(fn.values[operand].block)
+                && fn.values[operand].block != header) {
+              return operand;
+            }
+          }
+        }
+        size_t condition = fn.blocks[b].condition;
+        if (condition != NO_VALUE && fn.values[condition].home == HOME_ACC
+            && !loop.blocks.count(fn.values[condition].block)) {
+          return condition;
+        }
+      }
+      return NO_VALUE;
+    }
+
+    void replaceInLoop(const NaturalLoop& loop, size_t header, size_t from, size_t to) {
+      Block& head = fn.blocks[loop.header];
+      size_t slot = std::find(head.preds.begin(), head.preds.end(), header) - head.preds.begin();
+      for (size_t b : loop.blocks) {
+        for (size_t v : fn.blocks[b].values) {
+          Value& value = fn.values[v];
+          for (size_t i = 0; i < value.operands.size(); i++) {
+            if (value.operands[i] != from) continue;
+            // Phis only take the preheader's operand from it
+            if (value.op != IR_PHI || (b == loop.header && i == slot)) value.operands[i] = to;
+          }
+        }
+        if (fn.blocks[b].condition == from) fn.blocks[b].condition = to;
+      }
+    }
+  };
+}
+
+size_t GVMOptimize::hoistInvariants(Function& function) {
+  GVMTrace::Span span("licm");
+  return Hoister(function).run();
+}
+
+size_t GVMOptimize::versionLoops(Function& function) {
+  GVMTrace::Span span("versioning");
+  std::set<size_t> versioned;
+  for (const VersionedLoop& loop : function.versioned) {
+    versioned.insert(loop.blocks.begin(), loop.blocks.end());
+  }
+
+  // Largest first, so one guard covers a whole nest
+  std::vector<NaturalLoop> loops = naturalLoops(function, dominators(function));
+  size_t count = 0;
+  for (auto loop = loops.rbegin(); loop != loops.rend(); ++loop) {
+    long cells;
+    if (!loopCells(function, *loop, cells)) continue;
+    bool nested = false;
+    for (size_t b : loop->blocks) {
+      if (versioned.count(b)) nested = true;
+    }
+    if (nested) continue;
+
+    VersionedLoop copy{ loop->header, {}, cells };
+    for (size_t b : function.layout) {
+      if (loop->blocks.count(b)) copy.blocks.push_back(b);
+    }
+    versioned.insert(copy.blocks.begin(), copy.blocks.end());
+    function.versioned.push_back(copy);
+    count++;
+  }
+  return count;
+}
+
+bool GVMOptimize::optimize(GVMView<Instruction> program, std::vector<Instruction>& optimized,
+                           std::vector<size_t>* origins) {
+  GVMTrace::Span span("optimize");
+  Function function;
+  if (!GVMIR::build(program, function)) {
+    return false;
+  }
+  hoistInvariants(function);
+  versionLoops(function);
+  if (!GVMIR::verify(function).empty()) {
+    return false;
+  }
+
+  std::vector<Instruction> lowered;
+  std::vector<size_t> loweredOrigins;
+  if (!GVMIR::lower(function, lowered, &loweredOrigins)) {
+    return false;
+  }
+  optimized.swap(lowered);
+  if (origins) origins->swap(loweredOrigins);
+  return true;
+}
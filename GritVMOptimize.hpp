@@ -0,0 +1,34 @@
+#ifndef GRITVMOPTIMIZE_H
+#define GRITVMOPTIMIZE_H
+
+#include "GritVMBase.hpp"
+#include "GritVMIR.hpp"
+#include <vector>
+
+// Optimization passes over GVMIR, and a driver that takes a decoded program
+// through them and back. Optimized programs may use the VM's internal
+// opcodes (scratch registers and the like), so they can be run but not
+// written back out as .gvm text.
+namespace GVMOptimize {
+  // Move accumulator computations that give the same value on every
+  // iteration (AT k / MULCONST c chains over cells the loop never writes)
+  // into a preheader run once before the loop, keeping the result in a
+  // scratch register. Only work that cannot fail is moved ahead of the loop:
+  // no division, and reads only of cells already known to exist there.
+  // Returns the number of values moved
+  size_t hoistInvariants(GVMIR::Function& function);
+
+  // Have lower() emit a second copy of each outermost loop that never erases
+  // cells, with the bounds checks taken out of its cell accesses. Memory does
+  // not shrink while such a loop runs, so one MEMGUARD on entry against the
+  // highest cell the loop names decides which copy runs. Returns the number
+  // of loops versioned
+  size_t versionLoops(GVMIR::Function& function);
+
+  // Build SSA form of program, run every pass, verify and lower it. False,
+  // with optimized untouched, if the program cannot be optimized
+  bool   optimize(GVMView<Instruction> program, std::vector<Instruction>& optimized,
+                  std::vector<size_t>* origins = nullptr);
+};
+
+#endif // GRITVMOPTIMIZE_H
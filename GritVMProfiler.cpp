@@ -0,0 +1,231 @@
+#include "GritVMProfiler.hpp"
+#include "GritVM.hpp"
+#include "GritVMAnalysis.hpp"
+#include <cerrno>
+
+#ifdef __linux__
+#include <csignal>
+#include <ctime>
+#include <sys/syscall.h>
+#include <unistd.h>
+#ifndef sigev_notify_thread_id
+#define sigev_notify_thread_id _sigev_un._tid
+#endif
+#define GVM_HAVE_THREAD_TIMERS 1
+#endif
+
+namespace {
+    // What the signal handler may touch: plain thread-locals filled in before
+    // slotActive is raised and left alone until it is lowered again
+    struct SampleSlot {
+        const std::atomic<size_t>* pc = nullptr;
+        std::atomic<unsigned long>* counts = nullptr;
+        size_t size = 0;
+    };
+
+    thread_local SampleSlot slot;
+    thread_local std::atomic<bool> slotActive{false};
+
+#ifdef GVM_HAVE_THREAD_TIMERS
+    void onSample(int) {
+        int savedErrno = errno;
+        if (slotActive.load(std::memory_order_relaxed)) {
+            size_t pc = slot.pc->load(std::memory_order_relaxed);
+            if (pc < slot.size) {
+                slot.counts[pc].fetch_add(1, std::memory_order_relaxed);
+            }
+        }
+        errno = savedErrno;
+    }
+
+    // One CPU-time timer per thread, created on the thread's first profiled run
+    struct ThreadTimer {
+        timer_t id;
+        bool created = false;
+        ~ThreadTimer() {
+            if (created) timer_delete(id);
+        }
+    };
+
+    thread_local ThreadTimer threadTimer;
+
+    void setThreadTimer(unsigned intervalMicros) {
+        itimerspec spec = {};
+        spec.it_interval.tv_sec = intervalMicros / 1000000;
+        spec.it_interval.tv_nsec = (intervalMicros % 1000000) * 1000L;
+        spec.it_value = spec.it_interval;
+        timer_settime(threadTimer.id, 0, &spec, nullptr);
+    }
+
+    void armThreadTimer(unsigned intervalMicros) {
+        static bool installed = [] {
+            struct sigaction action = {};
+            action.sa_handler = onSample;
+            action.sa_flags = SA_RESTART;
+            sigemptyset(&action.sa_mask);
+            return sigaction(SIGPROF, &action, nullptr) == 0;
+        }();
+        if (!installed) {
+            return;
+        }
+
+        if (!threadTimer.created) {
+            sigevent event = {};
+            event.sigev_notify = SIGEV_THREAD_ID;
+            event.sigev_signo = SIGPROF;
+            event.sigev_notify_thread_id = static_cast<pid_t>(syscall(SYS_gettid));
+            if (timer_create(CLOCK_THREAD_CPUTIME_ID, &event, &threadTimer.id) != 0) {
+                return;
+            }
+            threadTimer.created = true;
+        }
+        setThreadTimer(intervalMicros);
+    }
+
+    // A zero interval stops the timer, so no SIGPROF reaches the thread outside the VM
+    void disarmThreadTimer() {
+        if (threadTimer.created) {
+            setThreadTimer(0);
+        }
+    }
+#else
+    void armThreadTimer(unsigned) {}
+    void disarmThreadTimer() {}
+#endif
+
+    bool sameCode(const std::vector<Instruction>& code, GVMView<Instruction> program) {
+        if (code.size() != program.size) return false;
+        for (size_t i = 0; i < code.size(); ++i) {
+            if (code[i].operation != program[i].operation || code[i].argument != program[i].argument) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    std::atomic<uint64_t> nextProfilerId{1};
+
+    // The profile this thread entered last, so entering the same load again
+    // takes no lock
+    struct LastProfile {
+        uint64_t profilerId = 0;
+        uint64_t programId = 0;
+        size_t size = 0;
+        std::string name;
+        void* profile = nullptr;
+    };
+
+    thread_local LastProfile last;
+}
+
+SamplingProfiler::SamplingProfiler(unsigned intervalMicros)
+    : intervalMicros(intervalMicros == 0 ? 1 : intervalMicros), profilerId(nextProfilerId.fetch_add(1)) {}
+
+// Find or create the counters for the program vm is about to run. Each
+// thread remembers the load (GritVM::programId()) it entered last, so only
+// the first run of a load compares code under the lock; the size check
+// catches a streaming load that has decoded more since
+SamplingProfiler::Profile* SamplingProfiler::profileFor(const GritVM& vm, const std::string& programName) {
+    GVMView<Instruction> program = vm.getProgram();
+    if (last.profilerId == profilerId && last.programId == vm.programId()
+        && last.size == program.size && last.name == programName) {
+        return static_cast<Profile*>(last.profile);
+    }
+
+    std::lock_guard<std::mutex> lock(profilesMutex);
+    Profile*& current = profiles[programName];
+    if (!current || !sameCode(current->code, program)) {
+        // A new or reloaded program gets fresh counters; the old ones stay allocated
+        allProfiles.emplace_back(new Profile);
+        current = allProfiles.back().get();
+        current->code.assign(program.begin(), program.end());
+        current->counts.reset(new std::atomic<unsigned long>[program.size]);
+        for (size_t i = 0; i < program.size; ++i) {
+            current->counts[i].store(0);
+        }
+    }
+    last.profilerId = profilerId;
+    last.programId = vm.programId();
+    last.size = program.size;
+    last.name = programName;
+    last.profile = current;
+    return current;
+}
+
+void SamplingProfiler::enter(const GritVM& vm, const std::string& programName) {
+    Profile* profile = profileFor(vm, programName);
+    slot.pc = &vm.executingPc();
+    slot.counts = profile->counts.get();
+    slot.size = profile->code.size();
+    std::atomic_signal_fence(std::memory_order_seq_cst);
+    slotActive.store(true, std::memory_order_relaxed);
+    armThreadTimer(intervalMicros);
+}
+
+void SamplingProfiler::leave() {
+    disarmThreadTimer();
+    slotActive.store(false, std::memory_order_relaxed);
+    std::atomic_signal_fence(std::memory_order_seq_cst);
+}
+
+std::vector<unsigned long> SamplingProfiler::snapshot(const Profile& profile) {
+    std::vector<unsigned long> counts(profile.code.size());
+    for (size_t i = 0; i < counts.size(); ++i) {
+        counts[i] = profile.counts[i].load(std::memory_order_relaxed);
+    }
+    return counts;
+}
+
+std::map<std::string, std::vector<unsigned long>> SamplingProfiler::histogram() const {
+    std::lock_guard<std::mutex> lock(profilesMutex);
+    std::map<std::string, std::vector<unsigned long>> result;
+    for (auto& item : profiles) {
+        result[item.first] = snapshot(*item.second);
+    }
+    return result;
+}
+
+std::map<size_t, unsigned long> SamplingProfiler::blockHistogram(const std::string& programName) const {
+    std::lock_guard<std::mutex> lock(profilesMutex);
+    std::map<size_t, unsigned long> blocks;
+    auto found = profiles.find(programName);
+    if (found == profiles.end()) {
+        return blocks;
+    }
+
+    const Profile& profile = *found->second;
+    std::vector<unsigned long> counts = snapshot(profile);
+    std::vector<bool> leaders = GVMAnalysis::blockLeaders(GVMView<Instruction>(profile.code.data(), profile.code.size()));
+    size_t block = 0;
+    for (size_t pc = 0; pc < counts.size(); ++pc) {
+        if (leaders[pc]) block = pc;
+        if (counts[pc] != 0) blocks[block] += counts[pc];
+    }
+    return blocks;
+}
+
+void SamplingProfiler::writeFolded(std::ostream& out) const {
+    std::vector<std::string> names;
+    {
+        std::lock_guard<std::mutex> lock(profilesMutex);
+        for (auto& item : profiles) names.push_back(item.first);
+    }
+
+    for (const std::string& name : names) {
+        std::vector<Instruction> code;
+        {
+            std::lock_guard<std::mutex> lock(profilesMutex);
+            code = profiles.find(name)->second->code;
+        }
+        GVMView<Instruction> program(code.data(), code.size());
+        std::vector<GVMAnalysis::Loop> loops = GVMAnalysis::findLoops(program);
+
+        for (auto& block : blockHistogram(name)) {
+            out << name;
+            for (size_t loop : GVMAnalysis::loopNest(loops, block.first)) {
+                out << ";loop@" << loops[loop].header << "-" << loops[loop].latch;
+            }
+            out << ";block@" << block.first << " " << block.second << "\n";
+        }
+    }
+}
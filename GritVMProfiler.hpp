@@ -0,0 +1,64 @@
+#ifndef GRITVMPROFILER_H
+#define GRITVMPROFILER_H
+
+#include "GritVMBase.hpp"
+#include <atomic>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <ostream>
+#include <string>
+#include <vector>
+
+class GritVM;
+
+// Statistical profiler for GritVM runs. A per-thread CPU-time timer raises
+// SIGPROF every interval; the handler reads the pc the interrupted thread's
+// running VM publishes and bumps that instruction's counter. Nothing is added
+// to the interpreter loop beyond the published pc, so the cost is one short
+// signal handler per sample. Loops stand in for call frames in the folded
+// stacks written for flame graphs.
+class SamplingProfiler {
+public:
+    // intervalMicros of thread CPU time between samples
+    explicit SamplingProfiler(unsigned intervalMicros = 1000);
+
+    // Called by GritVM::run() on the running thread for VMs given this profiler.
+    // The profiler must outlive every run it is attached to. A thread entering
+    // the same load again finds its counters without taking a lock, and the
+    // thread's timer only runs between enter() and leave()
+    void enter(const GritVM& vm, const std::string& programName);
+    void leave();
+
+    // Samples per instruction of each program
+    std::map<std::string, std::vector<unsigned long>> histogram() const;
+
+    // Samples per basic block of programName, keyed by the block's first instruction
+    std::map<size_t, unsigned long> blockHistogram(const std::string& programName) const;
+
+    // One "program;loop@header-latch;...;block@first count" line per sampled block
+    void writeFolded(std::ostream& out) const;
+
+    SamplingProfiler(const SamplingProfiler&) = delete;
+    SamplingProfiler& operator=(const SamplingProfiler&) = delete;
+
+private:
+    // Counters for one program; never freed while the profiler lives because
+    // a signal handler may still be incrementing them
+    struct Profile {
+        std::vector<Instruction> code;
+        std::unique_ptr<std::atomic<unsigned long>[]> counts;
+    };
+
+    const unsigned intervalMicros;
+    const uint64_t profilerId;                     // Tells this profiler apart in per-thread caches
+    mutable std::mutex profilesMutex;
+    std::map<std::string, Profile*> profiles;      // Latest profile for each program name
+    std::vector<std::unique_ptr<Profile>> allProfiles;
+
+    Profile* profileFor(const GritVM& vm, const std::string& programName);
+    static std::vector<unsigned long> snapshot(const Profile& profile);
+};
+
+#endif // GRITVMPROFILER_H
@@ -0,0 +1,227 @@
+#include "GritVMRegistry.hpp"
+#include "GritVMTrace.hpp"
+#include "GritVMMetrics.hpp"
+#include <filesystem>
+#include <fstream>
+#include <stdexcept>
+#include <system_error>
+
+#ifdef __linux__
+#include <cerrno>
+#include <poll.h>
+#include <sys/inotify.h>
+#include <unistd.h>
+#define GVM_HAVE_INOTIFY 1
+#endif
+
+struct ProgramRegistry::Entry {
+    std::string filename;
+    std::string dir;                               // Directory watched for this file
+    std::string base;                              // Name inside dir reported by inotify
+    std::shared_ptr<const ProgramVersion> version; // Only accessed through std::atomic_load/store
+    std::mutex reloadMutex;                        // Serializes reparsing, never taken by readers
+    std::filesystem::file_time_type stamp;
+    std::uintmax_t size = 0;
+};
+
+ProgramRegistry::ProgramRegistry(bool watchFiles) : notifyFd(-1), wakeFd{-1, -1} {
+#ifdef GVM_HAVE_INOTIFY
+    if (watchFiles) {
+        notifyFd = inotify_init1(IN_CLOEXEC | IN_NONBLOCK);
+        if (notifyFd >= 0 && pipe(wakeFd) == 0) {
+            watcher = std::thread(&ProgramRegistry::watchLoop, this);
+        } else if (notifyFd >= 0) {
+            close(notifyFd);
+            notifyFd = -1;
+        }
+    }
+#else
+    (void)watchFiles;
+#endif
+}
+
+ProgramRegistry::~ProgramRegistry() {
+#ifdef GVM_HAVE_INOTIFY
+    if (watcher.joinable()) {
+        char stop = 0;
+        (void)!write(wakeFd[1], &stop, 1);
+        watcher.join();
+        close(wakeFd[0]);
+        close(wakeFd[1]);
+    }
+    if (notifyFd >= 0) {
+        close(notifyFd);
+    }
+#endif
+}
+
+// Register a file and decode its first version
+ProgramRegistry::Handle ProgramRegistry::watch(const std::string& filename) {
+    std::lock_guard<std::mutex> lock(entriesMutex);
+    auto found = entries.find(filename);
+    GVMMetrics::recordCacheLookup(found != entries.end());
+    if (found != entries.end()) {
+        return found->second;
+    }
+
+    Handle entry = std::make_shared<Entry>();
+    std::filesystem::path path(filename);
+    entry->filename = filename;
+    entry->dir = path.has_parent_path() ? path.parent_path().string() : ".";
+    entry->base = path.filename().string();
+    if (!reload(*entry) && !std::ifstream(filename)) {
+        throw std::runtime_error("Unable to open file: " + filename);
+    }
+
+    watchDirectory(entry->dir);
+    entries[filename] = entry;
+    return entry;
+}
+
+std::shared_ptr<const ProgramVersion> ProgramRegistry::current(const Handle& handle) {
+    return handle ? std::atomic_load(&handle->version) : nullptr;
+}
+
+std::shared_ptr<const ProgramVersion> ProgramRegistry::acquire(const std::string& filename) {
+    return current(watch(filename));
+}
+
+// The VM keeps the version alive for as long as it has it loaded
+STATUS ProgramRegistry::load(GritVM& vm, const std::string& filename, const std::vector<long>& initialMemory) {
+    return load(vm, watch(filename), initialMemory);
+}
+
+STATUS ProgramRegistry::load(GritVM& vm, const Handle& handle, const std::vector<long>& initialMemory) {
+    std::shared_ptr<const ProgramVersion> version = current(handle);
+    if (!version) {
+        return ERRORED;
+    }
+    return vm.load(std::shared_ptr<const Instruction>(version, version->code.data()),
+                   version->code.size(), initialMemory);
+}
+
+// Decode the file again and publish it; a version that fails to parse is not swapped in
+bool ProgramRegistry::reload(Entry& entry) {
+    std::lock_guard<std::mutex> lock(entry.reloadMutex);
+    GVMTrace::Span span("reload", entry.filename);
+    std::error_code stampError, sizeError;
+    std::filesystem::file_time_type stamp = std::filesystem::last_write_time(entry.filename, stampError);
+    std::uintmax_t size = std::filesystem::file_size(entry.filename, sizeError);
+    if (stampError || sizeError) {
+        return false;
+    }
+    std::ifstream file(entry.filename);
+    if (!file) {
+        return false;
+    }
+
+    std::shared_ptr<ProgramVersion> next = std::make_shared<ProgramVersion>();
+    if (!GVMHelper::parseProgram(file, next->code)) {
+        entry.stamp = stamp;
+        entry.size = size;
+        return false;
+    }
+
+    std::shared_ptr<const ProgramVersion> previous = std::atomic_load(&entry.version);
+    next->filename = entry.filename;
+    next->generation = previous ? previous->generation + 1 : 1;
+    entry.stamp = stamp;
+    entry.size = size;
+    std::atomic_store(&entry.version, std::shared_ptr<const ProgramVersion>(std::move(next)));
+    return true;
+}
+
+// Poll every registered file for changes
+size_t ProgramRegistry::refresh() {
+    std::vector<Handle> snapshot;
+    {
+        std::lock_guard<std::mutex> lock(entriesMutex);
+        for (auto& item : entries) {
+            snapshot.push_back(item.second);
+        }
+    }
+
+    size_t swapped = 0;
+    for (Handle& entry : snapshot) {
+        std::error_code stampError, sizeError;
+        std::filesystem::file_time_type stamp = std::filesystem::last_write_time(entry->filename, stampError);
+        std::uintmax_t size = std::filesystem::file_size(entry->filename, sizeError);
+        if (stampError || sizeError) {
+            continue;
+        }
+        bool changed;
+        {
+            std::lock_guard<std::mutex> lock(entry->reloadMutex);
+            changed = stamp != entry->stamp || size != entry->size;
+        }
+        if (changed && reload(*entry)) {
+            ++swapped;
+        }
+    }
+    return swapped;
+}
+
+#ifdef GVM_HAVE_INOTIFY
+
+// Watch the directory rather than the file so editors that replace the file by rename are seen
+void ProgramRegistry::watchDirectory(const std::string& dir) {
+    if (notifyFd < 0) {
+        return;
+    }
+    for (auto& item : watchDirs) {
+        if (item.second == dir) return;
+    }
+    int wd = inotify_add_watch(notifyFd, dir.c_str(), IN_CLOSE_WRITE | IN_MOVED_TO);
+    if (wd >= 0) {
+        watchDirs[wd] = dir;
+    }
+}
+
+// Background thread: reparse files as their change events arrive
+void ProgramRegistry::watchLoop() {
+    alignas(inotify_event) char buffer[4096];
+    pollfd fds[2] = { { notifyFd, POLLIN, 0 }, { wakeFd[0], POLLIN, 0 } };
+
+    // Errors other than an interruption will not go away by retrying; the
+    // watcher then stops and refresh() is left to pick up changes
+    while (true) {
+        if (poll(fds, 2, -1) < 0) {
+            if (errno == EINTR || errno == EAGAIN) continue;
+            return;
+        }
+        if (fds[1].revents) return;
+
+        ssize_t length = read(notifyFd, buffer, sizeof(buffer));
+        if (length < 0 && errno != EINTR && errno != EAGAIN) {
+            return;
+        }
+        for (ssize_t offset = 0; offset < length; ) {
+            const inotify_event* event = reinterpret_cast<const inotify_event*>(buffer + offset);
+            offset += sizeof(inotify_event) + event->len;
+            if (event->len == 0) continue;
+
+            std::vector<Handle> changed;
+            {
+                std::lock_guard<std::mutex> lock(entriesMutex);
+                auto dir = watchDirs.find(event->wd);
+                if (dir == watchDirs.end()) continue;
+                for (auto& item : entries) {
+                    if (item.second->dir == dir->second && item.second->base == event->name) {
+                        changed.push_back(item.second);
+                    }
+                }
+            }
+            for (Handle& entry : changed) {
+                reload(*entry);
+            }
+        }
+    }
+}
+
+#else
+
+void ProgramRegistry::watchDirectory(const std::string&) {}
+
+void ProgramRegistry::watchLoop() {}
+
+#endif
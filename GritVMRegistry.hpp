@@ -0,0 +1,67 @@
+#ifndef GRITVMREGISTRY_H
+#define GRITVMREGISTRY_H
+
+#include "GritVM.hpp"
+#include <atomic>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+// One immutable decoded version of a program file
+struct ProgramVersion {
+    std::string filename;
+    unsigned long generation;                      // 1 for the first load, +1 per reload
+    std::vector<Instruction> code;
+};
+
+// Keeps the decoded version of each registered .gvm file and swaps in a new
+// version whenever the file changes on disk. Runs that already hold a version
+// keep executing it; the old version is freed when its last run releases it.
+// Looking up the current version through a Handle is a single atomic load.
+class ProgramRegistry {
+public:
+    struct Entry;
+    typedef std::shared_ptr<Entry> Handle;
+
+    // With watchFiles, a background thread reloads files as soon as they change
+    // (inotify); otherwise changes are picked up by refresh()
+    explicit ProgramRegistry(bool watchFiles = true);
+    ~ProgramRegistry();
+
+    // Register a file (or return its existing handle). Throws if it cannot be opened
+    Handle watch(const std::string& filename);
+
+    // Current version of a registered file, nullptr if it never parsed successfully
+    static std::shared_ptr<const ProgramVersion> current(const Handle& handle);
+    std::shared_ptr<const ProgramVersion> acquire(const std::string& filename);
+
+    // Load the current version of filename into vm without copying it
+    STATUS load(GritVM& vm, const std::string& filename, const std::vector<long>& initialMemory);
+
+    // Same for a handle from watch(), taking no lock, for callers that load the
+    // same file over and over
+    static STATUS load(GritVM& vm, const Handle& handle, const std::vector<long>& initialMemory);
+
+    // Reparse every file whose timestamp or size changed, returns how many were swapped
+    size_t refresh();
+
+    ProgramRegistry(const ProgramRegistry&) = delete;
+    ProgramRegistry& operator=(const ProgramRegistry&) = delete;
+
+private:
+    std::mutex entriesMutex;                       // Guards entries and watchDirs
+    std::map<std::string, Handle> entries;         // Keyed by the filename given to watch()
+    std::map<int, std::string> watchDirs;          // inotify watch descriptor -> directory
+    int notifyFd;                                  // inotify instance, -1 when not watching
+    int wakeFd[2];                                 // Pipe used to stop the watcher thread
+    std::thread watcher;
+
+    bool reload(Entry& entry);
+    void watchDirectory(const std::string& dir);
+    void watchLoop();
+};
+
+#endif // GRITVMREGISTRY_H
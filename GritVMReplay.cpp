@@ -0,0 +1,89 @@
+#include "GritVMReplay.hpp"
+#include "GritVM.hpp"
+#include "GritVMTrace.hpp"
+
+ExecutionRecorder::ExecutionRecorder(unsigned long interval, unsigned keyframes)
+    : every(interval ? interval : 1), keyframeEvery(keyframes ? keyframes : 1) {}
+
+void ExecutionRecorder::clear() {
+    program.reset();
+    points.clear();
+    last.clear();
+}
+
+// Store the cells that changed since the last checkpoint, or all of them
+void ExecutionRecorder::checkpoint(GVMView<Instruction> code, unsigned long retired, size_t pc,
+                                   long accumulator, GVMView<long> memory,
+                                   GVMView<long> scratch) {
+    if (retired == 0 || !program) {
+        // A new recording starts with the program it is of
+        clear();
+        program = std::make_shared<std::vector<Instruction>>(code.begin(), code.end());
+    }
+
+    Checkpoint point{ retired, pc, accumulator, std::vector<long>(scratch.begin(), scratch.end()),
+                      memory.size, false, {}, {} };
+    if (points.size() % keyframeEvery != 0) {
+        for (size_t i = 0; i < memory.size && point.changes.size() * 2 < memory.size; i++) {
+            if (i >= last.size() || last[i] != memory[i]) {
+                point.changes.emplace_back(i, memory[i]);
+            }
+        }
+    }
+    if (points.size() % keyframeEvery == 0 || point.changes.size() * 2 >= memory.size) {
+        point.keyframe = true;
+        point.changes.clear();
+        point.cells.assign(memory.begin(), memory.end());
+    }
+    points.push_back(std::move(point));
+    last.assign(memory.begin(), memory.end());
+}
+
+std::vector<long> ExecutionRecorder::memoryAt(size_t index) const {
+    if (index >= points.size()) {
+        return {};
+    }
+    size_t key = index;
+    while (!points[key].keyframe) {
+        --key;
+    }
+    std::vector<long> memory = points[key].cells;
+    for (size_t i = key + 1; i <= index; i++) {
+        memory.resize(points[i].memorySize);
+        for (const auto& change : points[i].changes) {
+            memory[change.first] = change.second;
+        }
+    }
+    return memory;
+}
+
+size_t ExecutionRecorder::checkpointBefore(unsigned long instructions) const {
+    size_t index = 0;
+    while (index + 1 < points.size() && points[index + 1].retired <= instructions) {
+        ++index;
+    }
+    return index;
+}
+
+// Start from the nearest checkpoint and run forward to exactly instructions
+STATUS ExecutionRecorder::replay(GritVM& vm, unsigned long instructions) const {
+    GVMTrace::Span span("replay");
+    vm.reset();
+    if (points.empty()) {
+        return WAITING;
+    }
+    size_t index = checkpointBefore(instructions);
+    const Checkpoint& point = points[index];
+    STATUS loaded = vm.load(std::shared_ptr<const Instruction>(program, program->data()), program->size(), memoryAt(index));
+    if (loaded != READY) {
+        return loaded;
+    }
+    vm.resumeAt(point.pc, point.accumulator, point.retired,
+                GVMView<long>(point.scratch.data(), point.scratch.size()));
+    return vm.runUntil(instructions);
+}
+
+STATUS ExecutionRecorder::reverseStep(GritVM& vm) const {
+    unsigned long now = vm.instructionsRetired();
+    return replay(vm, now ? now - 1 : 0);
+}
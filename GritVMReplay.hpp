@@ -0,0 +1,65 @@
+#ifndef GRITVMREPLAY_H
+#define GRITVMREPLAY_H
+
+#include "GritVMBase.hpp"
+#include <memory>
+#include <utility>
+#include <vector>
+
+class GritVM;
+
+// Records the state of GritVM runs given this recorder with
+// GritVM::setRecorder(). A checkpoint is taken on the first backward jump
+// after every interval instructions, riding on the check the VM already makes
+// there for its instruction budget, so recording costs one checkpoint per
+// interval and nothing per instruction. Runs are deterministic given their
+// start state, so any instruction count can be reached again by loading the
+// nearest checkpoint and running forward; OUTPUT is repeated when that happens.
+class ExecutionRecorder {
+public:
+    struct Checkpoint {
+        unsigned long retired;                     // Instructions executed before this point
+        size_t pc;                                 // Next instruction to execute
+        long accumulator;
+        std::vector<long> scratch;                 // GritVM scratch registers
+        size_t memorySize;
+        bool keyframe;                             // cells holds all of data memory
+        std::vector<long> cells;
+        std::vector<std::pair<size_t, long>> changes; // Otherwise, cells that differ from the previous checkpoint
+    };
+
+    // A keyframe is stored every keyframeEvery checkpoints, and whenever a
+    // delta would be larger than data memory
+    explicit ExecutionRecorder(unsigned long interval = 100000, unsigned keyframeEvery = 16);
+
+    // Called by GritVM when a run starts from the beginning and every interval after
+    void checkpoint(GVMView<Instruction> program, unsigned long retired, size_t pc,
+                    long accumulator, GVMView<long> memory, GVMView<long> scratch);
+
+    unsigned long interval() const { return every; }
+    const std::vector<Checkpoint>& checkpoints() const { return points; }
+    void clear();
+
+    // Data memory at checkpoints()[index]
+    std::vector<long> memoryAt(size_t index) const;
+
+    // Index of the last checkpoint at or before instructions
+    size_t checkpointBefore(unsigned long instructions) const;
+
+    // Reset vm, load the recorded program into it and bring it to the state
+    // after instructions instructions. The result is PAUSED, so run() continues
+    // the recorded run from there, or how the run ended if it ended sooner
+    STATUS replay(GritVM& vm, unsigned long instructions) const;
+
+    // Replay vm to one instruction before where it is now
+    STATUS reverseStep(GritVM& vm) const;
+
+private:
+    unsigned long every;
+    unsigned keyframeEvery;
+    std::shared_ptr<std::vector<Instruction>> program;
+    std::vector<Checkpoint> points;
+    std::vector<long> last;                        // Memory at the last checkpoint, for diffing
+};
+
+#endif // GRITVMREPLAY_H
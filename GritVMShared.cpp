@@ -0,0 +1,164 @@
+#include "GritVMShared.hpp"
+#include "GritVMTrace.hpp"
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <new>
+#include <stdexcept>
+#include <type_traits>
+#include <vector>
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#define GVM_HAVE_SHM 1
+#endif
+
+static_assert(std::is_trivially_copyable<Instruction>::value,
+              "Instructions are copied into shared memory byte for byte");
+
+namespace {
+    const uint32_t SEGMENT_MAGIC = 0x4D564753;     // "SGVM"
+    const uint32_t SEGMENT_VERSION = 2;
+
+    // Everything after the header is addressed by offset so the segment can be
+    // mapped anywhere. The magic is written last, readers ignore a segment
+    // that is still being filled in.
+    struct SegmentHeader {
+        std::atomic<uint32_t> magic;
+        uint32_t version;
+        uint64_t count;
+        uint64_t codeOffset;
+    };
+
+    static_assert(std::atomic<uint32_t>::is_always_lock_free,
+                  "The ready flag is shared between processes");
+
+    size_t codeOffset() {
+        size_t align = alignof(Instruction);
+        return (sizeof(SegmentHeader) + align - 1) / align * align;
+    }
+}
+
+SharedProgram::SharedProgram(void* mapping, size_t mappingSize, const Instruction* code, size_t count)
+    : mapping(mapping), mappingSize(mappingSize), code(code), count(count) {}
+
+#ifdef GVM_HAVE_SHM
+
+// Decode the file and copy it into a fresh segment
+STATUS SharedProgram::publish(const std::string& segmentName, const std::string& filename) {
+    GVMTrace::Span span("publish", filename);
+    std::ifstream file(filename);
+    if (!file) {
+        throw std::runtime_error("Unable to open file: " + filename);
+    }
+
+    std::vector<Instruction> decoded;
+    if (!GVMHelper::parseProgram(file, decoded)) {
+        return ERRORED;
+    }
+
+    // Replace rather than overwrite: processes still mapping the old version keep it
+    shm_unlink(segmentName.c_str());
+    int fd = shm_open(segmentName.c_str(), O_CREAT | O_EXCL | O_RDWR, 0644);
+    if (fd < 0) {
+        throw std::runtime_error("Unable to create shared segment: " + segmentName);
+    }
+
+    size_t offset = codeOffset();
+    size_t bytes = offset + decoded.size() * sizeof(Instruction);
+    void* base = MAP_FAILED;
+    if (ftruncate(fd, static_cast<off_t>(bytes)) == 0) {
+        base = mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    }
+    close(fd);
+    if (base == MAP_FAILED) {
+        shm_unlink(segmentName.c_str());
+        throw std::runtime_error("Unable to map shared segment: " + segmentName);
+    }
+
+    if (!decoded.empty()) {
+        std::memcpy(static_cast<char*>(base) + offset, decoded.data(), decoded.size() * sizeof(Instruction));
+    }
+    SegmentHeader* header = new (base) SegmentHeader;
+    header->version = SEGMENT_VERSION;
+    header->count = decoded.size();
+    header->codeOffset = offset;
+    header->magic.store(SEGMENT_MAGIC, std::memory_order_release);
+
+    munmap(base, bytes);
+    return decoded.empty() ? WAITING : READY;
+}
+
+// Map and sanity check a published segment
+std::shared_ptr<const SharedProgram> SharedProgram::open(const std::string& segmentName) {
+    GVMTrace::Span span("map", segmentName);
+    int fd = shm_open(segmentName.c_str(), O_RDONLY, 0);
+    if (fd < 0) {
+        return nullptr;
+    }
+
+    struct stat info;
+    if (fstat(fd, &info) != 0 || static_cast<size_t>(info.st_size) < codeOffset()) {
+        close(fd);
+        return nullptr;
+    }
+    size_t bytes = static_cast<size_t>(info.st_size);
+    void* base = mmap(nullptr, bytes, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (base == MAP_FAILED) {
+        return nullptr;
+    }
+
+    const SegmentHeader* header = static_cast<const SegmentHeader*>(base);
+    bool valid = header->magic.load(std::memory_order_acquire) == SEGMENT_MAGIC
+              && header->version == SEGMENT_VERSION
+              && header->codeOffset == codeOffset()
+              && header->count <= (bytes - codeOffset()) / sizeof(Instruction);
+
+    const Instruction* code = reinterpret_cast<const Instruction*>(static_cast<const char*>(base) + codeOffset());
+    for (uint64_t i = 0; valid && i < header->count; ++i) {
+        int op = static_cast<int>(code[i].operation);
+        valid = op >= CLEAR && op < UNKNOWN_INSTRUCTION;
+    }
+    if (!valid) {
+        munmap(base, bytes);
+        return nullptr;
+    }
+
+    return std::shared_ptr<const SharedProgram>(new SharedProgram(base, bytes, code, header->count));
+}
+
+bool SharedProgram::remove(const std::string& segmentName) {
+    return shm_unlink(segmentName.c_str()) == 0;
+}
+
+SharedProgram::~SharedProgram() {
+    munmap(mapping, mappingSize);
+}
+
+#else
+
+STATUS SharedProgram::publish(const std::string& segmentName, const std::string&) {
+    throw std::runtime_error("Shared program segments are not supported here: " + segmentName);
+}
+
+std::shared_ptr<const SharedProgram> SharedProgram::open(const std::string&) {
+    return nullptr;
+}
+
+bool SharedProgram::remove(const std::string&) {
+    return false;
+}
+
+SharedProgram::~SharedProgram() {}
+
+#endif
+
+// Alias the mapping's lifetime onto the instruction pointer handed to the VM
+std::shared_ptr<const Instruction> SharedProgram::instructions() const {
+    return std::shared_ptr<const Instruction>(shared_from_this(), code);
+}
@@ -0,0 +1,44 @@
+#ifndef GRITVMSHARED_H
+#define GRITVMSHARED_H
+
+#include "GritVMBase.hpp"
+#include <memory>
+#include <string>
+#include <cstddef>
+
+// A decoded program living in a named shared-memory segment. One process
+// publishes a .gvm file, every other process on the host maps the decoded
+// instructions read-only and runs them directly with GritVM::load(). The
+// segment only holds offsets and plain Instruction records, so it can be
+// mapped at any address.
+class SharedProgram : public std::enable_shared_from_this<SharedProgram> {
+private:
+    void* mapping;                                 // Start of the mapped segment
+    size_t mappingSize;                            // Bytes mapped
+    const Instruction* code;                       // First instruction inside the mapping
+    size_t count;                                  // Number of instructions
+
+    SharedProgram(void* mapping, size_t mappingSize, const Instruction* code, size_t count);
+
+public:
+    // Decode filename and publish it under segmentName (POSIX name, e.g. "/sumn").
+    // Throws if the file or segment cannot be opened, ERRORED on a bad instruction
+    static STATUS publish(const std::string& segmentName, const std::string& filename);
+
+    // Map a published program read-only, nullptr if it does not exist or is not complete
+    static std::shared_ptr<const SharedProgram> open(const std::string& segmentName);
+
+    // Remove the segment name; processes that already mapped it keep their mapping
+    static bool remove(const std::string& segmentName);
+
+    // Instructions for GritVM::load(), keeping the mapping alive while in use
+    std::shared_ptr<const Instruction> instructions() const;
+    size_t size() const { return count; }
+
+    ~SharedProgram();
+
+    SharedProgram(const SharedProgram&) = delete;
+    SharedProgram& operator=(const SharedProgram&) = delete;
+};
+
+#endif // GRITVMSHARED_H
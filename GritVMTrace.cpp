@@ -0,0 +1,92 @@
+#include "GritVMTrace.hpp"
+#include <fstream>
+#include <mutex>
+#include <vector>
+
+std::atomic<bool> GVMTrace::active{false};
+
+namespace {
+  struct Event {
+    const char* name;
+    std::string detail;
+    unsigned tid;
+    long long start;                               // Microseconds since start()
+    long long duration;
+  };
+
+  std::mutex traceMutex;                           // Guards everything below
+  std::vector<Event> events;
+  std::string traceFile;
+  std::chrono::steady_clock::time_point origin;
+
+  // Small stable thread ids read better in the viewer than hashed std::thread::id
+  unsigned threadId() {
+    static std::atomic<unsigned> next{1};
+    thread_local unsigned id = next.fetch_add(1);
+    return id;
+  }
+
+  void writeEscaped(std::ostream& out, const std::string& text) {
+    static const char hex[] = "0123456789abcdef";
+    for (char c : text) {
+      if (c == '"' || c == '\\') {
+        out << '\\' << c;
+      } else if (static_cast<unsigned char>(c) < 0x20) {
+        out << "\\u00" << hex[(c >> 4) & 0xf] << hex[c & 0xf];
+      } else {
+        out << c;
+      }
+    }
+  }
+}
+
+void GVMTrace::start(const std::string& filename) {
+  std::lock_guard<std::mutex> lock(traceMutex);
+  events.clear();
+  traceFile = filename;
+  origin = std::chrono::steady_clock::now();
+  active.store(true);
+}
+
+bool GVMTrace::stop() {
+  active.store(false);
+  std::lock_guard<std::mutex> lock(traceMutex);
+
+  std::ofstream out(traceFile);
+  out << "{\"traceEvents\":[";
+  for (size_t i = 0; i < events.size(); i++) {
+    const Event& event = events[i];
+    out << (i ? ",\n" : "\n") << "{\"name\":\"" << event.name << "\",\"cat\":\"gvm\",\"ph\":\"X\""
+        << ",\"ts\":" << event.start << ",\"dur\":" << event.duration
+        << ",\"pid\":1,\"tid\":" << event.tid;
+    if (!event.detail.empty()) {
+      out << ",\"args\":{\"detail\":\"";
+      writeEscaped(out, event.detail);
+      out << "\"}";
+    }
+    out << "}";
+  }
+  out << "\n],\"displayTimeUnit\":\"ms\"}\n";
+  events.clear();
+  return static_cast<bool>(out);
+}
+
+GVMTrace::Span::Span(const char* name, const std::string& detail)
+    : name(name), recording(enabled()) {
+  if (recording) {
+    this->detail = detail;
+    begin = std::chrono::steady_clock::now();
+  }
+}
+
+GVMTrace::Span::~Span() {
+  if (!recording || !enabled()) return;
+
+  auto end = std::chrono::steady_clock::now();
+  std::lock_guard<std::mutex> lock(traceMutex);
+  using std::chrono::duration_cast;
+  using std::chrono::microseconds;
+  events.push_back({ name, std::move(detail), threadId(),
+                     duration_cast<microseconds>(begin - origin).count(),
+                     duration_cast<microseconds>(end - begin).count() });
+}
@@ -0,0 +1,39 @@
+#ifndef GRITVMTRACE_H
+#define GRITVMTRACE_H
+
+#include <atomic>
+#include <chrono>
+#include <string>
+
+// Timeline of what GritVMs spend their time on, written as Chrome trace-event
+// JSON (chrome://tracing, ui.perfetto.dev). While tracing is off a Span costs
+// one relaxed load.
+namespace GVMTrace {
+  // Start collecting spans, dropping any collected before
+  void start(const std::string& filename);
+
+  // Stop collecting and write the file given to start(), false if it could not be written
+  bool stop();
+
+  extern std::atomic<bool> active;
+  inline bool enabled() { return active.load(std::memory_order_relaxed); }
+
+  // Records [construction, destruction) as a complete event on the current thread.
+  // name must outlive the trace (use string literals); detail is shown as an argument
+  class Span {
+  private:
+    const char* name;
+    std::string detail;
+    std::chrono::steady_clock::time_point begin;
+    bool recording;
+
+  public:
+    explicit Span(const char* name, const std::string& detail = std::string());
+    ~Span();
+
+    Span(const Span&) = delete;
+    Span& operator=(const Span&) = delete;
+  };
+};
+
+#endif // GRITVMTRACE_H
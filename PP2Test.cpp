@@ -14,8 +14,32 @@
 #include "catch.hpp"
 
 #include <cmath>
+#include <csignal>
+#include <cstdio>
+#include <fstream>
+#include <numeric>
+#include <thread>
+#include <chrono>
+#include <sstream>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <unistd.h>
 
 #include "GritVM.hpp"
+#include "GritVMShared.hpp"
+#include "GritVMRegistry.hpp"
+#include "GritVMHost.hpp"
+#include "GritVMProfiler.hpp"
+#include "GritVMTrace.hpp"
+#include "GritVMHeatmap.hpp"
+#include "GritVMMetrics.hpp"
+#include "GritVMReplay.hpp"
+#include "GritVMIR.hpp"
+#include "GritVMOptimize.hpp"
+#include "GritVMAnalysis.hpp"
+#include "GritVMFusion.hpp"
+#include "GritVMInput.hpp"
 
 TEST_CASE("Project 3 Test Cases for GritVM") {
   GritVM vm;
@@ -160,4 +184,1121 @@ TEST_CASE("Project 3 Test Cases for GritVM (EXTRA CREDIT!)") {
     vm.run();
     REQUIRE(vm.getDataMem() == checkMemory);
   }
-}
\ No newline at end of file
+}
+
+TEST_CASE("GritVM runs programs published to shared memory") {
+  GritVM vm;
+  long n = (rand() + 1) % 50;
+  std::vector<long> checkMemory = { n, n * (n + 1) / 2, n + 1 };
+
+  REQUIRE(SharedProgram::publish("/gvm_pp2_sumn", "sumn.gvm") == READY);
+  auto shared = SharedProgram::open("/gvm_pp2_sumn");
+  REQUIRE(shared != nullptr);
+  SharedProgram::remove("/gvm_pp2_sumn");
+
+  REQUIRE(vm.load(shared->instructions(), shared->size(), { n }) == READY);
+  REQUIRE(vm.run() == HALTED);
+  REQUIRE(vm.getDataMem() == checkMemory);
+
+  CHECK(SharedProgram::open("/gvm_pp2_missing") == nullptr);
+}
+
+TEST_CASE("ProgramRegistry swaps in reloaded programs for new runs only") {
+  ProgramRegistry registry(false);
+  GritVM before, after;
+
+  std::ofstream("reload_test.gvm") << "CLEAR\nADDCONST 1\nSET 0\n";
+  REQUIRE(registry.load(before, "reload_test.gvm", { 0 }) == READY);
+  REQUIRE(registry.acquire("reload_test.gvm")->generation == 1);
+
+  std::ofstream("reload_test.gvm") << "CLEAR\nADDCONST 20\nADDCONST 2\nSET 0\n";
+  REQUIRE(registry.refresh() == 1);
+  REQUIRE(registry.acquire("reload_test.gvm")->generation == 2);
+  REQUIRE(registry.load(after, "reload_test.gvm", { 0 }) == READY);
+
+  before.run();
+  after.run();
+  REQUIRE(before.getDataMem() == std::vector<long>{ 1 });
+  REQUIRE(after.getDataMem() == std::vector<long>{ 22 });
+
+  // A watching registry picks up a rewrite without refresh()
+  ProgramRegistry watching(true);
+  ProgramRegistry::Handle handle = watching.watch("reload_test.gvm");
+  REQUIRE(ProgramRegistry::current(handle)->code.size() == 4);
+  std::ofstream("reload_test.gvm") << "CLEAR\nADDCONST 5\nSET 0\n";
+  for (int wait = 0; wait < 2000 && ProgramRegistry::current(handle)->generation < 2; wait++) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+  }
+  REQUIRE(ProgramRegistry::current(handle)->generation == 2);
+  GritVM watched;
+  REQUIRE(watching.load(watched, "reload_test.gvm", { 0 }) == READY);
+  REQUIRE(watched.run() == HALTED);
+  REQUIRE(watched.getDataMem() == std::vector<long>{ 5 });
+
+  // Loading through the handle gets the same version without the registry lock
+  GritVM handled;
+  REQUIRE(ProgramRegistry::load(handled, handle, { 0 }) == READY);
+  REQUIRE(handled.run() == HALTED);
+  REQUIRE(handled.getDataMem() == std::vector<long>{ 5 });
+  REQUIRE(ProgramRegistry::load(handled, ProgramRegistry::Handle(), { 0 }) == ERRORED);
+
+  std::remove("reload_test.gvm");
+}
+
+TEST_CASE("GritVM runs programs while they are still being streamed in") {
+  GritVM vm;
+  long n = (rand() + 1) % 50;
+  std::vector<long> checkMemory = { n, n * (n + 1) / 2, n + 1 };
+
+  REQUIRE(vm.loadStreaming("sumn.gvm", { n }) == READY);
+  REQUIRE(vm.run() == HALTED);
+  REQUIRE(vm.getDataMem() == checkMemory);
+
+  {
+    std::ofstream program("stream_test.gvm");
+    program << "CLEAR\n";
+    for (int i = 0; i < 50000; i++) program << "ADDCONST 1\n";
+    program << "SET 0\nJUMPZERO 2\nBOGUS 1\n";
+  }
+  vm.reset();
+  REQUIRE(vm.loadStreaming("stream_test.gvm", { 0 }) == READY);
+  REQUIRE(vm.run() == ERRORED);
+  REQUIRE(vm.getDataMem() == std::vector<long>{ 50000 });
+
+  // A file with nothing to run leaves the VM WAITING and ready for any load
+  std::ofstream("stream_test.gvm") << "# empty\n";
+  vm.reset();
+  REQUIRE(vm.loadStreaming("stream_test.gvm", { 0 }) == WAITING);
+  REQUIRE(vm.loadStreaming("stream_test.gvm", { 0 }) == WAITING);
+  REQUIRE(vm.load("sumn.gvm", { 5 }) == READY);
+  REQUIRE(vm.run() == HALTED);
+  REQUIRE(vm.getDataMem() == std::vector<long>{ 5, 15, 6 });
+
+  std::remove("stream_test.gvm");
+}
+
+TEST_CASE("GritVM runs can be cancelled from another thread") {
+  GritVM vm;
+  auto token = std::make_shared<CancellationToken>();
+
+  std::ofstream("cancel_test.gvm") << "CLEAR\nADDCONST 1\nSET 0\nJUMPREL -2\n";
+  vm.setCancellationToken(token);
+  REQUIRE(vm.load("cancel_test.gvm", { 0 }) == READY);
+
+  std::thread canceller([token]() {
+    std::this_thread::sleep_for(std::chrono::milliseconds(20));
+    token->cancel();
+  });
+  REQUIRE(vm.run() == CANCELLED);
+  canceller.join();
+
+  REQUIRE(vm.getDataMem()[0] > 0);
+  REQUIRE(GVMHelper::statusToString(CANCELLED) == "CANCELLED");
+  REQUIRE(GVMHelper::stringToStatus("CANCELLED") == CANCELLED);
+
+  std::remove("cancel_test.gvm");
+}
+
+TEST_CASE("GritVMHost enforces per-VM caps and pauses tenants over budget") {
+  GritVMHost host(1);
+  GritVM vm;
+  TenantQuota quota;
+
+  quota.cellsPerVM = 2;
+  host.addTenant("small", quota);
+  REQUIRE(host.submit("small", vm, "sumn.gvm", { 5 }) == ERRORED);
+  REQUIRE(host.usage("small").errored == 1);
+
+  quota = TenantQuota();
+  quota.instructions = 40;
+  host.addTenant("metered", quota);
+  vm.reset();
+  REQUIRE(host.submit("metered", vm, "sumn.gvm", { 20 }) == PAUSED);
+  REQUIRE(host.run("metered", vm) == PAUSED);
+  REQUIRE(host.usage("metered").instructions >= 40);
+
+  host.newPeriod();
+  quota.instructions = 1000;
+  host.addTenant("metered", quota);
+  REQUIRE(host.run("metered", vm) == HALTED);
+  REQUIRE(vm.getDataMem() == std::vector<long>{ 20, 210, 21 });
+  REQUIRE(host.usage("metered").totalInstructions == vm.instructionsRetired());
+
+  // The per-run cap starts over for each run of a paused VM
+  quota = TenantQuota();
+  quota.instructions = 60;
+  quota.instructionsPerRun = 100;
+  host.addTenant("resumed", quota);
+  vm.reset();
+  STATUS status = host.submit("resumed", vm, "sumn.gvm", { 20 });
+  while (status == PAUSED) {
+    host.newPeriod();
+    status = host.run("resumed", vm);
+  }
+  REQUIRE(status == HALTED);
+  REQUIRE(vm.instructionsRetired() > 100);
+  REQUIRE(host.usage("resumed").errored == 0);
+
+  // Usage is counted from threads that are still running and from threads that have exited
+  GritVMHost batched(1000);
+  batched.addTenant("threads", TenantQuota());
+  STATUS exited = UNKNOWN, live = UNKNOWN, reader = UNKNOWN;
+  std::thread worker([&batched, &exited]() {
+    GritVM local;
+    exited = batched.submit("threads", local, "sumn.gvm", { 5 });
+  });
+  worker.join();
+  REQUIRE(exited == HALTED);
+  REQUIRE(batched.usage("threads").runs == 1);
+  std::mutex gate;
+  std::unique_lock<std::mutex> hold(gate);
+  std::thread running([&batched, &gate, &live]() {
+    GritVM local;
+    live = batched.submit("threads", local, "sumn.gvm", { 5 });
+    std::lock_guard<std::mutex> wait(gate);
+  });
+  while (batched.usage("threads").runs < 2) std::this_thread::sleep_for(std::chrono::milliseconds(1));
+  hold.unlock();
+  running.join();
+  REQUIRE(live == HALTED);
+  REQUIRE(batched.usage("threads").totalInstructions > 0);
+
+  // A run holds the cells its program can reach, not the tenant's whole quota
+  std::ofstream("host_test.gvm") << "INPUT 0\nHALT\n";
+  quota = TenantQuota();
+  quota.cells = 6;
+  host.addTenant("shared", quota);
+  auto ring = std::make_shared<RingBufferInput>(1);
+  std::thread blocked([&host, ring, &reader]() {
+    GritVM reading;
+    reading.setInput(ring);
+    reader = host.submit("shared", reading, "host_test.gvm", { 1, 2, 3 });
+  });
+  while (host.usage("shared").cellsReserved < 3) std::this_thread::sleep_for(std::chrono::milliseconds(1));
+  REQUIRE(host.usage("shared").cellsReserved == 3);
+  vm.reset();
+  REQUIRE(host.submit("shared", vm, "sumn.gvm", { 5 }) == HALTED);
+  ring->close();
+  blocked.join();
+  REQUIRE(reader == HALTED);
+  REQUIRE(host.usage("shared").cellsReserved == 0);
+  std::remove("host_test.gvm");
+
+  // Pausing on the budget retires each instruction once, however often it pauses
+  GritVM whole, sliced;
+  REQUIRE(whole.load("sumn.gvm", { 50 }) == READY);
+  REQUIRE(whole.run() == HALTED);
+  REQUIRE(sliced.load("sumn.gvm", { 50 }) == READY);
+  size_t pauses = 0;
+  do {
+    sliced.setInstructionBudget(sliced.instructionsRetired() + 7);
+    pauses++;
+  } while (sliced.run() == PAUSED);
+  REQUIRE(pauses > 40);
+  REQUIRE(sliced.instructionsRetired() == whole.instructionsRetired());
+  REQUIRE(sliced.getDataMem() == whole.getDataMem());
+
+  CHECK_THROWS(host.run("nobody", vm));
+}
+
+TEST_CASE("SamplingProfiler attributes samples to loops and blocks") {
+  GritVM vm;
+  SamplingProfiler profiler(200);
+  auto token = std::make_shared<CancellationToken>();
+
+  std::ofstream("profile_test.gvm") << "CLEAR\nADDCONST 1\nSET 0\nJUMPREL -2\n";
+  vm.setProfiler(&profiler, "spin");
+  vm.setCancellationToken(token);
+  REQUIRE(vm.load("profile_test.gvm", { 0 }) == READY);
+
+  std::thread canceller([token]() {
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    token->cancel();
+  });
+  REQUIRE(vm.run() == CANCELLED);
+  canceller.join();
+
+  auto blocks = profiler.blockHistogram("spin");
+  REQUIRE(blocks.count(1) == 1);
+  REQUIRE(blocks[1] > 0);
+
+  std::ostringstream folded;
+  profiler.writeFolded(folded);
+  REQUIRE(folded.str().find("spin;loop@1-3;block@1 ") == 0);
+
+  // Resuming the same load keeps counting into the same profile
+  unsigned long before = profiler.blockHistogram("spin")[1];
+  uint64_t id = vm.programId();
+  REQUIRE(vm.setBreakpoint(0));
+  REQUIRE(vm.programId() == id);
+  vm.clearBreakpoints();
+  token->clear();
+  vm.reset();
+  REQUIRE(vm.load("profile_test.gvm", { 0 }) == READY);
+  REQUIRE(vm.programId() != id);
+  for (int slice = 1; slice <= 20; slice++) {
+    vm.setInstructionBudget(slice * 2000000UL);
+    REQUIRE(vm.run() == PAUSED);
+  }
+  REQUIRE(profiler.blockHistogram("spin")[1] > before);
+  REQUIRE(profiler.histogram().size() == 1);
+
+  // The thread's timer stops with the run, so no SIGPROF arrives outside the VM
+  static std::atomic<int> strays{0};
+  struct sigaction counting = {}, previous = {};
+  counting.sa_handler = [](int) { strays.fetch_add(1); };
+  sigemptyset(&counting.sa_mask);
+  sigaction(SIGPROF, &counting, &previous);
+  auto until = std::chrono::steady_clock::now() + std::chrono::milliseconds(20);
+  volatile unsigned long spin = 0;
+  while (std::chrono::steady_clock::now() < until) spin = spin + 1;
+  sigaction(SIGPROF, &previous, nullptr);
+  REQUIRE(strays.load() == 0);
+
+  std::remove("profile_test.gvm");
+}
+
+TEST_CASE("GVMTrace writes load, parse and run spans as Chrome trace events") {
+  GritVM vm;
+
+  GVMTrace::start("trace_test.json");
+  vm.load("sumn.gvm", { 5 });
+  vm.run();
+  vm.getDataMem();
+  REQUIRE(GVMTrace::stop());
+
+  std::ifstream trace("trace_test.json");
+  std::stringstream contents;
+  contents << trace.rdbuf();
+  REQUIRE(contents.str().find("{\"traceEvents\":[") == 0);
+  for (const char* span : { "\"load\"", "\"open\"", "\"parse\"", "\"run\"", "\"getDataMem\"" }) {
+    REQUIRE(contents.str().find(span) != std::string::npos);
+  }
+  REQUIRE(contents.str().find("sumn.gvm") != std::string::npos);
+
+  std::remove("trace_test.json");
+}
+
+TEST_CASE("MemoryHeatmap counts accesses and renumbers fixed-layout programs") {
+  GritVM vm;
+  MemoryHeatmap heatmap;
+
+  vm.setHeatmap(&heatmap);
+  vm.load("surfarea.gvm", { 2, 3, 4 });
+  vm.run();
+  REQUIRE(heatmap.cells()[0].reads == 2);
+  REQUIRE(heatmap.cells()[0].erases == 3);
+  REQUIRE(heatmap.totalShifted() > 0);
+  LayoutAdvice advice = heatmap.adviseLayout(vm.getProgram());
+  REQUIRE_FALSE(advice.applicable);
+  REQUIRE_FALSE(advice.notes.empty());
+
+  std::ofstream("heatmap_test.gvm") << "AT 2\nADDCONST 1\nSET 2\nSUBMEM 0\nJUMPNZERO -4\nHALT\n";
+  std::vector<long> initialMemory = { 7, 0, 0 };
+  heatmap.clear();
+  vm.reset();
+  vm.load("heatmap_test.gvm", initialMemory);
+  vm.run();
+  std::vector<long> expected = vm.getDataMem();
+
+  advice = heatmap.adviseLayout(vm.getProgram());
+  REQUIRE(advice.applicable);
+  REQUIRE(advice.newIndexOf == std::vector<size_t>{ 1, 2, 0 });
+
+  std::ofstream renumbered("heatmap_test.gvm");
+  for (const Instruction& inst : advice.program) {
+    renumbered << GVMHelper::instructionToString(inst.operation) << " " << inst.argument << "\n";
+  }
+  renumbered.close();
+  vm.setHeatmap(nullptr);
+  vm.reset();
+  vm.load("heatmap_test.gvm", advice.toNewLayout(initialMemory));
+  vm.run();
+  REQUIRE(advice.toOriginalLayout(vm.getDataMem()) == expected);
+
+  std::remove("heatmap_test.gvm");
+}
+
+TEST_CASE("GVMMetrics aggregates per-thread counters into Prometheus text") {
+  GVMMetrics::Snapshot before;
+  GVMMetrics::snapshot(before);
+
+  std::thread worker([]() {
+    GritVM vm;
+    vm.load("sumn.gvm", { 10 });
+    vm.run();
+  });
+  worker.join();
+
+  GVMMetrics::Snapshot after;
+  GVMMetrics::snapshot(after);
+  REQUIRE(after.runs[HALTED] == before.runs[HALTED] + 1);
+  REQUIRE(after.loads[READY] == before.loads[READY] + 1);
+  REQUIRE(after.instructions > before.instructions);
+  REQUIRE(after.runLatency.count() == before.runLatency.count() + 1);
+
+  GVMMetrics::LatencyHistogram histogram;
+  for (uint64_t ns : { 1000, 2000, 3000, 100000 }) histogram.record(ns);
+  REQUIRE(histogram.percentile(0.25) >= 2000);
+  REQUIRE(histogram.percentile(0.25) <= 2048);
+  REQUIRE(histogram.percentile(1.0) >= 100000);
+
+  GVMMetrics::Endpoint endpoint;
+  endpoint.listenTcp(0);
+  int client = socket(AF_INET, SOCK_STREAM, 0);
+  sockaddr_in address = {};
+  address.sin_family = AF_INET;
+  address.sin_port = htons(endpoint.port());
+  address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  REQUIRE(connect(client, reinterpret_cast<sockaddr*>(&address), sizeof(address)) == 0);
+  std::string request = "GET /metrics HTTP/1.0\r\n\r\n";
+  REQUIRE(write(client, request.data(), request.size()) == static_cast<ssize_t>(request.size()));
+
+  std::string response;
+  char buffer[4096];
+  for (ssize_t n; (n = read(client, buffer, sizeof(buffer))) > 0; ) response.append(buffer, n);
+  close(client);
+  REQUIRE(response.find("200 OK") != std::string::npos);
+  REQUIRE(response.find("gritvm_runs_total{status=\"HALTED\"}") != std::string::npos);
+  REQUIRE(response.find("gritvm_run_duration_seconds_count") != std::string::npos);
+
+  // Bucket bounds double, and le is the largest nanosecond count each bucket holds
+  std::string text = GVMMetrics::prometheusText();
+  for (const char* bound : { "le=\"0.000001023\"", "le=\"0.000002047\"", "le=\"68.719476735\"" }) {
+    REQUIRE(text.find(std::string("gritvm_run_duration_seconds_bucket{") + bound + "}") != std::string::npos);
+  }
+  // The sum is exact to the nanosecond, where the default precision kept six digits
+  GVMMetrics::Snapshot now;
+  GVMMetrics::snapshot(now);
+  size_t sum = text.find("gritvm_run_duration_seconds_sum ");
+  REQUIRE(sum != std::string::npos);
+  long double total = std::stold(text.substr(sum + std::string("gritvm_run_duration_seconds_sum ").size()));
+  REQUIRE(std::llround(total * 1e9L) == static_cast<long long>(now.runLatency.sum()));
+}
+
+TEST_CASE("GritVM records where and why a program became ERRORED") {
+  GritVM vm;
+
+  std::ofstream("fault_test.gvm") << "CLEAR\nADDCONST 7\nSET 0\nDIVMEM 1\n";
+  REQUIRE(vm.load("fault_test.gvm", { 3, 0 }) == READY);
+  REQUIRE(vm.getFault().code == FAULT_NONE);
+  REQUIRE(vm.run() == ERRORED);
+  Fault fault = vm.getFault();
+  REQUIRE(fault.code == FAULT_DIVIDE_BY_ZERO);
+  REQUIRE(fault.pc == 3);
+  REQUIRE(fault.operation == DIVMEM);
+  REQUIRE(fault.argument == 1);
+  REQUIRE(fault.accumulator == 7);
+  REQUIRE(fault.memorySize == 2);
+
+  vm.reset();
+  REQUIRE(vm.getFault().code == FAULT_NONE);
+  REQUIRE(vm.load("fault_test.gvm", { 3 }) == READY);
+  REQUIRE(vm.run() == ERRORED);
+  REQUIRE(vm.getFault().code == FAULT_BAD_ADDRESS);
+  REQUIRE(GVMHelper::faultToString(vm.getFault().code) == "BAD_ADDRESS");
+
+  std::ofstream("fault_test.gvm") << "CLEAR\nCHECKMEM 1\nNOTANOP 2\n";
+  vm.reset();
+  REQUIRE(vm.load("fault_test.gvm", { 3 }) == ERRORED);
+  REQUIRE(vm.getFault().code == FAULT_BAD_INSTRUCTION);
+  REQUIRE(vm.getFault().pc == 2);
+  REQUIRE(vm.getFault().operation == UNKNOWN_INSTRUCTION);
+
+  REQUIRE(GVMMetrics::prometheusText().find("gritvm_faults_total{reason=\"DIVIDE_BY_ZERO\"}") != std::string::npos);
+  std::remove("fault_test.gvm");
+}
+
+TEST_CASE("GritVM breakpoints pause runs without changing their results") {
+  GritVM vm;
+  REQUIRE(vm.load("sumn.gvm", { 4 }) == READY);
+  REQUIRE_FALSE(vm.setBreakpoint(1000));
+
+  // Find the loop's backward jump and stop on it every iteration
+  GVMView<Instruction> program = vm.getProgram();
+  size_t latch = 0;
+  for (size_t i = 0; i < program.size; i++) {
+    if (program[i].operation == JUMPREL && program[i].argument < 0) latch = i;
+  }
+  REQUIRE(vm.setBreakpoint(latch));
+  REQUIRE(vm.getProgram()[latch].operation == BREAKPOINT);
+
+  int stops = 0;
+  while (vm.run() == PAUSED) {
+    REQUIRE(vm.atBreakpoint());
+    REQUIRE(vm.getPc() == latch);
+    stops++;
+  }
+  REQUIRE(vm.getDataMem() == std::vector<long>{ 4, 10, 5 });
+  REQUIRE(stops > 0);
+
+  unsigned long plain;
+  {
+    GritVM reference;
+    reference.load("sumn.gvm", { 4 });
+    reference.run();
+    plain = reference.instructionsRetired();
+  }
+  REQUIRE(vm.instructionsRetired() == plain);
+
+  vm.reset();
+  REQUIRE(vm.load("sumn.gvm", { 4 }) == READY);
+  REQUIRE(vm.step() == PAUSED);
+  REQUIRE(vm.getPc() == 1);
+  REQUIRE_FALSE(vm.atBreakpoint());
+  REQUIRE(vm.setBreakpoint(latch));
+  REQUIRE(vm.run() == PAUSED);
+  REQUIRE(vm.clearBreakpoint(latch));
+  REQUIRE(vm.getProgram()[latch].operation == JUMPREL);
+  REQUIRE(vm.run() == HALTED);
+  REQUIRE(vm.getDataMem() == std::vector<long>{ 4, 10, 5 });
+}
+
+TEST_CASE("GritVM watchpoints pause runs when a watched cell is written") {
+  GritVM vm;
+  REQUIRE(vm.load("sumn.gvm", { 3 }) == READY);
+  vm.watchCell(1);
+
+  // INSERT 1 creates the sum cell, then every SET 1 adds the next j
+  std::vector<WatchHit> hits;
+  while (vm.run() == PAUSED) {
+    REQUIRE(vm.atWatchpoint());
+    hits.push_back(vm.getWatchHit());
+  }
+  REQUIRE(vm.getDataMem() == std::vector<long>{ 3, 6, 4 });
+  REQUIRE(hits.size() == 4);                       // INSERT 2 does not reach cell 1
+  REQUIRE(vm.getProgram()[hits[0].pc].operation == INSERT);
+  REQUIRE(hits[0].oldValue == 0);
+  REQUIRE(hits[0].newValue == 0);
+  REQUIRE(vm.getProgram()[hits[1].pc].operation == SET);
+  REQUIRE(hits[1].oldValue == 0);
+  REQUIRE(hits[1].newValue == 1);
+  REQUIRE(hits[3].oldValue == 3);
+  REQUIRE(hits[3].newValue == 6);
+
+  // N is only ever read, so watching it never stops the run
+  vm.reset();
+  REQUIRE(vm.load("sumn.gvm", { 3 }) == READY);
+  vm.watchCell(0);
+  vm.clearWatches();
+  vm.watchCell(0);
+  REQUIRE(vm.run() == HALTED);
+  REQUIRE(vm.unwatchCell(0));
+
+  // runUntil() keeps watches and the heatmap
+  MemoryHeatmap heatmap;
+  vm.reset();
+  REQUIRE(vm.load("sumn.gvm", { 3 }) == READY);
+  vm.setHeatmap(&heatmap);
+  vm.watchCell(1);
+  REQUIRE(vm.runUntil(100) == PAUSED);
+  REQUIRE(vm.atWatchpoint());
+  REQUIRE(vm.instructionsRetired() == 3);          // INSERT 1
+  vm.clearWatches();
+  REQUIRE(vm.runUntil(10) == PAUSED);
+  REQUIRE_FALSE(vm.atWatchpoint());
+  REQUIRE(vm.instructionsRetired() == 10);
+  REQUIRE(heatmap.cells()[0].reads == 2);          // Both AT 0
+  REQUIRE(heatmap.cells()[1].inserts == 1);
+  vm.setHeatmap(nullptr);
+}
+
+TEST_CASE("ExecutionRecorder checkpoints runs and replays them to any instruction") {
+  ExecutionRecorder recorder(50, 4);
+  GritVM vm;
+  vm.setRecorder(&recorder);
+  std::vector<long> initial(20, 0);
+  initial[0] = 200;
+  REQUIRE(vm.load("sumn.gvm", initial) == READY);
+  REQUIRE(vm.run() == HALTED);
+  std::vector<long> final = vm.getDataMem();
+  unsigned long total = vm.instructionsRetired();
+
+  const auto& points = recorder.checkpoints();
+  REQUIRE(points.size() > total / 60);
+  REQUIRE(points[0].retired == 0);
+  REQUIRE(points[0].keyframe);
+  REQUIRE_FALSE(points[2].keyframe);
+  REQUIRE(points[2].changes.size() == 2);          // The sum and j
+
+  // Replaying from any checkpoint finishes the run the same way
+  GritVM replayed;
+  for (unsigned long at : { 0UL, total / 3, total / 2, total - 1 }) {
+    REQUIRE(recorder.replay(replayed, at) == PAUSED);
+    REQUIRE(replayed.instructionsRetired() == at);
+    REQUIRE(replayed.run() == HALTED);
+    REQUIRE(replayed.getDataMem() == final);
+    REQUIRE(replayed.instructionsRetired() == total);
+  }
+
+  // Stepping back lands on the state stepping forward left
+  REQUIRE(recorder.replay(replayed, total / 2) == PAUSED);
+  size_t pc = replayed.getPc();
+  long accumulator = replayed.getAccumulator();
+  std::vector<long> memory = replayed.getDataMem();
+  REQUIRE(replayed.step() == PAUSED);
+  REQUIRE(recorder.reverseStep(replayed) == PAUSED);
+  REQUIRE(replayed.instructionsRetired() == total / 2);
+  REQUIRE(replayed.getPc() == pc);
+  REQUIRE(replayed.getAccumulator() == accumulator);
+  REQUIRE(replayed.getDataMem() == memory);
+
+  // Checkpoints hold the instructions breakpoints cover, so a replay runs through them
+  recorder.clear();
+  vm.reset();
+  initial[0] = 20;
+  REQUIRE(vm.load("sumn.gvm", initial) == READY);
+  REQUIRE(vm.setBreakpoint(14));
+  STATUS status;
+  while ((status = vm.run()) == PAUSED) {
+    REQUIRE(vm.getPc() == 14);
+  }
+  REQUIRE(status == HALTED);
+  final = vm.getDataMem();
+  total = vm.instructionsRetired();
+  REQUIRE(recorder.replay(replayed, total / 2) == PAUSED);
+  REQUIRE(replayed.run() == HALTED);
+  REQUIRE(replayed.getDataMem() == final);
+  REQUIRE(replayed.instructionsRetired() == total);
+}
+
+TEST_CASE("GritVM state can be inspected and formatted without copies") {
+  GritVM vm;
+  REQUIRE(vm.load("sumn.gvm", { 5 }) == READY);
+  REQUIRE(vm.run() == HALTED);
+
+  VMState state = vm.inspect();
+  REQUIRE(state.status == HALTED);
+  REQUIRE(state.memory.size == 3);
+  REQUIRE(state.memory[1] == 15);
+  REQUIRE(state.program[0].operation == CHECKMEM);
+
+  std::ostringstream expected;
+  expected << "Status: HALTED\nAccumulator: " << state.accumulator << "\n*** Data Memory ***\n";
+  for (size_t i = 0; i < state.memory.size; i++) expected << "Location " << i << ": " << state.memory[i] << "\n";
+  expected << "*** Instruction Memory ***\n";
+  for (size_t i = 0; i < state.program.size; i++) {
+    expected << "Instruction " << i << ": " << GVMHelper::instructionToString(state.program[i].operation)
+             << " " << state.program[i].argument << "\n";
+  }
+
+  // Small buffers are flushed many times over and must give the same text
+  for (size_t capacity : { 0, 300, 4096 }) {
+    std::vector<char> buffer(capacity);
+    std::ostringstream out;
+    GVMHelper::formatState(out, state, buffer.data(), buffer.size());
+    REQUIRE(out.str() == expected.str());
+  }
+  REQUIRE(GVMHelper::instructionName(JUMPNZERO) == "JUMPNZERO");
+  REQUIRE(GVMHelper::statusName(PAUSED) == "PAUSED");
+}
+
+TEST_CASE("GVMIR builds SSA form and lowers it back to equivalent programs") {
+  // Round trip every sample program and compare against the original
+  struct Sample { const char* file; std::vector<long> memory; };
+  for (const Sample& sample : { Sample{ "sumn.gvm", { 20 } }, Sample{ "fact.gvm", { 6 } },
+                                Sample{ "altseq.gvm", { 9 } }, Sample{ "surfarea.gvm", { 2, 3, 4 } },
+                                Sample{ "toh.gvm", { 5 } }, Sample{ "test.gvm", {} } }) {
+    GritVM original;
+    REQUIRE(original.load(sample.file, sample.memory) == READY);
+
+    GVMIR::Function function;
+    REQUIRE(GVMIR::build(original.getProgram(), function));
+    REQUIRE(GVMIR::verify(function).empty());
+    std::vector<Instruction> lowered;
+    REQUIRE(GVMIR::lower(function, lowered));
+
+    GritVM rebuilt;
+    auto code = std::make_shared<std::vector<Instruction>>(lowered);
+    rebuilt.load(std::shared_ptr<const Instruction>(code, code->data()), code->size(), sample.memory);
+    REQUIRE(original.run() == rebuilt.run());
+    REQUIRE(original.getDataMem() == rebuilt.getDataMem());
+  }
+
+  // With a fixed layout the loop counter in cell 1 gets a phi at the loop header
+  std::ofstream("ir_test.gvm") << "CHECKMEM 2\nAT 0\nSET 1\nAT 1\nJUMPZERO 5\nSUBCONST 1\nSET 1\nNOOP\nJUMPREL -5\nHALT\n";
+  GritVM vm;
+  REQUIRE(vm.load("ir_test.gvm", { 4, 0 }) == READY);
+  GVMIR::Function function;
+  REQUIRE(GVMIR::build(vm.getProgram(), function));
+  REQUIRE(function.promotedCells);
+  REQUIRE(GVMIR::verify(function).empty());
+  bool cellPhi = false;
+  for (const GVMIR::Value& value : function.values) {
+    if (value.op == GVMIR::IR_PHI && value.home == 1) cellPhi = true;
+  }
+  REQUIRE(cellPhi);
+
+  std::vector<Instruction> lowered;
+  std::vector<size_t> origins;
+  REQUIRE(GVMIR::lower(function, lowered, &origins));
+  REQUIRE(origins.size() == lowered.size());
+  REQUIRE(lowered.size() == 9);                    // The NOOP is dropped
+  std::ostringstream text;
+  GVMIR::print(text, function);
+  REQUIRE(text.str().find("phi") != std::string::npos);
+  std::remove("ir_test.gvm");
+}
+
+TEST_CASE("GVMOptimize hoists loop-invariant work out of loops") {
+  // Cell 2 = cell 0 * 3 + cell 1 is recomputed on every pass of the countdown in cell 3
+  std::ofstream("licm_test.gvm") << "CHECKMEM 5\nAT 3\nJUMPZERO 12\nAT 0\nMULCONST 3\nADDMEM 1\nSET 2\n"
+                                    "AT 4\nADDMEM 2\nSET 4\nAT 3\nSUBCONST 1\nSET 3\nJUMPREL -12\nHALT\n";
+  GritVM original;
+  REQUIRE(original.load("licm_test.gvm", { 5, 2, 0, 100, 0 }) == READY);
+
+  GVMIR::Function function;
+  REQUIRE(GVMIR::build(original.getProgram(), function));
+  REQUIRE(GVMOptimize::hoistInvariants(function) > 0);
+  REQUIRE(GVMIR::verify(function).empty());
+
+  std::vector<Instruction> optimized;
+  std::vector<size_t> origins;
+  REQUIRE(GVMOptimize::optimize(original.getProgram(), optimized, &origins));
+  REQUIRE(origins.size() == optimized.size());
+
+  GritVM hoisted;
+  auto code = std::make_shared<std::vector<Instruction>>(optimized);
+  REQUIRE(hoisted.load(std::shared_ptr<const Instruction>(code, code->data()), code->size(),
+                       { 5, 2, 0, 100, 0 }) == READY);
+  REQUIRE(original.run() == HALTED);
+  REQUIRE(hoisted.run() == HALTED);
+  REQUIRE(original.getDataMem() == hoisted.getDataMem());
+  REQUIRE(hoisted.getDataMem()[4] == 1700);
+  REQUIRE(hoisted.instructionsRetired() < original.instructionsRetired());
+
+  // Every sample program still gives the same results
+  struct Sample { const char* file; std::vector<long> memory; };
+  for (const Sample& sample : { Sample{ "sumn.gvm", { 20 } }, Sample{ "fact.gvm", { 6 } },
+                                Sample{ "altseq.gvm", { 9 } }, Sample{ "surfarea.gvm", { 2, 3, 4 } },
+                                Sample{ "toh.gvm", { 5 } }, Sample{ "test.gvm", {} } }) {
+    GritVM vm;
+    REQUIRE(vm.load(sample.file, sample.memory) == READY);
+    std::vector<Instruction> program;
+    REQUIRE(GVMOptimize::optimize(vm.getProgram(), program));
+
+    GritVM rebuilt;
+    auto sampleCode = std::make_shared<std::vector<Instruction>>(program);
+    rebuilt.load(std::shared_ptr<const Instruction>(sampleCode, sampleCode->data()), sampleCode->size(), sample.memory);
+    REQUIRE(vm.run() == rebuilt.run());
+    REQUIRE(vm.getDataMem() == rebuilt.getDataMem());
+  }
+  std::remove("licm_test.gvm");
+}
+
+TEST_CASE("GVMOptimize versions loops behind one memory check") {
+  // Sums cells 1 to 3 into cell 4, cell 0 times, with no CHECKMEM to prove the cells exist
+  std::ofstream("version_test.gvm") << "AT 0\nJUMPZERO 11\nAT 4\nADDMEM 1\nADDMEM 2\nADDMEM 3\nSET 4\n"
+                                       "AT 0\nSUBCONST 1\nSET 0\nJUMPREL -10\nHALT\n";
+  GritVM original;
+  REQUIRE(original.load("version_test.gvm", { 50, 1, 2, 3, 0 }) == READY);
+
+  GVMIR::Function function;
+  REQUIRE(GVMIR::build(original.getProgram(), function));
+  REQUIRE(GVMOptimize::versionLoops(function) == 1);
+  REQUIRE(function.versioned[0].cells == 5);
+  REQUIRE(GVMIR::verify(function).empty());
+
+  std::vector<Instruction> optimized;
+  REQUIRE(GVMOptimize::optimize(original.getProgram(), optimized));
+  auto count = [&](INSTRUCTION_SET op) {
+    return std::count_if(optimized.begin(), optimized.end(), [op](const Instruction& inst) { return inst.operation == op; });
+  };
+  REQUIRE(count(MEMGUARD) == 1);
+  REQUIRE(count(ADDRAW) == 3);
+  REQUIRE(count(ADDMEM) == 3);                     // The checked copy is still there
+  auto code = std::make_shared<std::vector<Instruction>>(optimized);
+
+  // Enough memory takes the unchecked copy
+  GritVM versioned;
+  REQUIRE(versioned.load(std::shared_ptr<const Instruction>(code, code->data()), code->size(), { 50, 1, 2, 3, 0 }) == READY);
+  REQUIRE(original.run() == HALTED);
+  REQUIRE(versioned.run() == HALTED);
+  REQUIRE(versioned.getDataMem() == original.getDataMem());
+  REQUIRE(versioned.getDataMem()[4] == 300);
+
+  // Too little falls back to the checked copy, which faults where the original does
+  GritVM small;
+  REQUIRE(small.load(std::shared_ptr<const Instruction>(code, code->data()), code->size(), { 50, 1, 2 }) == READY);
+  REQUIRE(small.run() == ERRORED);
+  REQUIRE(small.getFault().code == FAULT_BAD_ADDRESS);
+  std::remove("version_test.gvm");
+}
+
+TEST_CASE("Guard-paged data memory faults out of range accesses in hardware") {
+  GritVM vm;
+  REQUIRE(vm.setGuardPages(true));
+
+  // Same results as heap memory on the sample programs
+  GritVM heap;
+  REQUIRE(vm.load("surfarea.gvm", { 2, 3, 4 }) == READY);
+  REQUIRE(heap.load("surfarea.gvm", { 2, 3, 4 }) == READY);
+  REQUIRE(vm.run() == heap.run());
+  REQUIRE(vm.getDataMem() == heap.getDataMem());
+
+  // Past the end and below the start both fault like the checked interpreter
+  for (const char* source : { "CLEAR\nADDCONST 7\nSET 1\nAT 3\nHALT\n", "CLEAR\nADDMEM -1\nHALT\n",
+                              "CLEAR\nADDCONST 9\nSET 2\nHALT\n" }) {
+    std::ofstream("guard_test.gvm") << source;
+    vm.reset();
+    heap.reset();
+    REQUIRE(vm.load("guard_test.gvm", { 1, 2, 3 }) == READY);
+    REQUIRE(heap.load("guard_test.gvm", { 1, 2, 3 }) == READY);
+    STATUS status = heap.run();
+    REQUIRE(vm.run() == status);
+    REQUIRE(vm.getDataMem() == heap.getDataMem());
+    REQUIRE(vm.getFault().code == heap.getFault().code);
+    REQUIRE(vm.getFault().pc == heap.getFault().pc);
+    REQUIRE(vm.getFault().accumulator == heap.getFault().accumulator);
+    REQUIRE(vm.instructionsRetired() == heap.instructionsRetired());
+  }
+  REQUIRE(vm.getFault().code == FAULT_NONE);
+
+  // Growing well past the first reservation keeps every cell
+  std::ofstream("guard_test.gvm") << "AT 0\nSUBCONST 1\nINSERT 0\nJUMPNZERO -3\nAT 200000\nSET 200001\nHALT\n";
+  vm.reset();
+  REQUIRE(vm.load("guard_test.gvm", { 200000 }) == READY);
+  REQUIRE(vm.run() == ERRORED);
+  REQUIRE(vm.getFault().code == FAULT_BAD_ADDRESS);
+  REQUIRE(vm.getFault().pc == 5);
+  std::vector<long> memory = vm.getDataMem();
+  REQUIRE(memory.size() == 200001);
+  REQUIRE(memory[0] == 0);
+  REQUIRE(memory[199999] == 199999);
+  REQUIRE(memory[200000] == 200000);
+
+  // And going back to the heap keeps them too
+  REQUIRE(vm.setGuardPages(false));
+  REQUIRE(vm.getDataMem() == memory);
+
+  // A cell named beyond the largest guard is checked in software instead
+  std::ofstream("guard_test.gvm") << "INSERT 0\nAT 1\nAT 1000000000000\nHALT\n";
+  vm.reset();
+  REQUIRE(vm.setGuardPages(true));
+  REQUIRE(vm.load("guard_test.gvm", { 4 }) == READY);
+  REQUIRE(vm.run() == ERRORED);
+  REQUIRE(vm.getFault().code == FAULT_BAD_ADDRESS);
+  REQUIRE(vm.getFault().pc == 2);
+  REQUIRE(vm.getAccumulator() == 4);
+
+  // The guard reaches as far as asked, with the cells where they were
+  DataMemory guarded;
+  REQUIRE(guarded.setBackend(DataMemory::GUARDED));
+  guarded = std::vector<long>{ 1, 2, 3 };
+  REQUIRE(guarded.guardReach(300000));
+  REQUIRE(guarded.toVector() == std::vector<long>({ 1, 2, 3 }));
+  REQUIRE(guarded.inGuard(guarded.data() + 299999));
+  REQUIRE_FALSE(guarded.guardReach(size_t(1) << 40));
+  std::remove("guard_test.gvm");
+}
+
+TEST_CASE("Peak memory growth is found before the run and reserved at load") {
+  struct Sample { const char* file; size_t growth; };
+  for (const Sample& sample : { Sample{ "fact.gvm", 2 }, Sample{ "altseq.gvm", 2 }, Sample{ "sumn.gvm", 2 },
+                                Sample{ "surfarea.gvm", 3 } }) {
+    GritVM vm;
+    REQUIRE(vm.load(sample.file, { 4, 5, 6 }) == READY);
+    size_t growth;
+    REQUIRE(GVMAnalysis::peakGrowth(vm.getProgram(), growth));
+    REQUIRE(growth == sample.growth);
+  }
+
+  // A loop that inserts and erases once per pass is bounded by its high point,
+  // one that only inserts has no bound
+  std::vector<Instruction> balanced = { Instruction(INSERT, 0), Instruction(INSERT, 0), Instruction(ERASE, 0),
+                                        Instruction(ERASE, 0), Instruction(JUMPNZERO, -4), Instruction(INSERT, 0) };
+  size_t growth;
+  REQUIRE(GVMAnalysis::peakGrowth(GVMView<Instruction>(balanced.data(), balanced.size()), growth));
+  REQUIRE(growth == 2);
+  balanced[3] = Instruction(NOOP);
+  REQUIRE_FALSE(GVMAnalysis::peakGrowth(GVMView<Instruction>(balanced.data(), balanced.size()), growth));
+
+  // Reserved heap cells are filled without reallocating
+  DataMemory memory;
+  memory.reserve(8);
+  memory = std::vector<long>{ 1, 2 };
+  const long* first = memory.data();
+  for (long i = 0; i < 6; i++) memory.insert(memory.size(), i);
+  REQUIRE(memory.data() == first);
+  REQUIRE(memory.toVector() == std::vector<long>({ 1, 2, 0, 1, 2, 3, 4, 5 }));
+}
+
+TEST_CASE("Mapped data memory grows in place and can live in a file") {
+  // The counter INSERTs itself in front of every cell, past the first mapping
+  std::ofstream("mapped_test.gvm") << "AT 0\nSUBCONST 1\nINSERT 0\nJUMPNZERO -3\nAT 200000\nHALT\n";
+  std::vector<long> initial(131068, 7);              // Just under the first 1 MiB mapping
+  initial[0] = 10;
+
+  GritVM heap;
+  REQUIRE(heap.load("mapped_test.gvm", initial) == READY);
+  REQUIRE(heap.run() == ERRORED);
+  std::vector<long> expected = heap.getDataMem();
+  REQUIRE(expected.size() == 131078);
+
+  {
+    GritVM vm;
+    REQUIRE(vm.setMappedMemory("mapped_test.mem"));
+    REQUIRE(vm.load("mapped_test.gvm", initial) == READY);
+    REQUIRE(vm.run() == ERRORED);
+    REQUIRE(vm.getFault().code == FAULT_BAD_ADDRESS);
+    REQUIRE(vm.getFault().pc == 4);
+    REQUIRE(vm.inspect().memory.size == expected.size());
+    REQUIRE(std::equal(expected.begin(), expected.end(), vm.inspect().memory.begin()));
+  }
+
+  // Once the VM is gone the file is exactly the final cells
+  std::ifstream file("mapped_test.mem", std::ios::binary);
+  std::vector<long> stored(expected.size() + 1);
+  file.read(reinterpret_cast<char*>(stored.data()), stored.size() * sizeof(long));
+  REQUIRE(static_cast<size_t>(file.gcount()) == expected.size() * sizeof(long));
+  stored.pop_back();
+  REQUIRE(stored == expected);
+
+  // Anonymous mappings behave the same, and can be left for the heap again
+  GritVM anonymous;
+  REQUIRE(anonymous.setMappedMemory());
+  REQUIRE(anonymous.load("mapped_test.gvm", initial) == READY);
+  REQUIRE(anonymous.run() == ERRORED);
+  REQUIRE(anonymous.setGuardPages(false));
+  REQUIRE(anonymous.getDataMem() == expected);
+  std::remove("mapped_test.gvm");
+  std::remove("mapped_test.mem");
+}
+
+TEST_CASE("Programs that cannot move cells run without per-access bounds checks") {
+  // Sums cell 0 down to 1 into cell 1, cell 2 counts the passes
+  const char* source = "AT 0\nJUMPZERO 10\nADDMEM 1\nSET 1\nAT 2\nADDCONST 1\nSET 2\nAT 0\nSUBCONST 1\nSET 0\nJUMPREL -10\nHALT\n";
+  std::ofstream("resolved_test.gvm") << source;
+  size_t cells;
+  GritVM vm;
+  REQUIRE(vm.load("resolved_test.gvm", { 100, 0, 0 }) == READY);
+  REQUIRE(GVMAnalysis::cellSpan(vm.getProgram(), cells));
+  REQUIRE(cells == 3);
+
+  // The resolved run agrees with the checked one runUntil() takes
+  GritVM checked;
+  REQUIRE(checked.load("resolved_test.gvm", { 100, 0, 0 }) == READY);
+  REQUIRE(vm.run() == HALTED);
+  REQUIRE(checked.runUntil(std::numeric_limits<unsigned long>::max()) == HALTED);
+  REQUIRE(vm.getDataMem() == std::vector<long>{ 0, 5050, 100 });
+  REQUIRE(vm.getDataMem() == checked.getDataMem());
+  REQUIRE(vm.instructionsRetired() == checked.instructionsRetired());
+
+  // Too little memory for every cell named falls back to checking each access
+  vm.reset();
+  REQUIRE(vm.load("resolved_test.gvm", { 3, 0 }) == READY);
+  REQUIRE(vm.run() == ERRORED);
+  REQUIRE(vm.getFault().code == FAULT_BAD_ADDRESS);
+  REQUIRE(vm.getFault().pc == 4);
+  REQUIRE(vm.getDataMem() == std::vector<long>{ 3, 3 });
+
+  // Breakpoints and stepping keep working on the resolved path
+  vm.reset();
+  REQUIRE(vm.load("resolved_test.gvm", { 2, 0, 0 }) == READY);
+  REQUIRE(vm.setBreakpoint(3));
+  REQUIRE(vm.run() == PAUSED);
+  REQUIRE(vm.atBreakpoint());
+  REQUIRE(vm.step() == PAUSED);
+  REQUIRE(vm.getDataMem() == std::vector<long>{ 2, 2, 0 });
+  vm.clearBreakpoints();
+  REQUIRE(vm.run() == HALTED);
+  REQUIRE(vm.getDataMem() == std::vector<long>{ 0, 3, 2 });
+
+  // Layout changes and negative cells rule it out
+  for (const char* other : { "AT 0\nINSERT 0\nHALT\n", "AT 0\nERASE 1\nHALT\n", "AT -1\nHALT\n" }) {
+    std::ofstream("resolved_test.gvm") << other;
+    GritVM mutating;
+    REQUIRE(mutating.load("resolved_test.gvm", { 1, 2 }) == READY);
+    REQUIRE_FALSE(GVMAnalysis::cellSpan(mutating.getProgram(), cells));
+  }
+
+  // An empty program leaves the VM WAITING, and a streamed one loaded after it
+  // is still checked access by access
+  std::ofstream("resolved_test.gvm") << "# nothing here\n";
+  GritVM streamed;
+  REQUIRE(streamed.load("resolved_test.gvm", {}) == WAITING);
+  std::ofstream("resolved_test.gvm") << "CLEAR\nADDCONST 5\nSET 1000000\nINSERT 0\n";
+  REQUIRE(streamed.loadStreaming("resolved_test.gvm", {}) == READY);
+  REQUIRE(streamed.run() == ERRORED);
+  REQUIRE(streamed.getFault().code == FAULT_BAD_ADDRESS);
+  REQUIRE(streamed.getFault().pc == 2);
+  std::remove("resolved_test.gvm");
+}
+
+TEST_CASE("Hot loops move to the optimized tier mid-run and back") {
+  // The hoisting program from above, counting down from 20000
+  std::string loop = "CHECKMEM 5\nAT 3\nJUMPZERO 12\nAT 0\nMULCONST 3\nADDMEM 1\nSET 2\n"
+                     "AT 4\nADDMEM 2\nSET 4\nAT 3\nSUBCONST 1\nSET 3\nJUMPREL -12\n";
+  std::ofstream("tier_test.gvm") << loop << "HALT\n";
+  std::vector<long> memory = { 5, 2, 0, 20000, 0 };
+
+  GritVM interpreted;
+  REQUIRE(interpreted.load("tier_test.gvm", memory) == READY);
+  REQUIRE(interpreted.run() == HALTED);
+
+  // One run crosses into the optimized program, which retires fewer instructions
+  GritVM tiered;
+  tiered.setTiering(1000);
+  REQUIRE(tiered.load("tier_test.gvm", memory) == READY);
+  REQUIRE(tiered.run() == HALTED);
+  REQUIRE(tiered.getDataMem() == interpreted.getDataMem());
+  REQUIRE(tiered.getAccumulator() == interpreted.getAccumulator());
+  REQUIRE(tiered.instructionsRetired() < interpreted.instructionsRetired());
+
+  // Pausing leaves the run on the loaded program, at an instruction of it
+  tiered.reset();
+  REQUIRE(tiered.load("tier_test.gvm", memory) == READY);
+  const Instruction* loaded = tiered.getProgram().begin();
+  STATUS status;
+  size_t pauses = 0;
+  do {
+    tiered.setInstructionBudget(tiered.instructionsRetired() + 5000);
+    status = tiered.run();
+    REQUIRE(tiered.getProgram().begin() == loaded);
+    REQUIRE(tiered.getPc() < tiered.getProgram().size);
+    pauses += (status == PAUSED);
+  } while (status == PAUSED);
+  REQUIRE(status == HALTED);
+  REQUIRE(pauses > 1);
+  REQUIRE(tiered.getDataMem() == interpreted.getDataMem());
+
+  // A fault in the optimized program is reported against the loaded one
+  std::ofstream("tier_test.gvm") << loop << "DIVCONST 0\n";
+  interpreted.reset();
+  tiered.reset();
+  tiered.setInstructionBudget(std::numeric_limits<unsigned long>::max());
+  REQUIRE(interpreted.load("tier_test.gvm", memory) == READY);
+  REQUIRE(tiered.load("tier_test.gvm", memory) == READY);
+  REQUIRE(interpreted.run() == ERRORED);
+  REQUIRE(tiered.run() == ERRORED);
+  REQUIRE(tiered.getFault().code == FAULT_DIVIDE_BY_ZERO);
+  REQUIRE(tiered.getFault().pc == interpreted.getFault().pc);
+  REQUIRE(tiered.getFault().operation == DIVCONST);
+  REQUIRE(tiered.getFault().accumulator == interpreted.getFault().accumulator);
+  REQUIRE(tiered.getPc() == interpreted.getPc());
+  std::remove("tier_test.gvm");
+}
+
+TEST_CASE("Superinstruction candidates are mined from counted and scanned programs") {
+  // Counts cell 0 down from 10
+  std::ofstream("fusion_test.gvm") << "AT 0\nJUMPZERO 4\nSUBCONST 1\nSET 0\nJUMPREL -4\nHALT\n";
+  std::vector<Instruction> program;
+  std::vector<unsigned long> executions;
+  REQUIRE(GVMFusion::countExecutions("fusion_test.gvm", { 10 }, program, executions, 1000) == HALTED);
+  REQUIRE(executions == std::vector<unsigned long>{ 11, 11, 10, 10, 10, 1 });
+  GVMMetrics::Snapshot before, after;
+  GVMMetrics::snapshot(before);
+  REQUIRE(GVMFusion::countExecutions("fusion_test.gvm", { 10 }, program, executions, 20) == PAUSED);
+  GVMMetrics::snapshot(after);
+  REQUIRE(std::accumulate(executions.begin(), executions.end(), 0UL) == 20);
+  REQUIRE(after.runs[PAUSED] == before.runs[PAUSED] + 1);  // One run, not one per instruction
+
+  // Counts attached to a VM pick up every run, and runs without them are not counted
+  GritVM vm;
+  std::vector<unsigned long> counted;
+  REQUIRE(vm.load("fusion_test.gvm", { 3 }) == READY);
+  vm.setExecutionCounts(&counted);
+  REQUIRE(vm.run() == HALTED);
+  REQUIRE(counted == std::vector<unsigned long>{ 4, 4, 3, 3, 3, 1 });
+  vm.setExecutionCounts(nullptr);
+  vm.reset();
+  REQUIRE(vm.load("fusion_test.gvm", { 3 }) == READY);
+  REQUIRE(vm.run() == HALTED);
+  REQUIRE(counted == std::vector<unsigned long>{ 4, 4, 3, 3, 3, 1 });
+
+  // Jumps only end a sequence, and HALT is never part of one
+  GVMFusion::Counts counts;
+  GVMFusion::add(counts, GVMView<Instruction>(program.data(), program.size()), { 11, 11, 10, 10, 10, 1 });
+  std::vector<GVMFusion::Candidate> ranked = GVMFusion::rank(counts, 10);
+  REQUIRE(ranked.size() == 4);
+  REQUIRE(ranked[0].ops == std::vector<INSTRUCTION_SET>{ SUBCONST, SET, JUMPREL });
+  REQUIRE(ranked[0].saved == 20);
+  REQUIRE(ranked[1].ops == std::vector<INSTRUCTION_SET>{ AT, JUMPZERO });
+  REQUIRE(ranked[1].saved == 11);
+  REQUIRE(GVMFusion::rank(counts, 2).size() == 2);
+
+  // Without a run, the loop is what counts
+  std::vector<unsigned long> guessed = GVMFusion::staticExecutions(GVMView<Instruction>(program.data(), program.size()));
+  REQUIRE(guessed == std::vector<unsigned long>{ 10, 10, 10, 10, 10, 1 });
+
+  // Samples pile up across a corpus
+  for (const char* sample : { "sumn.gvm", "fact.gvm" }) {
+    REQUIRE(GVMFusion::countExecutions(sample, { 8 }, program, executions, 100000) == HALTED);
+    GVMFusion::add(counts, GVMView<Instruction>(program.data(), program.size()), executions);
+  }
+  ranked = GVMFusion::rank(counts, 5);
+  REQUIRE(ranked.size() == 5);
+  for (size_t i = 1; i < ranked.size(); i++) REQUIRE(ranked[i - 1].saved >= ranked[i].saved);
+
+  std::ostringstream report, handlers;
+  GVMFusion::report(report, ranked);
+  REQUIRE(report.str().find("1. ") == 0);
+  GVMFusion::Candidate loop;
+  loop.ops = { SUBCONST, SET, JUMPREL };
+  REQUIRE(GVMFusion::opcodeName(loop) == "FUSED_SUBCONST_SET_JUMPREL");
+  GVMFusion::writeHandlers(handlers, { loop });
+  REQUIRE(handlers.str().find("case FUSED_SUBCONST_SET_JUMPREL: {") != std::string::npos);
+  REQUIRE(handlers.str().find("fail(FAULT_BAD_ADDRESS, pc + 1);") != std::string::npos);
+  REQUIRE(handlers.str().find("return 2 + arg2;") != std::string::npos);
+  std::remove("fusion_test.gvm");
+}
+
+TEST_CASE("INPUT streams values into the accumulator from an input source") {
+  // Adds every value of the input into cell 0, then leaves the total in the accumulator
+  std::ofstream("input_test.gvm") << "INPUT 4\nADDMEM 0\nSET 0\nJUMPREL -3\nAT 0\n";
+  std::vector<long> values;
+  for (long i = 1; i <= 100; i++) values.push_back(i);
+
+  GritVM vm;
+  auto buffer = std::make_shared<BufferInput>(values);
+  vm.setInput(buffer);
+  REQUIRE(vm.load("input_test.gvm", { 0 }) == READY);
+  REQUIRE(vm.run() == HALTED);
+  REQUIRE(vm.getAccumulator() == 5050);
+  REQUIRE(vm.getDataMem() == std::vector<long>{ 5050 });
+  REQUIRE(buffer->consumed() == 100);
+
+  // The end-of-input edge makes the loop a loop with an exit
+  std::vector<Instruction> program;
+  std::istringstream text("INPUT 4\nADDMEM 0\nSET 0\nJUMPREL -3\nAT 0\n");
+  REQUIRE(GVMHelper::parseProgram(text, program));
+  GVMView<Instruction> code(program.data(), program.size());
+  REQUIRE(GVMAnalysis::blockLeaders(code) == std::vector<bool>{ true, true, false, false, true });
+  REQUIRE(GVMAnalysis::findLoops(code).size() == 1);
+  std::vector<Instruction> optimized;
+  REQUIRE_FALSE(GVMOptimize::optimize(code, optimized));
+
+  // A stream is read a word at a time and ends at the first word that is not a number
+  std::istringstream words("3 4\n5 x 9");
+  vm.reset();
+  vm.setInput(std::make_shared<StreamInput>(words));
+  REQUIRE(vm.load("input_test.gvm", { 0 }) == READY);
+  REQUIRE(vm.run() == HALTED);
+  REQUIRE(vm.getAccumulator() == 12);
+
+  // With INPUT 0 the end of input halts there, and no source is an empty one
+  std::ofstream("input_test.gvm") << "INPUT 0\nADDMEM 0\nSET 0\nJUMPREL -3\n";
+  vm.reset();
+  vm.setInput(nullptr);
+  REQUIRE(vm.load("input_test.gvm", { 7 }) == READY);
+  REQUIRE(vm.run() == HALTED);
+  REQUIRE(vm.getPc() == 0);
+  REQUIRE(vm.getAccumulator() == 0);
+
+  // A producer thread feeds more values through a small ring buffer than it
+  // holds; tiering stays out of the way of a program that reads input
+  auto ring = std::make_shared<RingBufferInput>(16);
+  std::thread producer([ring]() {
+    for (long i = 1; i <= 10000; i++) ring->push(i);
+    ring->close();
+  });
+  vm.reset();
+  vm.setTiering(100);
+  vm.setInput(ring);
+  REQUIRE(vm.load("input_test.gvm", { 0 }) == READY);
+  REQUIRE(vm.run() == HALTED);
+  producer.join();
+  REQUIRE(vm.getDataMem() == std::vector<long>{ 50005000 });
+  REQUIRE_FALSE(ring->push(1));
+  std::remove("input_test.gvm");
+}